@@ -77,53 +77,69 @@ void wait_until_done_or_force_detached(struct drbd_device *device, struct drbd_b
 	}
 }
 
-static int _drbd_md_sync_page_io(struct drbd_device *device,
-				 struct drbd_backing_dev *bdev,
-				 sector_t sector, int op)
+/* Submits one meta data IO of device->md_io.page, or an empty flush. The
+ * caller waits for device->md_io.done, and puts the returned bio. */
+static struct bio *md_page_io_submit(struct drbd_device *device,
+				     struct drbd_backing_dev *bdev,
+				     sector_t sector, int op, int op_flags)
 {
 	struct bio *bio;
 	/* we do all our meta data IO in aligned 4k blocks. */
 	const int size = 4096;
-	int err, op_flags = 0;
 
-	if ((op == REQ_OP_WRITE) && !test_bit(MD_NO_FUA, &device->flags))
-		op_flags |= REQ_FUA | REQ_PREFLUSH;
 	op_flags |= REQ_META | REQ_SYNC;
 
 	device->md_io.done = 0;
 	device->md_io.error = -ENODEV;
 
-	bio = bio_alloc_bioset(bdev->md_bdev, 1, op | op_flags,
+	bio = bio_alloc_bioset(bdev->md_bdev, op == REQ_OP_FLUSH ? 0 : 1, op | op_flags,
 		GFP_NOIO, &drbd_md_io_bio_set);
 	bio->bi_iter.bi_sector = sector;
-	err = -EIO;
-	if (bio_add_page(bio, device->md_io.page, size, 0) != size)
-		goto out;
+	if (op != REQ_OP_FLUSH && bio_add_page(bio, device->md_io.page, size, 0) != size) {
+		bio_put(bio);
+		return ERR_PTR(-EIO);
+	}
 	bio->bi_private = device;
 	bio->bi_end_io = drbd_md_endio;
 
-	if (op != REQ_OP_WRITE && device->disk_state[NOW] == D_DISKLESS && device->ldev == NULL)
+	if (op == REQ_OP_READ && device->disk_state[NOW] == D_DISKLESS && device->ldev == NULL)
 		/* special case, drbd_md_read() during drbd_adm_attach(): no get_ldev */
 		;
 	else if (!get_ldev_if_state(device, D_ATTACHING)) {
 		/* Corresponding put_ldev in drbd_md_endio() */
 		drbd_err(device, "ASSERT FAILED: get_ldev_if_state() == 1 in _drbd_md_sync_page_io()\n");
-		err = -ENODEV;
-		goto out;
+		bio_put(bio);
+		return ERR_PTR(-ENODEV);
 	}
 
 	bio_get(bio); /* one bio_put() is in the completion handler */
 	atomic_inc(&device->md_io.in_use); /* drbd_md_put_buffer() is in the completion handler */
 	device->md_io.submit_jif = jiffies;
-	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
+	if (drbd_insert_fault(device, (op != REQ_OP_READ) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
 		bio->bi_status = BLK_STS_IOERR;
 		bio_endio(bio);
 	} else {
 		submit_bio(bio);
 	}
+	return bio;
+}
+
+static int _drbd_md_sync_page_io(struct drbd_device *device,
+				 struct drbd_backing_dev *bdev,
+				 sector_t sector, int op)
+{
+	struct bio *bio;
+	int err, op_flags = 0;
+
+	if ((op == REQ_OP_WRITE) && !test_bit(MD_NO_FUA, &device->flags))
+		op_flags |= REQ_FUA | REQ_PREFLUSH;
+
+	bio = md_page_io_submit(device, bdev, sector, op, op_flags);
+	if (IS_ERR(bio))
+		return PTR_ERR(bio);
+
 	wait_until_done_or_force_detached(device, bdev, &device->md_io.done);
 	err = device->md_io.error;
- out:
 	bio_put(bio);
 	return err;
 }
@@ -171,53 +187,442 @@ struct get_activity_log_ref_ctx {
 	bool wake_up;
 };
 
+/* The resync extents activity log extent @enr overlaps with. Activity log
+ * extents larger than BM_EXT_SIZE cover several. */
+static void al_extent_to_rs_extents(struct drbd_device *device, unsigned int enr,
+				    unsigned int *first, unsigned int *last)
+{
+	sector_t sector = (sector_t)enr << (device->al_extent_shift - 9);
+
+	*first = BM_SECT_TO_EXT(sector);
+	*last = BM_SECT_TO_EXT(sector + (1 << (device->al_extent_shift - 9)) - 1);
+}
+
+/* Application IO waits for resync extent @bm_ext: resync should finish or
+ * step aside there. rs_prio_count counts the extents of @peer_device marked
+ * so, which lets drbd_sector_has_priority() skip the al_lock while there are
+ * none. Both are changed with al_lock held. */
+static bool rs_prio_add(struct drbd_peer_device *peer_device, struct bm_extent *bm_ext)
+{
+	if (test_and_set_bit(BME_PRIORITY, &bm_ext->flags))
+		return false;
+	WRITE_ONCE(peer_device->rs_prio_count, peer_device->rs_prio_count + 1);
+	return true;
+}
+
+static void rs_prio_release(struct drbd_peer_device *peer_device, struct bm_extent *bm_ext)
+{
+	if (test_and_clear_bit(BME_PRIORITY, &bm_ext->flags))
+		WRITE_ONCE(peer_device->rs_prio_count, peer_device->rs_prio_count - 1);
+}
+
 static struct bm_extent*
 find_active_resync_extent(struct get_activity_log_ref_ctx *al_ctx)
 {
 	struct drbd_peer_device *peer_device;
 	struct lc_element *tmp;
+	unsigned int rs_enr, first, last;
 
+	al_extent_to_rs_extents(al_ctx->device, al_ctx->enr, &first, &last);
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, al_ctx->device) {
-		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
-		if (unlikely(tmp != NULL)) {
-			struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
-			if (test_bit(BME_NO_WRITES, &bm_ext->flags)) {
-				if (peer_device->resync_wenr == tmp->lc_number) {
-					peer_device->resync_wenr = LC_FREE;
-					if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
-						bm_ext->flags = 0;
-						al_ctx->wake_up = true;
-						peer_device->resync_locked--;
-						continue;
-					}
+		for (rs_enr = first; rs_enr <= last; rs_enr++) {
+			struct bm_extent *bm_ext;
+
+			tmp = lc_find(peer_device->resync_lru, rs_enr);
+			if (likely(tmp == NULL))
+				continue;
+			bm_ext = lc_entry(tmp, struct bm_extent, lce);
+			if (!test_bit(BME_NO_WRITES, &bm_ext->flags))
+				continue;
+			if (peer_device->resync_wenr == tmp->lc_number) {
+				peer_device->resync_wenr = LC_FREE;
+				if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
+					rs_prio_release(peer_device, bm_ext);
+					bm_ext->flags = 0;
+					al_ctx->wake_up = true;
+					peer_device->resync_locked--;
+					continue;
 				}
-				rcu_read_unlock();
-				return bm_ext;
 			}
+			rcu_read_unlock();
+			return bm_ext;
 		}
 	}
 	rcu_read_unlock();
 	return NULL;
 }
 
-void
-set_bme_priority(struct get_activity_log_ref_ctx *al_ctx)
+static void
+set_rs_priority(struct get_activity_log_ref_ctx *al_ctx)
 {
 	struct drbd_peer_device *peer_device;
 	struct lc_element *tmp;
+	unsigned int rs_enr, first, last;
 
+	al_extent_to_rs_extents(al_ctx->device, al_ctx->enr, &first, &last);
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, al_ctx->device) {
-		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
-		if (tmp) {
-			struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
-			if (test_bit(BME_NO_WRITES, &bm_ext->flags)
-			&& !test_and_set_bit(BME_PRIORITY, &bm_ext->flags))
-				al_ctx->wake_up = true;
+		for (rs_enr = first; rs_enr <= last; rs_enr++) {
+			tmp = lc_find(peer_device->resync_lru, rs_enr);
+			if (tmp) {
+				struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
+				if (test_bit(BME_NO_WRITES, &bm_ext->flags)
+				&& rs_prio_add(peer_device, bm_ext))
+					al_ctx->wake_up = true;
+			}
+		}
+	}
+	rcu_read_unlock();
+}
+
+/**
+ * drbd_al_policy_init() - Reset the replacement policy state for a new activity log
+ * @device:	DRBD device.
+ *
+ * Caller holds al_lock, and has set up device->act_log and al_policy.ghost.
+ */
+void drbd_al_policy_init(struct drbd_device *device)
+{
+	struct drbd_al_policy *pol = &device->al_policy;
+	struct lru_cache *al = device->act_log;
+	int i;
+
+	INIT_LIST_HEAD(&pol->a1in);
+	INIT_LIST_HEAD(&pol->am);
+	pol->a1in_len = 0;
+	pol->ghost_size = max(al->nr_elements / 2, 1U);
+	pol->ghost_slot = (struct hlist_head *)(pol->ghost + pol->ghost_size);
+	pol->ghost_next = 0;
+	for (i = 0; i < pol->ghost_size; i++) {
+		INIT_HLIST_NODE(&pol->ghost[i].colision);
+		pol->ghost[i].enr = LC_FREE;
+		INIT_HLIST_HEAD(&pol->ghost_slot[i]);
+	}
+
+	for (i = 0; i < DRBD_AL_STREAMS; i++)
+		device->al_prefetch.stream_next[i] = LC_FREE;
+	device->al_prefetch.n_held = 0;
+
+	for (i = 0; i < al->nr_elements; i++) {
+		struct al_extent *ext = lc_entry(lc_element_by_index(al, i), struct al_extent, lce);
+
+		INIT_LIST_HEAD(&ext->policy_list);
+		ext->policy_enr = LC_FREE;
+		ext->policy_am = false;
+	}
+}
+
+static struct hlist_head *al_policy_ghost_slot(struct drbd_al_policy *pol, unsigned int enr)
+{
+	return pol->ghost_slot + (enr % pol->ghost_size);
+}
+
+/* Remembers @enr in the ring, forgetting the oldest entry there. */
+static void al_policy_ghost_add(struct drbd_al_policy *pol, unsigned int enr)
+{
+	struct drbd_al_ghost *g = &pol->ghost[pol->ghost_next];
+
+	hlist_del_init(&g->colision);
+	g->enr = enr;
+	hlist_add_head(&g->colision, al_policy_ghost_slot(pol, enr));
+	pol->ghost_next = (pol->ghost_next + 1) % pol->ghost_size;
+}
+
+static bool al_policy_ghost_remove(struct drbd_al_policy *pol, unsigned int enr)
+{
+	struct drbd_al_ghost *g;
+
+	hlist_for_each_entry(g, al_policy_ghost_slot(pol, enr), colision) {
+		if (g->enr == enr) {
+			hlist_del_init(&g->colision);
+			g->enr = LC_FREE;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void al_policy_forget(struct drbd_device *device, struct lc_element *e)
+{
+	struct al_extent *ext = lc_entry(e, struct al_extent, lce);
+
+	if (!ext->policy_am && !list_empty(&ext->policy_list))
+		device->al_policy.a1in_len--;
+	list_del_init(&ext->policy_list);
+	ext->policy_enr = LC_FREE;
+}
+
+/* Called with al_lock held for every reference lc_get() and friends hand out.
+ * Seeing a new extent number in a slot means the old one was evicted. */
+static void al_policy_account(struct drbd_device *device, struct lc_element *e)
+{
+	struct drbd_al_policy *pol = &device->al_policy;
+	struct al_extent *ext = lc_entry(e, struct al_extent, lce);
+	unsigned int policy = min_t(unsigned int, READ_ONCE(drbd_al_policy), AL_POLICY_NR - 1);
+
+	if (ext->policy_enr == e->lc_new_number) {
+		pol->hits[policy]++;
+		/* 2Q: references while in a1in are correlated, do not count */
+		if (ext->policy_am)
+			list_move(&ext->policy_list, &pol->am);
+		return;
+	}
+
+	pol->misses[policy]++;
+	if (ext->policy_enr != LC_FREE) {
+		pol->evictions[policy]++;
+		if (!ext->policy_am)
+			al_policy_ghost_add(pol, ext->policy_enr);
+	}
+	al_policy_forget(device, e);
+
+	ext->policy_enr = e->lc_new_number;
+	ext->policy_am = al_policy_ghost_remove(pol, ext->policy_enr);
+	if (ext->policy_am) {
+		pol->ghost_hits++;
+		list_add(&ext->policy_list, &pol->am);
+	} else {
+		list_add(&ext->policy_list, &pol->a1in);
+		pol->a1in_len++;
+	}
+}
+
+/* Extents still in use, near the end of @queue, go back to its head: they
+ * have just been referenced, and are not walked over again on the next
+ * miss. */
+static struct al_extent *al_policy_oldest_unused(struct list_head *queue)
+{
+	struct al_extent *ext, *tmp;
+	LIST_HEAD(busy);
+
+	list_for_each_entry_safe_reverse(ext, tmp, queue, policy_list) {
+		struct lc_element *e = &ext->lce;
+
+		/* on the lru list of the lru_cache */
+		if (e->refcnt == 0 && e->lc_number == e->lc_new_number && e->lc_number != LC_FREE) {
+			list_splice(&busy, queue);
+			return ext;
 		}
+		list_move_tail(&ext->policy_list, &busy);
+	}
+	list_splice(&busy, queue);
+	return NULL;
+}
+
+/* lc_get() recycles the unused element at the tail of the lru list. With 2Q,
+ * put the one to recycle there first: extents seen only once (a1in) go first
+ * once they take more than a quarter of the activity log, so that a
+ * sequential scan cannot displace the extents referenced repeatedly (am).
+ * Nothing to do if @enr is cached already, or a free element is left.
+ * Caller holds al_lock. */
+static void al_policy_pick_victim(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_al_policy *pol = &device->al_policy;
+	struct lru_cache *al = device->act_log;
+	struct al_extent *victim = NULL;
+
+	if (READ_ONCE(drbd_al_policy) != AL_POLICY_2Q)
+		return;
+	if (!list_empty(&al->free) || lc_find(al, enr))
+		return;
+
+	if (pol->a1in_len > al->nr_elements / 4)
+		victim = al_policy_oldest_unused(&pol->a1in);
+	if (!victim)
+		victim = al_policy_oldest_unused(&pol->am);
+	if (!victim)
+		victim = al_policy_oldest_unused(&pol->a1in);
+	if (victim)
+		list_move_tail(&victim->lce.list, &al->lru);
+}
+
+/* Extents activated by a pipelined transaction must not be used before it is
+ * on disk, see drbd_al_commit_pipelined(). Caller holds al_lock. */
+static bool al_extent_in_flight(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_al_pipe *pipe = &device->al_pipe;
+	int i, j;
+
+	if (!pipe->in_flight)
+		return false;
+	for (i = 0; i < DRBD_AL_PIPE_DEPTH; i++) {
+		struct drbd_al_pipe_slot *slot = &pipe->slot[i];
+
+		for (j = 0; j < slot->n_extents; j++) {
+			if (slot->extents[j] == enr)
+				return true;
+		}
+	}
+	return false;
+}
+
+/* References on busy extents are counted per CPU, so that the fast path and
+ * drbd_al_complete_io() need not take the al_lock for them.
+ *
+ * An extent is made "hot" when the fast path found it committed, and it gets
+ * one of the DRBD_AL_HOT_SLOTS. The slot holds an lc reference on it, so the
+ * lru_cache keeps seeing it as in use. While hot, references are taken and
+ * dropped on this CPU's counter for the slot, under rcu_read_lock() only.
+ *
+ * Anything that needs the real refcount first has to make it cold again:
+ * resync wanting the area, the activity log running out of unused extents,
+ * and shrinking or destroying it. Cold extents are "draining" until an RCU
+ * grace period has passed. Then the counters are folded into the lc refcount
+ * and the slot's reference is dropped, see al_hot_fold(). Until then, puts of
+ * that extent go to the counters as well, so the lc refcount cannot drop to
+ * zero while some of the references are still counted elsewhere.
+ */
+static struct drbd_al_hot *al_hot_slot(struct drbd_device *device, unsigned int enr)
+{
+	return &device->al_hot[enr % DRBD_AL_HOT_SLOTS];
+}
+
+static bool al_hot_get(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_al_hot *h = al_hot_slot(device, enr);
+	bool got = false;
+
+	rcu_read_lock();
+	if (smp_load_acquire(&h->hot) && READ_ONCE(h->enr) == enr) {
+		this_cpu_inc(device->al_hot_refs->refs[h - device->al_hot]);
+		got = true;
 	}
 	rcu_read_unlock();
+	return got;
+}
+
+static bool al_hot_put(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_al_hot *h = al_hot_slot(device, enr);
+	bool put = false;
+
+	rcu_read_lock();
+	if (smp_load_acquire(&h->hot) && READ_ONCE(h->enr) == enr) {
+		this_cpu_dec(device->al_hot_refs->refs[h - device->al_hot]);
+		put = true;
+	}
+	rcu_read_unlock();
+	return put;
+}
+
+/* Caller holds al_lock, and a reference on the committed extent @e */
+static void al_hot_promote(struct drbd_device *device, struct lc_element *e)
+{
+	struct drbd_al_hot *h = al_hot_slot(device, e->lc_number);
+
+	if (!drbd_al_percpu_refs || h->e)
+		return;
+	/* not while it is shrunk or starving */
+	if (device->act_log->flags & (LC_LOCKED | LC_STARVING))
+		return;
+
+	e->refcnt++;
+	h->e = e;
+	WRITE_ONCE(h->enr, e->lc_number);
+	smp_store_release(&h->hot, true);
+}
+
+static void al_hot_fold(struct rcu_head *rcu)
+{
+	struct drbd_al_hot *h = container_of(rcu, struct drbd_al_hot, rcu);
+	struct drbd_device *device = h->device;
+	int idx = h - device->al_hot;
+	unsigned long flags;
+	long sum = 0;
+	int cpu;
+
+	spin_lock_irqsave(&device->al_lock, flags);
+	for_each_possible_cpu(cpu) {
+		long *refs = &per_cpu_ptr(device->al_hot_refs, cpu)->refs[idx];
+
+		sum += *refs;
+		*refs = 0;
+	}
+	/* never drops to zero here, the slot still holds its reference */
+	h->e->refcnt = h->e->refcnt + sum;
+	lc_put(device->act_log, h->e);
+	h->e = NULL;
+	h->draining = false;
+	WRITE_ONCE(h->enr, LC_FREE);
+	spin_unlock_irqrestore(&device->al_lock, flags);
+	wake_up(&device->al_wait);
+}
+
+/* Caller holds al_lock */
+static void al_hot_demote(struct drbd_al_hot *h)
+{
+	if (!h->hot)
+		return;
+	WRITE_ONCE(h->hot, false);
+	h->draining = true;
+	call_rcu(&h->rcu, al_hot_fold);
+}
+
+static void al_hot_demote_all(struct drbd_device *device)
+{
+	int i;
+
+	for (i = 0; i < DRBD_AL_HOT_SLOTS; i++)
+		al_hot_demote(&device->al_hot[i]);
+}
+
+/* Caller holds al_lock. Resync is about to lock the resync extent @rs_enr. */
+static void al_hot_demote_rs_extent(struct drbd_device *device, unsigned int rs_enr)
+{
+	unsigned int shift = device->al_extent_shift - AL_EXTENT_SHIFT;
+	unsigned int first = (rs_enr * AL_EXT_PER_BM_SECT) >> shift;
+	unsigned int last = (rs_enr * AL_EXT_PER_BM_SECT + AL_EXT_PER_BM_SECT - 1) >> shift;
+	unsigned int enr;
+
+	for (enr = first; enr <= last; enr++) {
+		struct drbd_al_hot *h = al_hot_slot(device, enr);
+
+		if (h->e && h->enr == enr)
+			al_hot_demote(h);
+	}
+}
+
+/* Make all extents cold. Their counters are folded back after a grace period */
+void drbd_al_hot_demote(struct drbd_device *device)
+{
+	spin_lock_irq(&device->al_lock);
+	al_hot_demote_all(device);
+	spin_unlock_irq(&device->al_lock);
+}
+
+/* Make all extents cold, and wait until their counters are folded back */
+void drbd_al_hot_flush(struct drbd_device *device)
+{
+	drbd_al_hot_demote(device);
+	rcu_barrier();
+}
+
+/* Extents in use, not counting those that only a hot slot keeps active. For
+ * the congestion check, which is rare enough to sum up the counters of all
+ * CPUs. */
+unsigned int drbd_al_used_extents(struct drbd_device *device)
+{
+	unsigned long flags;
+	unsigned int used;
+	int i, cpu;
+
+	spin_lock_irqsave(&device->al_lock, flags);
+	used = device->act_log->used;
+	for (i = 0; i < DRBD_AL_HOT_SLOTS; i++) {
+		struct drbd_al_hot *h = &device->al_hot[i];
+		long refs = 0;
+
+		/* references other than the slot's are on the counters */
+		if (!h->e || h->e->refcnt != 1)
+			continue;
+		for_each_possible_cpu(cpu)
+			refs += per_cpu_ptr(device->al_hot_refs, cpu)->refs[i];
+		if (refs == 0)
+			used--;
+	}
+	spin_unlock_irqrestore(&device->al_lock, flags);
+	return used;
 }
 
 static
@@ -230,13 +635,24 @@ struct lc_element *__al_get(struct get_activity_log_ref_ctx *al_ctx)
 	spin_lock_irq(&device->al_lock);
 	bm_ext = find_active_resync_extent(al_ctx);
 	if (bm_ext) {
-		set_bme_priority(al_ctx);
+		set_rs_priority(al_ctx);
 		goto out;
 	}
+	if (al_extent_in_flight(device, al_ctx->enr))
+		goto out;
 	if (al_ctx->nonblock)
 		al_ext = lc_try_get(device->act_log, al_ctx->enr);
-	else
+	else {
+		al_policy_pick_victim(device, al_ctx->enr);
 		al_ext = lc_get(device->act_log, al_ctx->enr);
+		if (!al_ext)
+			al_hot_demote_all(device);
+	}
+	if (al_ext) {
+		al_policy_account(device, al_ext);
+		if (al_ctx->nonblock)
+			al_hot_promote(device, al_ext);
+	}
  out:
 	spin_unlock_irq(&device->al_lock);
 	if (al_ctx->wake_up)
@@ -307,8 +723,8 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 {
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first = i->sector >> (device->al_extent_shift - 9);
+	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift - 9);
 
 	D_ASSERT(device, first <= last);
 	D_ASSERT(device, atomic_read(&device->local_cnt) > 0);
@@ -320,10 +736,12 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 	if (first != last)
 		return false;
 
+	if (al_hot_get(device, first))
+		return true;
 	return _al_get_nonblock(device, first) != NULL;
 }
 
-#if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT)
+#if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT) || BM_BLOCK_SHIFT_MAX > AL_EXTENT_SHIFT
 /* Currently BM_BLOCK_SHIFT, BM_EXT_SHIFT and AL_EXTENT_SHIFT
  * are still coupled, or assume too much about their relation.
  * Code below will not work if this is violated.
@@ -332,9 +750,16 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 # error FIXME
 #endif
 
-static unsigned long al_extent_to_bm_bit(unsigned int al_enr)
+static unsigned long al_extent_to_bm_bit(struct drbd_device *device, unsigned int al_enr)
+{
+	return (unsigned long)al_enr << (device->al_extent_shift - device->bitmap->bm_block_shift);
+}
+
+/* Number of on-disk (4M) activity log extents one extent of act_log is
+ * recorded as. */
+static unsigned int al_disk_extents_per_extent(struct drbd_device *device)
 {
-	return (unsigned long)al_enr << (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT);
+	return 1U << (device->al_extent_shift - AL_EXTENT_SHIFT);
 }
 
 static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
@@ -355,15 +780,161 @@ static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
 	return device->ldev->md.md_offset + device->ldev->md.al_offset + t;
 }
 
-static int __al_write_transaction(struct drbd_device *device, struct al_transaction_on_disk *buffer)
+struct al_group_member {
+	struct list_head list;
+	struct drbd_device *device;
+	sector_t sector;
+	struct bio *bio;
+	/* member whose flush also covers our meta data device, or NULL */
+	struct al_group_member *flushed_by;
+	int err;
+	bool done;
+};
+
+/* Writes the activity log transactions of a batch of volumes. Instead of one
+ * PREFLUSH|FUA write each, one flush per meta data device makes the bitmap
+ * pages they wrote before stable, then all transactions go out in parallel
+ * with FUA. The flushes of different meta data devices are submitted
+ * together as well, and only then waited for. */
+static void al_group_write(struct list_head *batch)
+{
+	struct al_group_member *m, *o;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	list_for_each_entry(m, batch, list) {
+		struct drbd_device *device = m->device;
+
+		m->bio = NULL;
+		m->flushed_by = NULL;
+		m->err = 0;
+		if (test_bit(MD_NO_FUA, &device->flags))
+			continue;
+		list_for_each_entry(o, batch, list) {
+			if (o == m)
+				break;
+			if (!test_bit(MD_NO_FUA, &o->device->flags) &&
+			    o->device->ldev->md_bdev == device->ldev->md_bdev) {
+				m->flushed_by = o->flushed_by ?: o;
+				break;
+			}
+		}
+		if (m->flushed_by)
+			continue;
+		m->bio = md_page_io_submit(device, device->ldev, 0,
+					   REQ_OP_FLUSH, REQ_PREFLUSH);
+		if (IS_ERR(m->bio)) {
+			m->err = PTR_ERR(m->bio);
+			m->bio = NULL;
+		}
+	}
+	blk_finish_plug(&plug);
+
+	list_for_each_entry(m, batch, list) {
+		struct drbd_device *device = m->device;
+
+		if (!m->bio)
+			continue;
+		wait_until_done_or_force_detached(device, device->ldev, &device->md_io.done);
+		m->err = device->md_io.error;
+		bio_put(m->bio);
+		m->bio = NULL;
+	}
+
+	/* flushed together with an earlier volume */
+	list_for_each_entry(m, batch, list) {
+		if (m->flushed_by)
+			m->err = m->flushed_by->err;
+	}
+
+	blk_start_plug(&plug);
+	list_for_each_entry(m, batch, list) {
+		struct drbd_device *device = m->device;
+
+		if (m->err)
+			continue;
+		m->bio = md_page_io_submit(device, device->ldev, m->sector, REQ_OP_WRITE,
+					   test_bit(MD_NO_FUA, &device->flags) ? 0 : REQ_FUA);
+		if (IS_ERR(m->bio)) {
+			m->err = PTR_ERR(m->bio);
+			m->bio = NULL;
+		}
+	}
+	blk_finish_plug(&plug);
+
+	list_for_each_entry(m, batch, list) {
+		struct drbd_device *device = m->device;
+
+		if (!m->bio)
+			continue;
+		wait_until_done_or_force_detached(device, device->ldev, &device->md_io.done);
+		m->err = device->md_io.error;
+		bio_put(m->bio);
+	}
+}
+
+/* Commits the prepared transaction in device->md_io.page together with those
+ * of other volumes of the resource. Whoever finds no batch being written
+ * writes all that queued up meanwhile, the others wait for that. */
+static int al_group_commit(struct drbd_device *device, sector_t sector)
 {
+	struct drbd_al_group *grp = &device->resource->al_group;
+	struct al_group_member me = { .device = device, .sector = sector };
+	struct al_group_member *m, *tmp;
+	LIST_HEAD(batch);
+	unsigned int n;
+
+	spin_lock_irq(&grp->lock);
+	list_add_tail(&me.list, &grp->queued);
+	while (!me.done) {
+		if (grp->committing) {
+			spin_unlock_irq(&grp->lock);
+			wait_event(grp->wait, READ_ONCE(me.done) || !READ_ONCE(grp->committing));
+			spin_lock_irq(&grp->lock);
+			continue;
+		}
+
+		grp->committing = true;
+		list_splice_init(&grp->queued, &batch);
+		spin_unlock_irq(&grp->lock);
+
+		al_group_write(&batch);
+
+		spin_lock_irq(&grp->lock);
+		n = 0;
+		/* the others return as soon as they see done */
+		list_for_each_entry_safe(m, tmp, &batch, list) {
+			list_del(&m->list);
+			m->done = true;
+			n++;
+		}
+		grp->commits++;
+		grp->transactions += n;
+		grp->committing = false;
+		wake_up_all(&grp->wait);
+	}
+	spin_unlock_irq(&grp->lock);
+
+	return me.err;
+}
+
+static int al_commit_transaction(struct drbd_device *device, sector_t sector)
+{
+	if (READ_ONCE(drbd_al_group_commit))
+		return al_group_commit(device, sector);
+	return drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE);
+}
+
+/* Fills in the next transaction, and returns where it goes on disk. */
+static sector_t al_prepare_transaction(struct drbd_device *device,
+				       struct al_transaction_on_disk *buffer)
+{
+	const unsigned int f = al_disk_extents_per_extent(device);
+	const unsigned int nr_disk_extents = device->act_log->nr_elements * f;
 	struct lc_element *e;
-	sector_t sector;
-	int i, mx;
+	int i, j, mx;
 	unsigned extent_nr;
 	unsigned crc = 0;
-	int err = 0;
-	ktime_var_for_accounting(start_kt);
 
 	memset(buffer, 0, sizeof(*buffer));
 	buffer->magic = cpu_to_be32(DRBD_AL_MAGIC);
@@ -379,20 +950,22 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 	 * be in the process of changing it. */
 	spin_lock_irq(&device->al_lock);
 	list_for_each_entry(e, &device->act_log->to_be_changed, list) {
-		if (i == AL_UPDATES_PER_TRANSACTION) {
-			i++;
+		if (i + f > AL_UPDATES_PER_TRANSACTION) {
+			i = AL_UPDATES_PER_TRANSACTION + 1;
 			break;
 		}
-		buffer->update_slot_nr[i] = cpu_to_be16(e->lc_index);
-		buffer->update_extent_nr[i] = cpu_to_be32(e->lc_new_number);
+		for (j = 0; j < f; j++) {
+			buffer->update_slot_nr[i] = cpu_to_be16(e->lc_index * f + j);
+			buffer->update_extent_nr[i] = cpu_to_be32(e->lc_new_number * f + j);
+			i++;
+		}
 		if (e->lc_number != LC_FREE) {
 			unsigned long start, end;
 
-			start = al_extent_to_bm_bit(e->lc_number);
-			end = al_extent_to_bm_bit(e->lc_number + 1) - 1;
+			start = al_extent_to_bm_bit(device, e->lc_number);
+			end = al_extent_to_bm_bit(device, e->lc_number + 1) - 1;
 			drbd_bm_mark_range_for_writeout(device, start, end);
 		}
-		i++;
 	}
 	spin_unlock_irq(&device->al_lock);
 	BUG_ON(i > AL_UPDATES_PER_TRANSACTION);
@@ -403,28 +976,65 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		buffer->update_extent_nr[i] = cpu_to_be32(LC_FREE);
 	}
 
-	buffer->context_size = cpu_to_be16(device->act_log->nr_elements);
+	buffer->context_size = cpu_to_be16(nr_disk_extents);
 	buffer->context_start_slot_nr = cpu_to_be16(device->al_tr_cycle);
 
 	mx = min_t(int, AL_CONTEXT_PER_TRANSACTION,
-		   device->act_log->nr_elements - device->al_tr_cycle);
+		   nr_disk_extents - device->al_tr_cycle);
 	for (i = 0; i < mx; i++) {
 		unsigned idx = device->al_tr_cycle + i;
-		extent_nr = lc_element_by_index(device->act_log, idx)->lc_number;
+		extent_nr = lc_element_by_index(device->act_log, idx / f)->lc_number;
+		if (extent_nr != LC_FREE)
+			extent_nr = extent_nr * f + idx % f;
 		buffer->context[i] = cpu_to_be32(extent_nr);
 	}
 	for (; i < AL_CONTEXT_PER_TRANSACTION; i++)
 		buffer->context[i] = cpu_to_be32(LC_FREE);
 
 	device->al_tr_cycle += AL_CONTEXT_PER_TRANSACTION;
-	if (device->al_tr_cycle >= device->act_log->nr_elements)
+	if (device->al_tr_cycle >= nr_disk_extents)
 		device->al_tr_cycle = 0;
 
-	sector = al_tr_number_to_on_disk_sector(device);
-
 	crc = crc32c(0, buffer, 4096);
 	buffer->crc32c = cpu_to_be32(crc);
 
+	return al_tr_number_to_on_disk_sector(device);
+}
+
+/* With a sparse bitmap, the pages of the extents about to be activated have
+ * to be present before writes to them may set bits in atomic context. They
+ * stay while the extent is in the activity log. Called with the activity log
+ * locked for the transaction. */
+static void al_sparse_prepare(struct drbd_device *device)
+{
+	unsigned int enr[AL_UPDATES_PER_TRANSACTION];
+	struct lc_element *e;
+	int i, n = 0;
+
+	if (!(device->bitmap->bm_flags & BM_SPARSE))
+		return;
+
+	spin_lock_irq(&device->al_lock);
+	list_for_each_entry(e, &device->act_log->to_be_changed, list) {
+		if (n == AL_UPDATES_PER_TRANSACTION)
+			break;
+		enr[n++] = e->lc_new_number;
+	}
+	spin_unlock_irq(&device->al_lock);
+
+	for (i = 0; i < n; i++)
+		drbd_bm_sparse_prepare(device, al_extent_to_bm_bit(device, enr[i]),
+				       al_extent_to_bm_bit(device, enr[i] + 1) - 1);
+}
+
+static int __al_write_transaction(struct drbd_device *device, struct al_transaction_on_disk *buffer)
+{
+	sector_t sector;
+	int err = 0;
+	ktime_var_for_accounting(start_kt);
+
+	sector = al_prepare_transaction(device, buffer);
+
 	ktime_aggregate_delta(device, start_kt, al_before_bm_write_hinted_kt);
 	if (drbd_bm_write_hinted(device))
 		err = -EIO;
@@ -435,7 +1045,12 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 		rcu_read_unlock();
 		if (write_al_updates) {
 			ktime_aggregate_delta(device, start_kt, al_mid_kt);
-			if (drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE)) {
+			/* A dirty superblock goes out in parallel to the
+			 * transaction, with its own flush, instead of waiting
+			 * for md_sync_timer */
+			if (test_bit(MD_DIRTY, &device->flags))
+				drbd_md_sync_async(device);
+			if (al_commit_transaction(device, sector)) {
 				err = -EIO;
 				drbd_handle_io_error(device, DRBD_META_IO_ERROR);
 			} else {
@@ -505,6 +1120,19 @@ bool drbd_al_try_lock_for_transaction(struct drbd_device *device)
 {
 	bool locked;
 
+	spin_lock_irq(&device->al_lock);
+	/* A transaction written synchronously must not overtake pipelined ones */
+	locked = device->al_pipe.in_flight == 0 &&
+		lc_try_lock_for_transaction(device->act_log);
+	spin_unlock_irq(&device->al_lock);
+
+	return locked;
+}
+
+static bool al_try_lock_for_pipeline(struct drbd_device *device)
+{
+	bool locked;
+
 	spin_lock_irq(&device->al_lock);
 	locked = lc_try_lock_for_transaction(device->act_log);
 	spin_unlock_irq(&device->al_lock);
@@ -512,6 +1140,29 @@ bool drbd_al_try_lock_for_transaction(struct drbd_device *device)
 	return locked;
 }
 
+/* Drops the references al_prefetch() took, on those extents that have been
+ * committed by now. */
+static void al_put_prefetched(struct drbd_device *device)
+{
+	struct drbd_al_prefetch *pf = &device->al_prefetch;
+	bool wake = false;
+	int i, n = 0;
+
+	spin_lock_irq(&device->al_lock);
+	for (i = 0; i < pf->n_held; i++) {
+		struct lc_element *e = pf->held[i];
+
+		if (e->lc_number != e->lc_new_number)
+			pf->held[n++] = e;
+		else if (lc_put(device->act_log, e) == 0)
+			wake = true;
+	}
+	pf->n_held = n;
+	spin_unlock_irq(&device->al_lock);
+	if (wake)
+		wake_up(&device->al_wait);
+}
+
 void drbd_al_begin_io_commit(struct drbd_device *device)
 {
 	bool locked = false;
@@ -519,6 +1170,7 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 
 	if (drbd_md_dax_active(device->ldev)) {
 		drbd_dax_al_begin_io_commit(device);
+		al_put_prefetched(device);
 		return;
 	}
 
@@ -536,6 +1188,7 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 			write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
 			rcu_read_unlock();
 
+			al_sparse_prepare(device);
 			if (write_al_updates)
 				al_write_transaction(device);
 			spin_lock_irq(&device->al_lock);
@@ -549,6 +1202,204 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 		lc_unlock(device->act_log);
 		wake_up(&device->al_wait);
 	}
+	al_put_prefetched(device);
+}
+
+static void al_pipe_endio(struct bio *bio)
+{
+	struct drbd_al_pipe_slot *slot = bio->bi_private;
+	struct drbd_device *device = slot->device;
+	struct drbd_al_pipe *pipe = &device->al_pipe;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&device->al_lock, flags);
+	slot->error = blk_status_to_errno(bio->bi_status);
+	slot->state = AL_SLOT_DONE;
+	/* Transactions become durable in order. Only then may the extents
+	 * they activated be used. */
+	for (i = 0; i < pipe->used; i++) {
+		slot = &pipe->slot[(pipe->head + i) % DRBD_AL_PIPE_DEPTH];
+		if (slot->state == AL_SLOT_IN_FLIGHT)
+			break;
+		if (slot->state == AL_SLOT_DONE) {
+			slot->state = AL_SLOT_DURABLE;
+			slot->n_extents = 0;
+			pipe->in_flight--;
+		}
+	}
+	spin_unlock_irqrestore(&device->al_lock, flags);
+
+	bio_put(bio);
+	wake_up(&device->al_wait);
+	put_ldev(device);
+}
+
+/* Writes the transaction into a free pipeline slot, and commits it in memory
+ * without waiting for the write. Returns NULL if nothing was written. */
+static struct drbd_al_pipe_slot *al_write_transaction_pipelined(struct drbd_device *device)
+{
+	struct drbd_al_pipe *pipe = &device->al_pipe;
+	struct drbd_al_pipe_slot *slot;
+	struct lc_element *e;
+	struct bio *bio;
+	sector_t sector;
+	int op_flags = REQ_META | REQ_SYNC;
+
+	if (!get_ldev(device)) {
+		drbd_err(device, "disk is %s, cannot start al transaction\n",
+			drbd_disk_str(device->disk_state[NOW]));
+		return NULL;
+	}
+
+	/* The bitmap write may have failed, causing a state change. */
+	if (device->disk_state[NOW] < D_INCONSISTENT) {
+		drbd_err(device,
+			"disk is %s, cannot write al transaction\n",
+			drbd_disk_str(device->disk_state[NOW]));
+		goto out_put;
+	}
+
+	D_ASSERT(device, pipe->used < DRBD_AL_PIPE_DEPTH);
+	slot = &pipe->slot[(pipe->head + pipe->used) % DRBD_AL_PIPE_DEPTH];
+
+	al_sparse_prepare(device);
+
+	sector = al_prepare_transaction(device, page_address(slot->page));
+	if (drbd_bm_write_hinted(device))
+		goto out_put;
+
+	/* The PREFLUSH makes the bitmap pages written above stable */
+	if (!test_bit(MD_NO_FUA, &device->flags))
+		op_flags |= REQ_FUA | REQ_PREFLUSH;
+	bio = bio_alloc_bioset(device->ldev->md_bdev, 1, REQ_OP_WRITE | op_flags,
+			       GFP_NOIO, &drbd_md_io_bio_set);
+	bio->bi_iter.bi_sector = sector;
+	if (bio_add_page(bio, slot->page, 4096, 0) != 4096) {
+		bio_put(bio);
+		goto out_put;
+	}
+	bio->bi_private = slot;
+	bio->bi_end_io = al_pipe_endio;
+
+	spin_lock_irq(&device->al_lock);
+	slot->n_extents = 0;
+	list_for_each_entry(e, &device->act_log->to_be_changed, list) {
+		if (slot->n_extents == AL_UPDATES_PER_TRANSACTION)
+			break;
+		slot->extents[slot->n_extents++] = e->lc_new_number;
+	}
+	slot->state = AL_SLOT_IN_FLIGHT;
+	slot->error = 0;
+	pipe->used++;
+	pipe->in_flight++;
+	device->al_histogram[min_t(unsigned int, device->act_log->pending_changes,
+				   AL_UPDATES_PER_TRANSACTION)]++;
+	spin_unlock_irq(&device->al_lock);
+
+	device->al_tr_number++;
+	device->al_writ_cnt++;
+
+	/* put_ldev() is in al_pipe_endio() */
+	if (drbd_insert_fault(device, DRBD_FAULT_MD_WR))
+		bio_io_error(bio);
+	else
+		submit_bio(bio);
+	if (test_bit(MD_DIRTY, &device->flags))
+		drbd_md_sync_async(device);
+	return slot;
+
+out_put:
+	put_ldev(device);
+	return NULL;
+}
+
+/**
+ * drbd_al_commit_pipelined() - Commit pending activity log changes, without waiting for the write
+ * @device:	DRBD device.
+ *
+ * Like drbd_al_begin_io_commit(), but the next transaction may be prepared
+ * while this one is still being written. The extents it activates are kept
+ * from being used until it and all earlier ones are on disk.
+ *
+ * The caller makes sure that a pipeline slot is free. Returns the slot the
+ * requests waiting for this commit are to be queued on, or NULL if they may
+ * be submitted right away. They are handed back by drbd_al_pipe_reap().
+ */
+struct drbd_al_pipe_slot *drbd_al_commit_pipelined(struct drbd_device *device)
+{
+	struct drbd_al_pipe *pipe = &device->al_pipe;
+	struct drbd_al_pipe_slot *slot = NULL;
+	bool locked = false;
+
+	wait_event(device->al_wait,
+			device->act_log->pending_changes == 0 ||
+			(locked = al_try_lock_for_pipeline(device)));
+
+	if (locked) {
+		if (device->act_log->pending_changes) {
+			bool write_al_updates;
+
+			rcu_read_lock();
+			write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
+			rcu_read_unlock();
+
+			if (write_al_updates)
+				slot = al_write_transaction_pipelined(device);
+			spin_lock_irq(&device->al_lock);
+			lc_committed(device->act_log);
+			spin_unlock_irq(&device->al_lock);
+		}
+		lc_unlock(device->act_log);
+		wake_up(&device->al_wait);
+	}
+	al_put_prefetched(device);
+
+	/* The extents of these requests may be in a transaction in flight */
+	spin_lock_irq(&device->al_lock);
+	if (!slot && pipe->used)
+		slot = &pipe->slot[(pipe->head + pipe->used - 1) % DRBD_AL_PIPE_DEPTH];
+	spin_unlock_irq(&device->al_lock);
+
+	return slot;
+}
+
+/**
+ * drbd_al_pipe_reap() - Collect the requests of pipelined transactions that are on disk
+ * @device:		DRBD device.
+ * @peer_requests:	Peer requests to submit are added here.
+ * @requests:		Requests to submit are added here.
+ *
+ * Returns the number of transactions still in flight.
+ */
+unsigned int drbd_al_pipe_reap(struct drbd_device *device,
+			       struct list_head *peer_requests, struct list_head *requests)
+{
+	struct drbd_al_pipe *pipe = &device->al_pipe;
+	unsigned int used;
+	int err = 0;
+
+	spin_lock_irq(&device->al_lock);
+	while (pipe->used) {
+		struct drbd_al_pipe_slot *slot = &pipe->slot[pipe->head];
+
+		if (slot->state != AL_SLOT_DURABLE)
+			break;
+		list_splice_tail_init(&slot->peer_requests, peer_requests);
+		list_splice_tail_init(&slot->requests, requests);
+		if (!err)
+			err = slot->error;
+		slot->state = AL_SLOT_FREE;
+		pipe->head = (pipe->head + 1) % DRBD_AL_PIPE_DEPTH;
+		pipe->used--;
+	}
+	used = pipe->used;
+	spin_unlock_irq(&device->al_lock);
+
+	if (err)
+		drbd_handle_io_error(device, DRBD_META_IO_ERROR);
+
+	return used;
 }
 
 static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned int last)
@@ -559,8 +1410,18 @@ static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned
 	bool wake = false;
 
 	D_ASSERT(device, first <= last);
+	if (first == last && al_hot_put(device, first))
+		return false;
+
 	spin_lock_irqsave(&device->al_lock, flags);
 	for (enr = first; enr <= last; enr++) {
+		struct drbd_al_hot *h = al_hot_slot(device, enr);
+
+		if (h->e && h->enr == enr) {
+			/* hot or draining, see al_hot_fold() */
+			this_cpu_dec(device->al_hot_refs->refs[h - device->al_hot]);
+			continue;
+		}
 		extent = lc_find(device->act_log, enr);
 		if (!extent || extent->refcnt == 0) {
 			drbd_err(device, "al_complete_io() called on inactive extent %u\n", enr);
@@ -588,8 +1449,8 @@ int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_connection *connection = peer_device->connection;
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first = i->sector >> (device->al_extent_shift - 9);
+	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift - 9);
 	unsigned enr;
 	bool need_transaction = false;
 	long timeout = MAX_SCHEDULE_TIMEOUT;
@@ -637,14 +1498,71 @@ int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_
 
 }
 
+/* A writer that keeps missing in the activity log one extent after the other
+ * is taken to be sequential. It gets the next few extents activated in the
+ * transaction of its current miss, instead of stalling for one transaction
+ * at each extent boundary. Only spare update slots and unused elements are
+ * used, so this never makes the activity log starve. Caller holds al_lock. */
+static void al_prefetch(struct drbd_device *device, unsigned int first, unsigned int last)
+{
+	struct drbd_al_prefetch *pf = &device->al_prefetch;
+	struct lru_cache *al = device->act_log;
+	struct get_activity_log_ref_ctx al_ctx = { .device = device, };
+	unsigned int k = min_t(unsigned int, READ_ONCE(drbd_al_prefetch_extents),
+			       DRBD_AL_PREFETCH_MAX);
+	unsigned int nr_extents, enr;
+	int s;
+
+	if (!k)
+		return;
+
+	for (s = 0; s < DRBD_AL_STREAMS; s++) {
+		if (first <= pf->stream_next[s] && pf->stream_next[s] <= last)
+			break;
+	}
+	if (s == DRBD_AL_STREAMS) {
+		/* maybe the start of a new stream */
+		pf->stream_next[pf->stream_victim] = last + 1;
+		pf->stream_victim = (pf->stream_victim + 1) % DRBD_AL_STREAMS;
+		return;
+	}
+
+	nr_extents = (get_capacity(device->vdisk) + (1 << (device->al_extent_shift - 9)) - 1)
+		>> (device->al_extent_shift - 9);
+	for (enr = last + 1; enr <= last + k && enr < nr_extents; enr++) {
+		struct lc_element *e;
+
+		if (pf->n_held == DRBD_AL_PREFETCH_MAX ||
+		    al->pending_changes >= al->max_pending_changes / 2 ||
+		    (list_empty(&al->free) && list_empty(&al->lru)))
+			break;
+		al_ctx.enr = enr;
+		if (find_active_resync_extent(&al_ctx))
+			break;
+		if (lc_find(al, enr))
+			continue;
+
+		al_policy_pick_victim(device, enr);
+		e = lc_get_cumulative(al, enr);
+		if (!e)
+			break;
+		al_policy_account(device, e);
+		pf->held[pf->n_held++] = e;
+		pf->prefetched++;
+	}
+	pf->stream_next[s] = enr;
+	if (al_ctx.wake_up)
+		wake_up(&device->al_wait);
+}
+
 int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *i)
 {
 	struct lru_cache *al = device->act_log;
 	struct bm_extent *bm_ext;
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first = i->sector >> (device->al_extent_shift - 9);
+	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift - 9);
 	unsigned nr_al_extents;
 	unsigned available_update_slots;
 	struct get_activity_log_ref_ctx al_ctx = { .device = device, };
@@ -668,8 +1586,10 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 		 * If we cannot get even a single pending change through,
 		 * stop the fast path until we made some progress,
 		 * or requests to "cold" extents could be starved. */
-		if (!al->pending_changes)
+		if (!al->pending_changes) {
 			set_bit(__LC_STARVING, &device->act_log->flags);
+			al_hot_demote_all(device);
+		}
 		return -ENOBUFS;
 	}
 
@@ -678,7 +1598,7 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 		al_ctx.enr = enr;
 		bm_ext = find_active_resync_extent(&al_ctx);
 		if (unlikely(bm_ext != NULL)) {
-			set_bme_priority(&al_ctx);
+			set_rs_priority(&al_ctx);
 			if (al_ctx.wake_up)
 				return -EBUSY;
 			return -EWOULDBLOCK;
@@ -690,10 +1610,14 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 	 * this has to be successful. */
 	for (enr = first; enr <= last; enr++) {
 		struct lc_element *al_ext;
+		al_policy_pick_victim(device, enr);
 		al_ext = lc_get_cumulative(device->act_log, enr);
 		if (!al_ext)
 			drbd_err(device, "LOGIC BUG for enr=%u\n", enr);
+		else
+			al_policy_account(device, al_ext);
 	}
+	al_prefetch(device, first, last);
 	return 0;
 }
 
@@ -703,8 +1627,8 @@ bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i)
 {
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
-	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned first = i->sector >> (device->al_extent_shift - 9);
+	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift - 9);
 
 	return put_actlog(device, first, last);
 }
@@ -715,13 +1639,110 @@ static int _try_lc_del(struct drbd_device *device, struct lc_element *al_ext)
 
 	spin_lock_irq(&device->al_lock);
 	rv = (al_ext->refcnt == 0);
-	if (likely(rv))
+	if (likely(rv)) {
+		al_policy_forget(device, al_ext);
 		lc_del(device->act_log, al_ext);
+	}
 	spin_unlock_irq(&device->al_lock);
 
 	return rv;
 }
 
+/**
+ * drbd_al_save_hints() - Remember the extents of the activity log
+ * @device:	DRBD device.
+ *
+ * Called when the device is demoted, and before the activity log is destroyed
+ * on detach. Those in use first, then the unused ones from the most recently
+ * used on. drbd_al_warm() uses them to warm up the activity log when it is
+ * promoted again, possibly after a new attach. While secondary, the activity
+ * log only follows the writes of a peer, so it is not snapshotted again then.
+ * The hints are kept in memory only, they do not survive a reboot.
+ */
+void drbd_al_save_hints(struct drbd_device *device)
+{
+	struct drbd_al_hints *hints = &device->al_hints;
+	struct lru_cache *al = device->act_log;
+	struct list_head *lists[2];
+	struct lc_element *e;
+	unsigned int shift;
+	int i;
+
+	if (!al)
+		return;
+
+	/* in_use first, then lru, which lc_get() keeps most recently used first */
+	lists[0] = &al->in_use;
+	lists[1] = &al->lru;
+	spin_lock_irq(&device->al_lock);
+	shift = device->al_extent_shift - AL_EXTENT_SHIFT;
+	hints->n = 0;
+	for (i = 0; i < ARRAY_SIZE(lists); i++) {
+		list_for_each_entry(e, lists[i], list) {
+			if (hints->n == DRBD_AL_HINTS_MAX)
+				goto out;
+			hints->enr[hints->n++] = e->lc_number << shift;
+		}
+	}
+out:
+	spin_unlock_irq(&device->al_lock);
+}
+
+/**
+ * drbd_al_warm() - Activate the extents remembered by drbd_al_save_hints()
+ * @device:	DRBD device.
+ *
+ * Activates up to drbd_al_warm_extents of them in a single transaction,
+ * skipping those that are already there or that resync has locked, so that
+ * the first writes after a failover do not each have to wait for one.
+ * Only free elements of the activity log are used, so that warming up never
+ * evicts an extent that writes since the attach or promotion brought in.
+ * Caller holds a reference on ldev.
+ */
+void drbd_al_warm(struct drbd_device *device)
+{
+	struct drbd_al_hints *hints = &device->al_hints;
+	struct lc_element *got[DRBD_AL_HINTS_MAX];
+	struct get_activity_log_ref_ctx al_ctx = { .device = device, };
+	unsigned int max = min_t(unsigned int, drbd_al_warm_extents, DRBD_AL_HINTS_MAX);
+	unsigned int shift = device->al_extent_shift - AL_EXTENT_SHIFT;
+	unsigned int i, n = 0;
+
+	if (!max || !hints->n)
+		return;
+
+	spin_lock_irq(&device->al_lock);
+	for (i = 0; i < hints->n && n < max; i++) {
+		struct lc_element *e;
+
+		if (list_empty(&device->act_log->free))
+			break;
+		al_ctx.enr = hints->enr[i] >> shift;
+		if (lc_find(device->act_log, al_ctx.enr) ||
+		    find_active_resync_extent(&al_ctx) ||
+		    al_extent_in_flight(device, al_ctx.enr))
+			continue;
+		e = lc_get(device->act_log, al_ctx.enr);
+		if (!e)
+			break;
+		al_policy_account(device, e);
+		got[n++] = e;
+	}
+	spin_unlock_irq(&device->al_lock);
+
+	if (n)
+		drbd_al_begin_io_commit(device);
+
+	spin_lock_irq(&device->al_lock);
+	for (i = 0; i < n; i++)
+		lc_put(device->act_log, got[i]);
+	spin_unlock_irq(&device->al_lock);
+	wake_up(&device->al_wait);
+
+	if (n)
+		drbd_info(device, "Warmed up the activity log with %u extents\n", n);
+}
+
 /**
  * drbd_al_shrink() - Removes all active extents form the activity log
  * @device:	DRBD device.
@@ -738,6 +1759,7 @@ void drbd_al_shrink(struct drbd_device *device)
 
 	D_ASSERT(device, test_bit(__LC_LOCKED, &device->act_log->flags));
 
+	drbd_al_hot_flush(device);
 	for (i = 0; i < device->act_log->nr_elements; i++) {
 		al_ext = lc_element_by_index(device->act_log, i);
 		if (al_ext->lc_number == LC_FREE)
@@ -834,6 +1856,7 @@ int drbd_al_initialize(struct drbd_device *device, void *buffer)
 	if (drbd_md_dax_active(device->ldev))
 		return drbd_dax_al_initialize(device);
 
+	al_sparse_prepare(device);
 	__al_write_transaction(device, al);
 	/* There may or may not have been a pending transaction. */
 	spin_lock_irq(&device->al_lock);
@@ -887,10 +1910,11 @@ static int w_update_peers(struct drbd_work *w, int unused)
  */
 static int bm_e_weight(struct drbd_peer_device *peer_device, unsigned long enr)
 {
+	unsigned long bits_per_ext = bm_bits_per_ext(peer_device->device->bitmap);
 	unsigned long start, end, count;
 
-	start = enr << (BM_EXT_SHIFT - BM_BLOCK_SHIFT);
-	end = ((enr + 1) << (BM_EXT_SHIFT - BM_BLOCK_SHIFT)) - 1;
+	start = enr * bits_per_ext;
+	end = (enr + 1) * bits_per_ext - 1;
 	count = drbd_bm_count_bits(peer_device->device, peer_device->bitmap_index, start, end);
 	return count;
 }
@@ -974,6 +1998,7 @@ static bool update_rs_extent(struct drbd_peer_device *peer_device,
 				     " -> %d[%u;00]\n",
 				     ext->lce.lc_number, ext->rs_left,
 				     ext->flags, enr, rs_left);
+				rs_prio_release(peer_device, ext);
 				ext->flags = 0;
 			}
 			if (ext->rs_failed) {
@@ -1076,6 +2101,7 @@ static int update_sync_bits(struct drbd_peer_device *peer_device,
 	 * alignment. Typically this loop will execute exactly once.
 	 */
 	struct drbd_device *device = peer_device->device;
+	unsigned long ext_mask = bm_bits_per_ext(device->bitmap) - 1;
 	unsigned long flags;
 	unsigned long count = 0;
 	unsigned int cleared = 0;
@@ -1083,7 +2109,7 @@ static int update_sync_bits(struct drbd_peer_device *peer_device,
 		/* set temporary boundary bit number to last bit number within
 		 * the resync extent of the current start bit number,
 		 * but cap at provided end bit number */
-		unsigned long tbnr = min(ebnr, sbnr | BM_BLOCKS_PER_BM_EXT_MASK);
+		unsigned long tbnr = min(ebnr, sbnr | ext_mask);
 		unsigned long c;
 		int bmi = peer_device->bitmap_index;
 
@@ -1101,7 +2127,8 @@ static int update_sync_bits(struct drbd_peer_device *peer_device,
 
 		if (c) {
 			spin_lock_irqsave(&device->al_lock, flags);
-			cleared += update_rs_extent(peer_device, BM_BIT_TO_EXT(sbnr), c, mode);
+			cleared += update_rs_extent(peer_device,
+						    bm_bit_to_ext(device->bitmap, sbnr), c, mode);
 			spin_unlock_irqrestore(&device->al_lock, flags);
 			count += c;
 		}
@@ -1150,7 +2177,7 @@ static bool plausible_request_size(int size)
 
 /* clear the bit corresponding to the piece of storage in question:
  * size byte of data starting from sector.  Only clear a bits of the affected
- * one ore more _aligned_ BM_BLOCK_SIZE blocks.
+ * one ore more _aligned_ bm_block_size() blocks.
  *
  * called by worker on L_SYNC_TARGET and receiver on SyncSource.
  *
@@ -1160,6 +2187,7 @@ int __drbd_change_sync(struct drbd_peer_device *peer_device, sector_t sector, in
 {
 	/* Is called from worker and receiver context _only_ */
 	struct drbd_device *device = peer_device->device;
+	struct drbd_bitmap *bm = device->bitmap;
 	unsigned long sbnr, ebnr, lbnr;
 	unsigned long count = 0;
 	sector_t esector, nr_sectors;
@@ -1189,23 +2217,23 @@ int __drbd_change_sync(struct drbd_peer_device *peer_device, sector_t sector, in
 	if (!expect(peer_device, esector < nr_sectors))
 		esector = nr_sectors - 1;
 
-	lbnr = BM_SECT_TO_BIT(nr_sectors-1);
+	lbnr = bm_sect_to_bit(bm, nr_sectors-1);
 
 	if (mode == SET_IN_SYNC) {
 		/* Round up start sector, round down end sector.  We make sure
-		 * we only clear full, aligned, BM_BLOCK_SIZE blocks. */
-		if (unlikely(esector < BM_SECT_PER_BIT-1))
+		 * we only clear full, aligned, bm_block_size() blocks. */
+		if (unlikely(esector < bm_sect_per_bit(bm)-1))
 			goto out;
 		if (unlikely(esector == (nr_sectors-1)))
 			ebnr = lbnr;
 		else
-			ebnr = BM_SECT_TO_BIT(esector - (BM_SECT_PER_BIT-1));
-		sbnr = BM_SECT_TO_BIT(sector + BM_SECT_PER_BIT-1);
+			ebnr = bm_sect_to_bit(bm, esector - (bm_sect_per_bit(bm)-1));
+		sbnr = bm_sect_to_bit(bm, sector + bm_sect_per_bit(bm)-1);
 	} else {
 		/* We set it out of sync, or record resync failure.
 		 * Should not round anything here. */
-		sbnr = BM_SECT_TO_BIT(sector);
-		ebnr = BM_SECT_TO_BIT(esector);
+		sbnr = bm_sect_to_bit(bm, sector);
+		ebnr = bm_sect_to_bit(bm, esector);
 	}
 
 	count = update_sync_bits(peer_device, sbnr, ebnr, mode);
@@ -1230,6 +2258,7 @@ bool drbd_set_all_out_of_sync(struct drbd_device *device, sector_t sector, int s
 bool drbd_set_sync(struct drbd_device *device, sector_t sector, int size,
 		   unsigned long bits, unsigned long mask)
 {
+	struct drbd_bitmap *bm = device->bitmap;
 	long set_start, set_end, clear_start, clear_end;
 	sector_t esector, nr_sectors;
 	bool set = false;
@@ -1255,18 +2284,18 @@ bool drbd_set_sync(struct drbd_device *device, sector_t sector, int size,
 		esector = nr_sectors - 1;
 
 	/* For marking sectors as out of sync, we need to round up. */
-	set_start = BM_SECT_TO_BIT(sector);
-	set_end = BM_SECT_TO_BIT(esector);
+	set_start = bm_sect_to_bit(bm, sector);
+	set_end = bm_sect_to_bit(bm, esector);
 
 	/* For marking sectors as in sync, we need to round down except when we
 	 * reach the end of the device: The last bit in the bitmap does not
 	 * account for sectors past the end of the device.
 	 * CLEAR_END can become negative here. */
-	clear_start = BM_SECT_TO_BIT(sector + BM_SECT_PER_BIT - 1);
+	clear_start = bm_sect_to_bit(bm, sector + bm_sect_per_bit(bm) - 1);
 	if (esector == nr_sectors - 1)
-		clear_end = BM_SECT_TO_BIT(esector);
+		clear_end = bm_sect_to_bit(bm, esector);
 	else
-		clear_end = BM_SECT_TO_BIT(esector + 1) - 1;
+		clear_end = bm_sect_to_bit(bm, esector + 1) - 1;
 
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, device) {
@@ -1330,6 +2359,7 @@ struct bm_extent *_bme_get(struct drbd_peer_device *peer_device, unsigned int en
 		if (bm_ext->lce.refcnt == 1)
 			peer_device->resync_locked++;
 		set_bit(BME_NO_WRITES, &bm_ext->flags);
+		al_hot_demote_rs_extent(device, enr);
 	}
 	rs_flags = peer_device->resync_lru->flags;
 	spin_unlock_irq(&device->al_lock);
@@ -1346,12 +2376,18 @@ struct bm_extent *_bme_get(struct drbd_peer_device *peer_device, unsigned int en
 	return bm_ext;
 }
 
+/* Is the 4M extent @enr in use in the activity log? Caller holds al_lock. */
+static bool al_is_used(struct drbd_device *device, unsigned int enr)
+{
+	return lc_is_used(device->act_log, enr >> (device->al_extent_shift - AL_EXTENT_SHIFT));
+}
+
 static int _is_in_al(struct drbd_device *device, unsigned int enr)
 {
 	int rv;
 
 	spin_lock_irq(&device->al_lock);
-	rv = lc_is_used(device->act_log, enr);
+	rv = al_is_used(device, enr);
 	spin_unlock_irq(&device->al_lock);
 
 	return rv;
@@ -1390,6 +2426,7 @@ retry:
 		if (sig || (sa && test_bit(BME_PRIORITY, &bm_ext->flags))) {
 			spin_lock_irq(&device->al_lock);
 			if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
+				rs_prio_release(peer_device, bm_ext);
 				bm_ext->flags = 0; /* clears BME_NO_WRITES and eventually BME_PRIORITY */
 				peer_device->resync_locked--;
 				wake_up(&device->al_wait);
@@ -1407,13 +2444,21 @@ retry:
 }
 
 /**
- * drbd_try_rs_begin_io() - Gets an extent in the resync LRU cache, does not sleep
+ * drbd_try_rs_begin_io_refs() - Gets an extent in the resync LRU cache, does not sleep
+ * @peer_device: DRBD peer device.
+ * @sector: sector within the extent.
+ * @refs: number of references to take on it, at least one.
+ * @throttle: give up if resync should slow down.
  *
  * Gets an extent in the resync LRU cache, sets it to BME_NO_WRITES, then
  * tries to set it to BME_LOCKED. Returns 0 upon success, and -EAGAIN
  * if there is still application IO going on in this area.
+ *
+ * All @refs references are taken in the same al_lock section; each is to be
+ * dropped by drbd_rs_complete_io() or drbd_rs_put_refs().
  */
-int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector, bool throttle)
+int drbd_try_rs_begin_io_refs(struct drbd_peer_device *peer_device, sector_t sector,
+			      unsigned int refs, bool throttle)
 {
 	struct drbd_device *device = peer_device->device;
 	unsigned int enr = BM_SECT_TO_EXT(sector);
@@ -1457,6 +2502,7 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 			clear_bit(BME_NO_WRITES, &bm_ext->flags);
 			peer_device->resync_wenr = LC_FREE;
 			if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
+				rs_prio_release(peer_device, bm_ext);
 				bm_ext->flags = 0;
 				peer_device->resync_locked--;
 			}
@@ -1473,6 +2519,7 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 			goto proceed;
 		if (!test_and_set_bit(BME_NO_WRITES, &bm_ext->flags)) {
 			peer_device->resync_locked++;
+			al_hot_demote_rs_extent(device, enr);
 		} else {
 			/* we did set the BME_NO_WRITES,
 			 * but then could not set BME_LOCKED,
@@ -1505,17 +2552,23 @@ int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector,
 			D_ASSERT(device, test_bit(BME_LOCKED, &bm_ext->flags) == 0);
 		}
 		set_bit(BME_NO_WRITES, &bm_ext->flags);
+		al_hot_demote_rs_extent(device, enr);
 		D_ASSERT(device, bm_ext->lce.refcnt == 1);
 		peer_device->resync_locked++;
 		goto check_al;
 	}
 check_al:
 	for (i = 0; i < AL_EXT_PER_BM_SECT; i++) {
-		if (lc_is_used(device->act_log, al_enr+i))
+		if (al_is_used(device, al_enr+i))
 			goto try_again;
 	}
 	set_bit(BME_LOCKED, &bm_ext->flags);
 proceed:
+	/* The extra references go straight to refcnt: the element is held
+	 * and committed, so it is on the in_use list and counted in ->used
+	 * already, and nothing else of lru_cache changes. lc_try_get() would
+	 * do the same, but may fail while the cache is starving. */
+	bm_ext->lce.refcnt += refs - 1;
 	peer_device->resync_wenr = LC_FREE;
 	spin_unlock_irq(&device->al_lock);
 	return 0;
@@ -1527,7 +2580,7 @@ try_again:
 			D_ASSERT(peer_device, !test_bit(BME_LOCKED, &bm_ext->flags));
 			D_ASSERT(peer_device, test_bit(BME_NO_WRITES, &bm_ext->flags));
 			clear_bit(BME_NO_WRITES, &bm_ext->flags);
-			clear_bit(BME_PRIORITY, &bm_ext->flags);
+			rs_prio_release(peer_device, bm_ext);
 			peer_device->resync_wenr = LC_FREE;
 			if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
 				bm_ext->flags = 0;
@@ -1541,7 +2594,18 @@ try_again:
 	return -EAGAIN;
 }
 
-void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
+int drbd_try_rs_begin_io(struct drbd_peer_device *peer_device, sector_t sector, bool throttle)
+{
+	return drbd_try_rs_begin_io_refs(peer_device, sector, 1, throttle);
+}
+
+/**
+ * drbd_rs_put_refs() - Drops references taken by drbd_try_rs_begin_io_refs()
+ * @peer_device: DRBD peer device.
+ * @sector: sector within the extent.
+ * @refs: number of references to drop.
+ */
+void drbd_rs_put_refs(struct drbd_peer_device *peer_device, sector_t sector, unsigned int refs)
 {
 	struct drbd_device *device = peer_device->device;
 	unsigned int enr = BM_SECT_TO_EXT(sector);
@@ -1559,15 +2623,18 @@ void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
 		return;
 	}
 
-	if (bm_ext->lce.refcnt == 0) {
+	if (bm_ext->lce.refcnt < refs) {
 		spin_unlock_irqrestore(&device->al_lock, flags);
 		drbd_err(device, "drbd_rs_complete_io(,%llu [=%u]) called, "
-		    "but refcnt is 0!?\n",
-		    (unsigned long long)sector, enr);
+		    "but refcnt is %u!?\n",
+		    (unsigned long long)sector, enr, bm_ext->lce.refcnt);
 		return;
 	}
 
+	while (--refs)
+		lc_put(peer_device->resync_lru, &bm_ext->lce);
 	if (lc_put(peer_device->resync_lru, &bm_ext->lce) == 0) {
+		rs_prio_release(peer_device, bm_ext);
 		bm_ext->flags = 0; /* clear BME_LOCKED, BME_NO_WRITES and BME_PRIORITY */
 		peer_device->resync_locked--;
 		wake_up(&device->al_wait);
@@ -1576,6 +2643,52 @@ void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
 	spin_unlock_irqrestore(&device->al_lock, flags);
 }
 
+void drbd_rs_complete_io(struct drbd_peer_device *peer_device, sector_t sector)
+{
+	drbd_rs_put_refs(peer_device, sector, 1);
+}
+
+/**
+ * drbd_rs_batch_get() - Gets a reference on a resync extent for one request
+ * @peer_device: DRBD peer device.
+ * @batch: references the caller holds on one extent, not yet handed out.
+ * @sector: start of the request.
+ * @max_refs: most requests the caller may still send.
+ * @throttle: as for drbd_try_rs_begin_io().
+ *
+ * Requests within the extent of @batch take one of its references, without
+ * the al_lock. Otherwise, the unused references are given back, and up to
+ * @max_refs are taken on the new extent at once. Give back the reference of
+ * a request that is not sent after all with drbd_rs_batch_unget(), and what
+ * is left with drbd_rs_batch_put().
+ */
+int drbd_rs_batch_get(struct drbd_peer_device *peer_device, struct drbd_rs_batch *batch,
+		      sector_t sector, unsigned int max_refs, bool throttle)
+{
+	unsigned int enr = BM_SECT_TO_EXT(sector);
+	int err;
+
+	if (batch->refs && batch->enr == enr) {
+		batch->refs--;
+		return 0;
+	}
+
+	drbd_rs_batch_put(peer_device, batch);
+	err = drbd_try_rs_begin_io_refs(peer_device, sector, max_refs, throttle);
+	if (!err) {
+		batch->enr = enr;
+		batch->refs = max_refs - 1;
+	}
+	return err;
+}
+
+void drbd_rs_batch_put(struct drbd_peer_device *peer_device, struct drbd_rs_batch *batch)
+{
+	if (batch->refs)
+		drbd_rs_put_refs(peer_device, BM_EXT_TO_SECT(batch->enr), batch->refs);
+	batch->refs = 0;
+}
+
 /**
  * drbd_rs_cancel_all() - Removes all extents from the resync LRU (even BME_LOCKED)
  */
@@ -1590,6 +2703,8 @@ void drbd_rs_cancel_all(struct drbd_peer_device *peer_device)
 	}
 	peer_device->resync_locked = 0;
 	peer_device->resync_wenr = LC_FREE;
+	/* lc_reset() cleared the flags of all extents */
+	WRITE_ONCE(peer_device->rs_prio_count, 0);
 	spin_unlock_irq(&device->al_lock);
 	wake_up(&device->al_wait);
 }
@@ -1623,6 +2738,7 @@ int drbd_rs_del_all(struct drbd_peer_device *peer_device)
 				D_ASSERT(peer_device, !test_bit(BME_LOCKED, &bm_ext->flags));
 				D_ASSERT(peer_device, test_bit(BME_NO_WRITES, &bm_ext->flags));
 				clear_bit(BME_NO_WRITES, &bm_ext->flags);
+				rs_prio_release(peer_device, bm_ext);
 				peer_device->resync_wenr = LC_FREE;
 				lc_put(peer_device->resync_lru, &bm_ext->lce);
 			}
@@ -1652,6 +2768,9 @@ bool drbd_sector_has_priority(struct drbd_peer_device *peer_device, sector_t sec
 	struct lc_element *tmp;
 	bool has_priority = false;
 
+	if (!READ_ONCE(peer_device->rs_prio_count))
+		return false;
+
 	spin_lock_irq(&device->al_lock);
 	tmp = lc_find(peer_device->resync_lru, BM_SECT_TO_EXT(sector));
 	if (tmp) {
@@ -77,6 +77,14 @@
  *	and out against their on-disk location as necessary, but need to make
  *	sure we don't cause too much meta data IO, and must not deadlock in
  *	tight memory situations. This needs some more work.
+ *
+ *	A first step is the sparse mode (BM_SPARSE, module parameter
+ *	bitmap_sparse): a NULL entry in bm_pages stands for a page with no
+ *	bit set, in core and on disk. It reads as the zero page, gets
+ *	allocated when the first bit on it is set, and is taken out again
+ *	once it has been written back with no bit set. Pages of extents in
+ *	the activity log are kept, so that writes never allocate in atomic
+ *	context; bulk operations allocate in process context.
  */
 
 /*
@@ -183,9 +191,13 @@ void drbd_bm_slot_lock(struct drbd_peer_device *peer_device, char *why, enum bm_
 	_drbd_bm_lock(peer_device->device, peer_device, why, flags);
 }
 
+static void bm_sparse_free_list(struct list_head *to_free);
+
 void drbd_bm_unlock(struct drbd_device *device)
 {
 	struct drbd_bitmap *b = device->bitmap;
+	LIST_HEAD(to_free);
+
 	if (!b) {
 		drbd_err(device, "FIXME no bitmap in drbd_bm_unlock!?\n");
 		return;
@@ -194,12 +206,21 @@ void drbd_bm_unlock(struct drbd_device *device)
 	if (!(device->bitmap->bm_flags & BM_LOCK_ALL))
 		drbd_err(device, "FIXME bitmap not locked in bm_unlock\n");
 
+	/* we were the one who might have looked at reclaimed pages unlocked */
+	if (b->bm_flags & BM_SPARSE) {
+		spin_lock_irq(&b->bm_lock);
+		if (!b->bm_io_users)
+			list_splice_init(&b->bm_reclaimed, &to_free);
+		spin_unlock_irq(&b->bm_lock);
+	}
+
 	b->bm_flags &= ~BM_LOCK_ALL;
 	b->bm_why  = NULL;
 	b->bm_task_comm[0] = 0;
 	b->bm_task_pid = 0;
 	b->bm_locked_peer = NULL;
 	mutex_unlock(&b->bm_change);
+	bm_sparse_free_list(&to_free);
 }
 
 void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
@@ -250,19 +271,17 @@ static unsigned long bm_page_to_idx(struct page *page)
 /* As is very unlikely that the same page is under IO from more than one
  * context, we can get away with a bit per page and one wait queue per bitmap.
  */
-static void bm_page_lock_io(struct drbd_device *device, int page_nr)
+static void bm_page_lock_io(struct drbd_bitmap *b, struct page *page)
 {
-	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = &page_private(page);
 	wait_event(b->bm_io_wait, !test_and_set_bit(BM_PAGE_IO_LOCK, addr));
 }
 
-static void bm_page_unlock_io(struct drbd_device *device, int page_nr)
+static void bm_page_unlock_io(struct drbd_bitmap *b, struct page *page)
 {
-	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
+	void *addr = &page_private(page);
 	clear_bit_unlock(BM_PAGE_IO_LOCK, addr);
-	wake_up(&device->bitmap->bm_io_wait);
+	wake_up(&b->bm_io_wait);
 }
 
 /* set _before_ submit_io, so it may be reset due to being changed
@@ -323,7 +342,7 @@ static int bm_test_page_lazy_writeout(struct page *page)
  */
 
 
-static void bm_free_pages(struct page **pages, unsigned long number)
+static void bm_free_pages(struct drbd_bitmap *b, struct page **pages, unsigned long number)
 {
 	unsigned long i;
 	if (!pages)
@@ -331,8 +350,9 @@ static void bm_free_pages(struct page **pages, unsigned long number)
 
 	for (i = 0; i < number; i++) {
 		if (!pages[i]) {
-			pr_alert("bm_free_pages tried to free a NULL pointer; i=%lu n=%lu\n",
-				 i, number);
+			if (!(b->bm_flags & BM_SPARSE))
+				pr_alert("bm_free_pages tried to free a NULL pointer; i=%lu n=%lu\n",
+					 i, number);
 			continue;
 		}
 		__free_page(pages[i]);
@@ -340,10 +360,205 @@ static void bm_free_pages(struct page **pages, unsigned long number)
 	}
 }
 
+#define WORDS32_PER_PAGE	(PAGE_SIZE / sizeof(u32))
+
+/* A page for a sparse bitmap, with no bit set. It comes from a mempool,
+ * as it may have to be allocated with GFP_ATOMIC when setting bits. */
+static struct page *bm_sparse_alloc_page(gfp_t gfp, unsigned long page_nr)
+{
+	struct page *page;
+
+	page = mempool_alloc(&drbd_bm_sparse_page_pool, gfp | __GFP_HIGHMEM);
+	if (page) {
+		clear_highpage(page);
+		bm_store_page_idx(page, page_nr);
+	}
+	return page;
+}
+
+static void bm_sparse_free_page(struct page *page)
+{
+	mempool_free(page, &drbd_bm_sparse_page_pool);
+}
+
+static bool bm_page_absent(struct drbd_bitmap *b, unsigned long page_nr)
+{
+	return (b->bm_flags & BM_SPARSE) && !READ_ONCE(b->bm_pages[page_nr]);
+}
+
+/* Ran out of memory for setting bits on a sparse page in atomic context.
+ * Those bits are lost, make sure the peers of that slot get a full sync
+ * instead. Until all bits of the slot are set, see __bm_many_bits_op(),
+ * drbd_bm_lost_bits() keeps MDF_PEER_FULL_SYNC from being cleared again.
+ * Writes never get here, the pages of their activity log extents are
+ * present, see drbd_bm_sparse_prepare(). Bulk operations in process context
+ * allocate with GFP_NOIO, and do not get here either. */
+static void bm_sparse_lost(struct drbd_device *device, unsigned int bitmap_index)
+{
+	struct drbd_md *md;
+	int node_id;
+
+	set_bit(bitmap_index, &device->bitmap->bm_lost_slots);
+	if (!get_ldev_if_state(device, D_ATTACHING))
+		return;
+	md = &device->ldev->md;
+	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
+		if (md->peers[node_id].bitmap_index != bitmap_index ||
+		    md->peers[node_id].flags & MDF_PEER_FULL_SYNC)
+			continue;
+		md->peers[node_id].flags |= MDF_PEER_FULL_SYNC;
+		drbd_md_mark_dirty(device);
+	}
+	put_ldev(device);
+	if (drbd_ratelimit())
+		drbd_err(device, "Out of memory for a bitmap page, full sync for bitmap slot %u\n",
+			 bitmap_index);
+}
+
+/* Called with bm_lock held. Returns NULL if the page could not be allocated
+ * even from the reserve of drbd_bm_sparse_page_pool, the bits to be set on it
+ * are lost then. */
+static struct page *
+bm_sparse_materialize(struct drbd_device *device, unsigned int bitmap_index, unsigned int page_nr)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	struct page *page;
+
+	page = bm_sparse_alloc_page(GFP_ATOMIC, page_nr);
+	if (!page) {
+		bm_sparse_lost(device, bitmap_index);
+		return NULL;
+	}
+	/* lockless readers in bm_map() see it cleared */
+	smp_store_release(&b->bm_pages[page_nr], page);
+	return page;
+}
+
+/* Like bm_sparse_materialize(), for bitmap IO in process context, may sleep. */
+static struct page *bm_sparse_materialize_noio(struct drbd_bitmap *b, unsigned int page_nr)
+{
+	struct page *page = bm_sparse_alloc_page(GFP_NOIO, page_nr);
+
+	spin_lock_irq(&b->bm_lock);
+	if (!b->bm_pages[page_nr]) {
+		smp_store_release(&b->bm_pages[page_nr], page);
+		page = NULL;
+	}
+	spin_unlock_irq(&b->bm_lock);
+	if (page)
+		bm_sparse_free_page(page);
+	return b->bm_pages[page_nr];
+}
+
+/* Does the page hold bits of an extent in the activity log? Writes may set
+ * bits there without allocating, so it has to stay. Called with al_lock held. */
+static bool bm_page_in_act_log(struct drbd_device *device, unsigned int page_nr)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int shift = device->al_extent_shift - b->bm_block_shift;
+	unsigned long first_word = (unsigned long)page_nr * WORDS32_PER_PAGE;
+	unsigned long enr, last_enr;
+
+	if (!device->act_log)
+		return false;
+	enr = ((first_word / b->bm_max_peers) << 5) >> shift;
+	last_enr = ((((first_word + WORDS32_PER_PAGE - 1) / b->bm_max_peers) << 5) | 31) >> shift;
+	for (; enr <= last_enr; enr++) {
+		if (lc_find(device->act_log, enr) || lc_is_used(device->act_log, enr))
+			return true;
+	}
+	return false;
+}
+
+static bool bm_page_all_zero(struct page *page)
+{
+	void *addr = kmap_atomic(page);
+	bool zero = !memchr_inv(addr, 0, PAGE_SIZE);
+
+	kunmap_atomic(addr);
+	return zero;
+}
+
+/* Free the reclaimed pages, unless someone may still look at them: a
+ * bm_rw_range() in progress, or the drbd_bm_lock() holder, which may use
+ * _drbd_bm_find_next() without bm_lock. Called with bm_lock held. */
+static void bm_sparse_free_reclaimed(struct drbd_bitmap *b, struct list_head *to_free)
+{
+	if (b->bm_io_users || mutex_is_locked(&b->bm_change))
+		return;
+	list_splice_init(&b->bm_reclaimed, to_free);
+}
+
+static void bm_sparse_free_list(struct list_head *to_free)
+{
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, to_free, lru) {
+		list_del(&page->lru);
+		bm_sparse_free_page(page);
+	}
+}
+
+/* Take pages out of a sparse bitmap that have no bit set, and are so on disk
+ * as well: written back, and no IO on them. Only while no other bitmap IO is
+ * in progress, which might still submit the page. */
+static void bm_sparse_reclaim(struct drbd_device *device, unsigned int start_page, unsigned int end_page)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	const unsigned long busy = (1UL << BM_PAGE_IO_LOCK) | (1UL << BM_PAGE_IO_ERROR) |
+		(1UL << BM_PAGE_NEED_WRITEOUT) | (1UL << BM_PAGE_LAZY_WRITEOUT) |
+		(1UL << BM_PAGE_HINT_WRITEOUT);
+	unsigned int i;
+
+	for (i = start_page; i <= end_page; i++) {
+		struct page *page = b->bm_pages[i];
+
+		if (!page || page_private(page) & busy)
+			continue;
+
+		/* al_lock first, an extent activated after this has its
+		 * pages brought back by drbd_bm_sparse_prepare() */
+		spin_lock_irq(&device->al_lock);
+		spin_lock(&b->bm_lock);
+		if (b->bm_io_users == 1 && b->bm_pages[i] == page &&
+		    !(page_private(page) & busy) && !bm_page_in_act_log(device, i) &&
+		    bm_page_all_zero(page)) {
+			WRITE_ONCE(b->bm_pages[i], NULL);
+			list_add(&page->lru, &b->bm_reclaimed);
+		}
+		spin_unlock(&b->bm_lock);
+		spin_unlock_irq(&device->al_lock);
+		cond_resched();
+	}
+}
+
+/*
+ * With several NUMA nodes, the bitmap pages are spread over them in
+ * contiguous chunks. bm_rw_pages_parallel() reads and writes each chunk
+ * from a worker on the node that holds it.
+ */
+static int bm_page_node(unsigned long page_nr, unsigned long number_of_pages)
+{
+	unsigned int nodes = num_online_nodes();
+	unsigned long n;
+	int node;
+
+	if (nodes <= 1)
+		return NUMA_NO_NODE;
+
+	n = page_nr / DIV_ROUND_UP(number_of_pages, nodes);
+	for_each_online_node(node) {
+		if (n-- == 0)
+			return node;
+	}
+	return NUMA_NO_NODE;
+}
+
 /*
  * "have" and "want" are NUMBER OF PAGES.
+ * With @sparse, pages beyond "have" are not allocated.
  */
-static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
+static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want, bool sparse)
 {
 	struct page **old_pages = b->bm_pages;
 	struct page **new_pages, *page;
@@ -373,10 +588,11 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 	if (want >= have) {
 		for (i = 0; i < have; i++)
 			new_pages[i] = old_pages[i];
-		for (; i < want; i++) {
-			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+		for (; i < want && !sparse; i++) {
+			page = alloc_pages_node(bm_page_node(i, want),
+						GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO, 0);
 			if (!page) {
-				bm_free_pages(new_pages + have, i - have);
+				bm_free_pages(b, new_pages + have, i - have);
 				kvfree(new_pages);
 				return NULL;
 			}
@@ -395,6 +611,25 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 	return new_pages;
 }
 
+/* The summary of @pages bitmap pages, all bits set until bm_count_bits() */
+static unsigned long *bm_alloc_summary(unsigned long pages, unsigned int max_peers,
+				       size_t *longs)
+{
+	unsigned long *summary;
+	size_t bytes;
+
+	*longs = BITS_TO_LONGS(pages);
+	bytes = *longs * max_peers * sizeof(long);
+	summary = kmalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!summary) {
+		summary = __vmalloc(bytes, GFP_NOIO | __GFP_HIGHMEM);
+		if (!summary)
+			return NULL;
+	}
+	memset(summary, 0xff, bytes);
+	return summary;
+}
+
 struct drbd_bitmap *drbd_bm_alloc(void)
 {
 	struct drbd_bitmap *b;
@@ -406,8 +641,10 @@ struct drbd_bitmap *drbd_bm_alloc(void)
 	spin_lock_init(&b->bm_lock);
 	mutex_init(&b->bm_change);
 	init_waitqueue_head(&b->bm_io_wait);
+	INIT_LIST_HEAD(&b->bm_reclaimed);
 
 	b->bm_max_peers = 1;
+	b->bm_block_shift = BM_BLOCK_SHIFT;
 
 	return b;
 }
@@ -421,10 +658,12 @@ sector_t drbd_bm_capacity(struct drbd_device *device)
 
 void drbd_bm_free(struct drbd_bitmap *bitmap)
 {
+	kvfree(bitmap->bm_summary);
 	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
 		return;
 
-	bm_free_pages(bitmap->bm_pages, bitmap->bm_number_of_pages);
+	bm_free_pages(bitmap, bitmap->bm_pages, bitmap->bm_number_of_pages);
+	bm_sparse_free_list(&bitmap->bm_reclaimed);
 	kvfree(bitmap->bm_pages);
 	kfree(bitmap);
 }
@@ -462,10 +701,31 @@ static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
 	return word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
 }
 
+static inline unsigned long *bm_summary(struct drbd_bitmap *bitmap, unsigned int bitmap_index)
+{
+	return bitmap->bm_summary + bitmap_index * bitmap->bm_summary_longs;
+}
+
+/* the first bit of the slot stored on the page */
+static inline unsigned long first_bit_on_page(struct drbd_bitmap *bitmap,
+					      unsigned int bitmap_index,
+					      unsigned long page)
+{
+	unsigned long word = page << (PAGE_SHIFT - 2);
+
+	if (word <= bitmap_index)
+		return 0;
+	return DIV_ROUND_UP(word - bitmap_index, bitmap->bm_max_peers) << 5;
+}
+
+/* A page absent from a sparse bitmap maps the zero page, never write to it */
 static void *bm_map(struct drbd_bitmap *bitmap, unsigned int page)
 {
-	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
-		return kmap_atomic(bitmap->bm_pages[page]);
+	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
+		struct page *p = READ_ONCE(bitmap->bm_pages[page]);
+
+		return kmap_atomic(p ?: ZERO_PAGE(0));
+	}
 
 	return ((unsigned char *)bitmap->bm_on_pmem) + (unsigned long)page * PAGE_SIZE;
 }
@@ -476,15 +736,38 @@ static void bm_unmap(struct drbd_bitmap *bitmap, void *addr)
 		kunmap_atomic(addr);
 }
 
+/* does the slot have any bits set on the page? */
+static bool bm_page_has_bits(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+			     unsigned int page)
+{
+	unsigned int max_peers = bitmap->bm_max_peers;
+	unsigned int word = (bitmap_index + max_peers -
+			     (page * WORDS32_PER_PAGE) % max_peers) % max_peers;
+	bool found = false;
+	__le32 *p;
+
+	p = bm_map(bitmap, page);
+	for (; word < WORDS32_PER_PAGE; word += max_peers) {
+		if (READ_ONCE(p[word])) {
+			found = true;
+			break;
+		}
+	}
+	bm_unmap(bitmap, p);
+	return found;
+}
+
 static __always_inline unsigned long
 ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
 	 enum bitmap_operations op, __le32 *buffer)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long *summary = bm_summary(bitmap, bitmap_index);
 	unsigned int word32_skip = 32 * bitmap->bm_max_peers;
 	unsigned long total = 0;
 	unsigned long word;
 	unsigned int page, bit_in_page;
+	bool whole_page;
 
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
@@ -492,12 +775,65 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	word = interleaved_word32(bitmap, bitmap_index, start);
 	page = word32_to_page(word);
 	bit_in_page = (word32_in_page(word) << 5) | (start & 31);
+	/* does the op see all bits of the slot on the current page? */
+	whole_page = (op == BM_OP_FIND_BIT || op == BM_OP_CLEAR) &&
+		start == first_bit_on_page(bitmap, bitmap_index, page);
 
 	for (; start <= end; page++) {
 		unsigned int count = 0;
 		void *addr;
 
+		/* Summary bits change atomically, since _drbd_bm_find_next()
+		 * runs without bm_lock and may race with drbd_bm_set_bits().
+		 * See the ordering at next_page. */
+		if (op == BM_OP_FIND_BIT && !test_bit(page, summary)) {
+			page = find_next_bit(summary, bitmap->bm_number_of_pages, page);
+			if (page >= bitmap->bm_number_of_pages)
+				break;
+			start = first_bit_on_page(bitmap, bitmap_index, page);
+			if (start > end)
+				break;
+			word = interleaved_word32(bitmap, bitmap_index, start);
+			bit_in_page = word32_in_page(word) << 5;
+			whole_page = true;
+		}
+
+		/* Nothing to clear or to merge in on an absent page; materialize
+		 * it for setting bits, or skip it if that fails. */
+		if ((op == BM_OP_CLEAR || op == BM_OP_SET || op == BM_OP_MERGE) &&
+		    bm_page_absent(bitmap, page)) {
+			unsigned long last = min(last_bit_on_page(bitmap, bitmap_index, start), end);
+			unsigned int words = DIV_ROUND_UP(last - start + 1, 32);
+
+			if (op == BM_OP_CLEAR ||
+			    (op == BM_OP_MERGE && !memchr_inv(buffer, 0, words * sizeof(*buffer))) ||
+			    !bm_sparse_materialize(device, bitmap_index, page)) {
+				if (op == BM_OP_MERGE)
+					buffer += words;
+				start = last + 1;
+				word = interleaved_word32(bitmap, bitmap_index, start);
+				bit_in_page = word32_in_page(word) << 5;
+				whole_page = true;
+				continue;
+			}
+		}
+
 		addr = bm_map(bitmap, page);
+		if ((op == BM_OP_FIND_BIT || op == BM_OP_FIND_ZERO_BIT) && word32_skip == 32) {
+			/* not interleaved, search the rest of the page in one go */
+			unsigned int last = min_t(unsigned long, BITS_PER_PAGE,
+						  bit_in_page + (end - start) + 1);
+
+			if (op == BM_OP_FIND_BIT)
+				count = find_next_bit_le(addr, last, bit_in_page);
+			else
+				count = find_next_zero_bit_le(addr, last, bit_in_page);
+			if (count < last)
+				goto found;
+			start += last - bit_in_page;
+			bit_in_page = last;
+			goto next_page;
+		}
 		if (((start & 31) && (start | 31) <= end) || op == BM_OP_TEST) {
 			unsigned int last = bit_in_page | 31;
 
@@ -662,6 +998,24 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 
 	    next_page:
 		bm_unmap(bitmap, addr);
+		if (op == BM_OP_FIND_BIT || op == BM_OP_CLEAR) {
+			/* went through to the end of the page: the slot has
+			 * no bits set on it (any more) */
+			if (whole_page && bit_in_page >= BITS_PER_PAGE) {
+				clear_bit(page, summary);
+				/* A lockless finder may have missed bits set
+				 * after it scanned the page; the setter sets the
+				 * summary bit only after its bits, so either we
+				 * see them here or its set_bit comes after our
+				 * clear_bit. */
+				if (op == BM_OP_FIND_BIT) {
+					smp_mb__after_atomic();
+					if (bm_page_has_bits(bitmap, bitmap_index, page))
+						set_bit(page, summary);
+				}
+			}
+			whole_page = true;
+		}
 		bit_in_page -= BITS_PER_PAGE;
 		switch(op) {
 		case BM_OP_CLEAR:
@@ -674,6 +1028,9 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		case BM_OP_MERGE:
 			if (count) {
 				bm_set_page_need_writeout(bitmap, page);
+				/* pairs with the barrier after clear_bit above */
+				smp_mb__before_atomic();
+				set_bit(page, summary);
 				total += count;
 			}
 			break;
@@ -790,27 +1147,161 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 	____bm_op(device, bitmap_index, start, end, op, buffer)
 #endif
 
-/* you better not modify the bitmap while this is running,
- * or its results will be stale */
-static void bm_count_bits(struct drbd_device *device)
+/* Adds the bits set on one page to @n, per slot. The first word of the page
+ * belongs to slot @first_slot. Meant to be expanded with a constant
+ * @max_peers, so that the inner loop unrolls and the slot counts stay in
+ * registers. */
+static __always_inline void
+bm_count_page_slots(const u32 *p, unsigned int first_slot, unsigned int max_peers,
+		    unsigned long *n)
+{
+	unsigned int w, s;
+
+	if (max_peers == 1) {
+		const unsigned long *l = (const unsigned long *)p;
+
+		for (w = 0; w < PAGE_SIZE / sizeof(long); w++)
+			n[0] += hweight_long(l[w]);
+	} else if (WORDS32_PER_PAGE % max_peers == 0) {
+		/* every page starts with slot 0 */
+		for (w = 0; w < WORDS32_PER_PAGE; w += max_peers)
+			for (s = 0; s < max_peers; s++)
+				n[s] += hweight32(p[w + s]);
+	} else {
+		s = first_slot;
+		for (w = 0; w < WORDS32_PER_PAGE; w++) {
+			n[s] += hweight32(p[w]);
+			if (++s == max_peers)
+				s = 0;
+		}
+	}
+}
+
+static void bm_count_page(const u32 *p, unsigned int first_slot, unsigned int max_peers,
+			  unsigned long *n)
+{
+	switch (max_peers) {
+	case 1:
+		bm_count_page_slots(p, first_slot, 1, n);
+		break;
+	case 2:
+		bm_count_page_slots(p, first_slot, 2, n);
+		break;
+	case 3:
+		bm_count_page_slots(p, first_slot, 3, n);
+		break;
+	case 4:
+		bm_count_page_slots(p, first_slot, 4, n);
+		break;
+	case 7:
+		bm_count_page_slots(p, first_slot, 7, n);
+		break;
+	case 8:
+		bm_count_page_slots(p, first_slot, 8, n);
+		break;
+	default:
+		bm_count_page_slots(p, first_slot, max_peers, n);
+		break;
+	}
+}
+
+/* pages with all their words below bm_bits, in every slot */
+static unsigned long bm_full_pages(struct drbd_bitmap *bitmap)
+{
+	return ((bitmap->bm_bits >> 5) * bitmap->bm_max_peers) >> (PAGE_SHIFT - 2);
+}
+
+/* Count the bits of all slots on a page just read in, from drbd_bm_endio().
+ * Completions of different pages may run concurrently. */
+static unsigned long bm_count_read_page(struct drbd_bm_aio_ctx *ctx, unsigned int page)
+{
+	struct drbd_bitmap *bitmap = ctx->device->bitmap;
+	const unsigned int max_peers = bitmap->bm_max_peers;
+	unsigned long n[DRBD_PEERS_MAX] = { };
+	unsigned long total = 0;
+	unsigned int bitmap_index;
+	void *addr;
+
+	addr = bm_map(bitmap, page);
+	bm_count_page(addr, (page * WORDS32_PER_PAGE) % max_peers, max_peers, n);
+	bm_unmap(bitmap, addr);
+
+	for (bitmap_index = 0; bitmap_index < max_peers; bitmap_index++) {
+		if (n[bitmap_index]) {
+			set_bit(page, bm_summary(bitmap, bitmap_index));
+			atomic_long_add(n[bitmap_index], &ctx->bm_set[bitmap_index]);
+			total += n[bitmap_index];
+		} else {
+			clear_bit(page, bm_summary(bitmap, bitmap_index));
+		}
+	}
+	return total;
+}
+
+/* the rest after @full_pages, up to bm_bits slot by slot */
+static void bm_count_bits_tail(struct drbd_device *device, unsigned long full_pages)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
 	unsigned int bitmap_index;
+	unsigned long page;
 
 	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
-		unsigned long bit = 0, bits_set = 0;
+		unsigned long bit = first_bit_on_page(bitmap, bitmap_index, full_pages);
 
 		while (bit < bitmap->bm_bits) {
 			unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
+			unsigned long n;
 
-			bits_set += ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL);
+			page = bit_to_page_interleaved(bitmap, bitmap_index, bit);
+			n = ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL);
+			if (n)
+				__set_bit(page, bm_summary(bitmap, bitmap_index));
+			else
+				__clear_bit(page, bm_summary(bitmap, bitmap_index));
+			bitmap->bm_set[bitmap_index] += n;
 			bit = last_bit + 1;
 			cond_resched();
 		}
-		bitmap->bm_set[bitmap_index] = bits_set;
 	}
 }
 
+/* you better not modify the bitmap while this is running,
+ * or its results will be stale */
+static void bm_count_bits(struct drbd_device *device)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	const unsigned int max_peers = bitmap->bm_max_peers;
+	unsigned long full_pages = bm_full_pages(bitmap);
+	unsigned int bitmap_index;
+	unsigned long page;
+
+	for (bitmap_index = 0; bitmap_index < max_peers; bitmap_index++)
+		bitmap->bm_set[bitmap_index] = 0;
+
+	/* one pass over those for all slots together */
+	for (page = 0; page < full_pages; page++) {
+		unsigned long n[DRBD_PEERS_MAX] = { };
+		void *addr;
+
+		if (!bm_page_absent(bitmap, page)) {
+			addr = bm_map(bitmap, page);
+			bm_count_page(addr, (page * WORDS32_PER_PAGE) % max_peers, max_peers, n);
+			bm_unmap(bitmap, addr);
+		}
+
+		for (bitmap_index = 0; bitmap_index < max_peers; bitmap_index++) {
+			if (n[bitmap_index])
+				__set_bit(page, bm_summary(bitmap, bitmap_index));
+			else
+				__clear_bit(page, bm_summary(bitmap, bitmap_index));
+			bitmap->bm_set[bitmap_index] += n[bitmap_index];
+		}
+		cond_resched();
+	}
+
+	bm_count_bits_tail(device, full_pages);
+}
+
 /* For the layout, see comment above drbd_md_set_sector_offsets(). */
 static u64 drbd_md_on_disk_bits(struct drbd_device *device)
 {
@@ -842,6 +1333,8 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	unsigned long bits, words, obits;
 	unsigned long want, have, onpages; /* number of pages */
 	struct page **npages = NULL, **opages = NULL;
+	unsigned long *nsummary = NULL, *osummary = NULL;
+	size_t summary_longs = 0;
 	void *bm_on_pmem = NULL;
 	int err = 0;
 	bool growing;
@@ -870,14 +1363,19 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		b->bm_bits = 0;
 		b->bm_words = 0;
 		b->bm_dev_capacity = 0;
+		osummary = b->bm_summary;
+		b->bm_summary = NULL;
 		spin_unlock_irq(&b->bm_lock);
+		kvfree(osummary);
 		if (!(b->bm_flags & BM_ON_DAX_PMEM)) {
-			bm_free_pages(opages, onpages);
+			bm_free_pages(b, opages, onpages);
+			bm_sparse_free_list(&b->bm_reclaimed);
 			kvfree(opages);
 		}
+		b->bm_flags &= ~BM_SPARSE;
 		goto out;
 	}
-	bits  = BM_SECT_TO_BIT(ALIGN(capacity, BM_SECT_PER_BIT));
+	bits  = bm_sect_to_bit(b, ALIGN(capacity, bm_sect_per_bit(b)));
 	words = (ALIGN(bits, 64) * b->bm_max_peers) / BITS_PER_LONG;
 
 	if (get_ldev(device)) {
@@ -893,20 +1391,37 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 	want = PFN_UP(words * sizeof(long));
 	have = b->bm_number_of_pages;
+	if (want != have || !b->bm_summary) {
+		nsummary = bm_alloc_summary(want, b->bm_max_peers, &summary_longs);
+		if (!nsummary) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
 	if (drbd_md_dax_active(device->ldev)) {
 		bm_on_pmem = drbd_dax_bitmap(device, want);
 	} else {
+		/* the mode is chosen on attach, and kept until detach */
+		if (have == 0 && drbd_bitmap_sparse)
+			b->bm_flags |= BM_SPARSE;
+		else if (have == 0)
+			b->bm_flags &= ~BM_SPARSE;
+
 		if (want == have) {
 			D_ASSERT(device, b->bm_pages != NULL);
 			npages = b->bm_pages;
 		} else {
+			/* new pages that get all bits set are needed anyways */
+			bool sparse = (b->bm_flags & BM_SPARSE) && !set_new_bits;
+
 			if (drbd_insert_fault(device, DRBD_FAULT_BM_ALLOC))
 				npages = NULL;
 			else
-				npages = bm_realloc_pages(b, want);
+				npages = bm_realloc_pages(b, want, sparse);
 		}
 
 		if (!npages) {
+			kvfree(nsummary);
 			err = -ENOMEM;
 			goto out;
 		}
@@ -938,6 +1453,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	b->bm_bits  = bits;
 	b->bm_words = words;
 	b->bm_dev_capacity = capacity;
+	if (nsummary) {
+		osummary = b->bm_summary;
+		b->bm_summary = nsummary;
+		b->bm_summary_longs = summary_longs;
+	}
 
 	if (growing) {
 		unsigned int bitmap_index;
@@ -958,12 +1478,13 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 	if (want < have && !(b->bm_flags & BM_ON_DAX_PMEM)) {
 		/* implicit: (opages != NULL) && (opages != npages) */
-		bm_free_pages(opages + want, have - want);
+		bm_free_pages(b, opages + want, have - want);
 	}
 
 	spin_unlock_irq(&b->bm_lock);
 	if (opages != npages)
 		kvfree(opages);
+	kvfree(osummary);
 	if (!growing)
 		bm_count_bits(device);
 	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu\n", bits, words, want);
@@ -1034,6 +1555,39 @@ unsigned long drbd_bm_bits(struct drbd_device *device)
 	return b->bm_bits;
 }
 
+/* Did the slot lose bits to a failed allocation, since all its bits were
+ * last set? Its MDF_PEER_FULL_SYNC must stay then, see bm_sparse_lost(). */
+bool drbd_bm_lost_bits(struct drbd_device *device, unsigned int bitmap_index)
+{
+	struct drbd_bitmap *b = device->bitmap;
+
+	if (!b || bitmap_index >= b->bm_max_peers)
+		return false;
+	return test_bit(bitmap_index, &b->bm_lost_slots);
+}
+
+/* With a sparse bitmap, allocate the absent pages on which merging buffer
+ * sets bits, so that bm_op() does not have to in atomic context. May sleep. */
+static void bm_sparse_prepare_merge(struct drbd_bitmap *b, unsigned int bitmap_index,
+				    unsigned long start, unsigned long end, const __le32 *buffer)
+{
+	if (!(b->bm_flags & BM_SPARSE) || start >= b->bm_bits)
+		return;
+	if (end >= b->bm_bits)
+		end = b->bm_bits - 1;
+
+	while (start <= end) {
+		unsigned long last = min(last_bit_on_page(b, bitmap_index, start), end);
+		unsigned int page_nr = bit_to_page_interleaved(b, bitmap_index, start);
+		unsigned int words = DIV_ROUND_UP(last - start + 1, 32);
+
+		if (bm_page_absent(b, page_nr) && memchr_inv(buffer, 0, words * sizeof(*buffer)))
+			bm_sparse_materialize_noio(b, page_nr);
+		buffer += words;
+		start = last + 1;
+	}
+}
+
 /* merge number words from buffer into the bitmap starting at offset.
  * buffer[i] is expected to be little endian unsigned long.
  * bitmap must be locked by drbd_bm_lock.
@@ -1042,11 +1596,14 @@ unsigned long drbd_bm_bits(struct drbd_device *device)
 void drbd_bm_merge_lel(struct drbd_peer_device *peer_device, size_t offset, size_t number,
 			unsigned long *buffer)
 {
+	struct drbd_device *device = peer_device->device;
 	unsigned long start, end;
 
 	start = offset * BITS_PER_LONG;
 	end = start + number * BITS_PER_LONG - 1;
-	bm_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_MERGE, (__le32 *)buffer);
+	bm_sparse_prepare_merge(device->bitmap, peer_device->bitmap_index, start, end,
+				(__le32 *)buffer);
+	bm_op(device, peer_device->bitmap_index, start, end, BM_OP_MERGE, (__le32 *)buffer);
 }
 
 /* copy number words from the bitmap starting at offset into the buffer.
@@ -1082,39 +1639,60 @@ static void drbd_bm_endio(struct bio *bio)
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
 	unsigned int idx = bm_page_to_idx(bio->bi_io_vec[0].bv_page);
+	struct page *page = b->bm_pages[idx];
+	bool reclaim = false;
 
 	blk_status_t status = bio->bi_status;
 
 	if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
-	    !bm_test_page_unchanged(b->bm_pages[idx]))
+	    !bm_test_page_unchanged(page))
 		drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
 
 	if (status) {
 		/* ctx error will hold the completed-last non-zero error code,
 		 * in case error codes differ. */
 		ctx->error = blk_status_to_errno(status);
-		bm_set_page_io_err(b->bm_pages[idx]);
+		bm_set_page_io_err(page);
 		/* Not identical to on disk version of it.
 		 * Is BM_PAGE_IO_ERROR enough? */
 		if (drbd_ratelimit())
 			drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
 				 status, idx);
 	} else {
-		bm_clear_page_io_err(b->bm_pages[idx]);
+		bm_clear_page_io_err(page);
 		dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
+		/* read in a sparse bitmap, and not a single bit set on it */
+		if (idx < ctx->count_pages)
+			reclaim = !bm_count_read_page(ctx, idx) && (b->bm_flags & BM_SPARSE);
+		else
+			reclaim = (ctx->flags & BM_AIO_READ) && (b->bm_flags & BM_SPARSE) &&
+				bm_page_all_zero(page);
 	}
 
-	bm_page_unlock_io(device, idx);
+	bm_page_unlock_io(b, page);
 
 	if (ctx->flags & BM_AIO_COPY_PAGES)
 		mempool_free(bio->bi_io_vec[0].bv_page, &drbd_md_io_page_pool);
 
 	bio_put(bio);
 
+	if (reclaim) {
+		unsigned long flags;
+
+		/* nobody else uses the bitmap while it is read in */
+		spin_lock_irqsave(&b->bm_lock, flags);
+		WRITE_ONCE(b->bm_pages[idx], NULL);
+		spin_unlock_irqrestore(&b->bm_lock, flags);
+		bm_sparse_free_page(page);
+	}
+
 	if (atomic_dec_and_test(&ctx->in_flight)) {
 		ctx->done = 1;
 		wake_up(&device->misc_wait);
 		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
+	} else if ((b->bm_flags & BM_SPARSE) && (ctx->flags & BM_AIO_READ)) {
+		/* bm_rw_range() limits the pages in flight */
+		wake_up(&device->misc_wait);
 	}
 }
 
@@ -1131,11 +1709,11 @@ static inline sector_t drbd_md_last_bitmap_sector(struct drbd_backing_dev *bdev)
 	}
 }
 
-static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_hold(local)
+static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr, struct page *bm_page)
+	__must_hold(local)
 {
 	struct bio *bio;
 	struct drbd_device *device = ctx->device;
-	struct drbd_bitmap *b = device->bitmap;
 	struct page *page;
 	sector_t last_bm_sect;
 	sector_t first_bm_sect;
@@ -1162,7 +1740,7 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 				 "page idx %u, sector %llu\n", page_nr, (unsigned long long) on_disk_sector);
 		}
 		ctx->error = -EIO;
-		bm_set_page_io_err(b->bm_pages[page_nr]);
+		bm_set_page_io_err(bm_page);
 		if (atomic_dec_and_test(&ctx->in_flight)) {
 			ctx->done = 1;
 			wake_up(&device->misc_wait);
@@ -1172,18 +1750,18 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 	}
 
 	/* serialize IO on this page */
-	bm_page_lock_io(device, page_nr);
+	bm_page_lock_io(device->bitmap, bm_page);
 	/* before memcpy and submit,
 	 * so it can be redirtied any time */
-	bm_set_page_unchanged(b->bm_pages[page_nr]);
+	bm_set_page_unchanged(bm_page);
 
 	if (ctx->flags & BM_AIO_COPY_PAGES) {
 		page = mempool_alloc(&drbd_md_io_page_pool,
 				GFP_NOIO | __GFP_HIGHMEM);
-		copy_highpage(page, b->bm_pages[page_nr]);
+		copy_highpage(page, bm_page);
 		bm_store_page_idx(page, page_nr);
 	} else
-		page = b->bm_pages[page_nr];
+		page = bm_page;
 
 	bio = bio_alloc_bioset(device->ldev->md_bdev, 1, op, GFP_NOIO,
 		&drbd_md_io_bio_set);
@@ -1207,6 +1785,132 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 	}
 }
 
+/* with a sparse bitmap, pages are allocated for reading them in */
+#define BM_SPARSE_READ_IN_FLIGHT	64
+
+/* Submit IO for all pages from @start_page to @end_page that @ctx asks for.
+ * Not for BM_AIO_WRITE_HINTED. Returns the number of pages submitted. */
+static unsigned int bm_rw_pages(struct drbd_bm_aio_ctx *ctx,
+	unsigned int start_page, unsigned int end_page) __must_hold(local)
+{
+	struct drbd_device *device = ctx->device;
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int i, count = 0;
+
+	if (ctx->flags & BM_AIO_READ) {
+		for (i = start_page; i <= end_page; i++) {
+			struct page *page = b->bm_pages[i];
+
+			if (b->bm_flags & BM_SPARSE) {
+				/* Only all zero pages get reclaimed right away
+				 * on completion, limit the memory used until then */
+				wait_event(device->misc_wait,
+					   atomic_read(&ctx->in_flight) <= BM_SPARSE_READ_IN_FLIGHT);
+				if (!page)
+					page = bm_sparse_materialize_noio(b, i);
+			}
+			atomic_inc(&ctx->in_flight);
+			bm_page_io_async(ctx, i, page);
+			++count;
+			cond_resched();
+		}
+		return count;
+	}
+
+	for (i = start_page; i <= end_page; i++) {
+		struct page *page = READ_ONCE(b->bm_pages[i]);
+
+		/* an absent page is all zero on disk already,
+		 * unless specifically requested to write ALL pages */
+		if (!page) {
+			if (!(ctx->flags & BM_AIO_WRITE_ALL_PAGES))
+				continue;
+			page = bm_sparse_materialize_noio(b, i);
+		}
+		/* ignore completely unchanged pages,
+		 * unless specifically requested to write ALL pages */
+		if (!(ctx->flags & BM_AIO_WRITE_ALL_PAGES) &&
+		    bm_test_page_unchanged(page)) {
+			dynamic_drbd_dbg(device, "skipped bm write for idx %u\n", i);
+			continue;
+		}
+		/* during lazy writeout,
+		 * ignore those pages not marked for lazy writeout. */
+		if ((ctx->flags & BM_AIO_WRITE_LAZY) &&
+		    !bm_test_page_lazy_writeout(page)) {
+			dynamic_drbd_dbg(device, "skipped bm lazy write for idx %u\n", i);
+			continue;
+		}
+		atomic_inc(&ctx->in_flight);
+		bm_page_io_async(ctx, i, page);
+		++count;
+		cond_resched();
+	}
+	return count;
+}
+
+/* Reading or writing out the whole bitmap is split across workers,
+ * each one taking at least this many pages */
+#define BM_RW_PAGES_PER_WORKER	1024
+#define BM_RW_MAX_WORKERS	16
+
+struct bm_rw_work {
+	struct work_struct w;
+	struct drbd_bm_aio_ctx *ctx;
+	unsigned int start_page, end_page;
+	unsigned int count;
+};
+
+static void bm_rw_work_fn(struct work_struct *w)
+{
+	struct bm_rw_work *work = container_of(w, struct bm_rw_work, w);
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	work->count = bm_rw_pages(work->ctx, work->start_page, work->end_page);
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Like bm_rw_pages(), but for large bitmaps from several workers at once,
+ * so that one submitter does not limit the IO depth. Each worker runs on
+ * the node that holds its pages (see bm_page_node()), and allocates pages
+ * of a sparse bitmap there as well.
+ */
+static unsigned int bm_rw_pages_parallel(struct drbd_bm_aio_ctx *ctx,
+	unsigned int start_page, unsigned int end_page) __must_hold(local)
+{
+	struct drbd_bitmap *b = ctx->device->bitmap;
+	unsigned int pages = end_page - start_page + 1;
+	unsigned int nr, i, chunk, count = 0;
+	struct bm_rw_work *work;
+
+	nr = min3(num_online_cpus(), (unsigned int)BM_RW_MAX_WORKERS,
+		  pages / BM_RW_PAGES_PER_WORKER);
+	if (nr < 2)
+		return bm_rw_pages(ctx, start_page, end_page);
+
+	work = kcalloc(nr, sizeof(*work), GFP_NOIO);
+	if (!work)
+		return bm_rw_pages(ctx, start_page, end_page);
+
+	chunk = DIV_ROUND_UP(pages, nr);
+	for (i = 0; i < nr; i++) {
+		work[i].ctx = ctx;
+		work[i].start_page = start_page + i * chunk;
+		work[i].end_page = min(work[i].start_page + chunk - 1, end_page);
+		INIT_WORK(&work[i].w, bm_rw_work_fn);
+		queue_work_node(bm_page_node(work[i].start_page, b->bm_number_of_pages),
+				drbd_bm_io_wq, &work[i].w);
+	}
+	for (i = 0; i < nr; i++) {
+		flush_work(&work[i].w);
+		count += work[i].count;
+	}
+	kfree(work);
+	return count;
+}
+
 /**
  * bm_rw_range() - read/write the specified range of bitmap pages
  * @device: drbd device this bitmap is associated with
@@ -1289,52 +1993,43 @@ static int bm_rw_range(struct drbd_device *device,
 
 	/* let the layers below us try to merge these bios... */
 
+	spin_lock_irq(&b->bm_lock);
+	b->bm_io_users++;
+	spin_unlock_irq(&b->bm_lock);
+
 	if (flags & BM_AIO_READ) {
-		for (i = start_page; i <= end_page; i++) {
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
-			++count;
-			cond_resched();
-		}
+		/* count the bits as the pages come in, instead of afterwards */
+		if (start_page == 0 && end_page == b->bm_number_of_pages - 1)
+			ctx->count_pages = bm_full_pages(b);
+		count = bm_rw_pages_parallel(ctx, start_page, end_page);
 	} else if (flags & BM_AIO_WRITE_HINTED) {
 		/* ASSERT: BM_AIO_WRITE_ALL_PAGES is not set. */
 		unsigned int hint;
 		for (hint = 0; hint < b->n_bitmap_hints; hint++) {
+			struct page *page;
+
 			i = b->al_bitmap_hints[hint];
 			if (i > end_page)
 				continue;
+			/* absent from a sparse bitmap, i.e. unchanged */
+			page = READ_ONCE(b->bm_pages[i]);
+			if (!page)
+				continue;
 			/* Several AL-extents may point to the same page. */
 			if (!test_and_clear_bit(BM_PAGE_HINT_WRITEOUT,
-			    &page_private(b->bm_pages[i])))
+			    &page_private(page)))
 				continue;
 			/* Has it even changed? */
-			if (bm_test_page_unchanged(b->bm_pages[i]))
+			if (bm_test_page_unchanged(page))
 				continue;
 			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
+			bm_page_io_async(ctx, i, page);
 			++count;
 		}
+	} else if (flags & BM_AIO_WRITE_LAZY) {
+		count = bm_rw_pages(ctx, start_page, end_page);
 	} else {
-		for (i = start_page; i <= end_page; i++) {
-			/* ignore completely unchanged pages,
-			 * unless specifically requested to write ALL pages */
-			if (!(flags & BM_AIO_WRITE_ALL_PAGES) &&
-			    bm_test_page_unchanged(b->bm_pages[i])) {
-				dynamic_drbd_dbg(device, "skipped bm write for idx %u\n", i);
-				continue;
-			}
-			/* during lazy writeout,
-			 * ignore those pages not marked for lazy writeout. */
-			if ((flags & BM_AIO_WRITE_LAZY) &&
-			    !bm_test_page_lazy_writeout(b->bm_pages[i])) {
-				dynamic_drbd_dbg(device, "skipped bm lazy write for idx %u\n", i);
-				continue;
-			}
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
-			++count;
-			cond_resched();
-		}
+		count = bm_rw_pages_parallel(ctx, start_page, end_page);
 	}
 
 	/*
@@ -1369,9 +2064,32 @@ static int bm_rw_range(struct drbd_device *device,
 	if (atomic_read(&ctx->in_flight))
 		err = -EIO; /* Disk timeout/force-detach during IO... */
 
+	if (b->bm_flags & BM_SPARSE) {
+		LIST_HEAD(to_free);
+
+		/* pages written back with no bit set can go */
+		if (!err && !(flags & (BM_AIO_READ | BM_AIO_WRITE_HINTED)))
+			bm_sparse_reclaim(device, start_page, end_page);
+		spin_lock_irq(&b->bm_lock);
+		b->bm_io_users--;
+		bm_sparse_free_reclaimed(b, &to_free);
+		spin_unlock_irq(&b->bm_lock);
+		bm_sparse_free_list(&to_free);
+	} else {
+		spin_lock_irq(&b->bm_lock);
+		b->bm_io_users--;
+		spin_unlock_irq(&b->bm_lock);
+	}
+
 	if (flags & BM_AIO_READ) {
 		now = jiffies;
-		bm_count_bits(device);
+		if (ctx->count_pages && !err) {
+			for (i = 0; i < b->bm_max_peers; i++)
+				b->bm_set[i] = atomic_long_read(&ctx->bm_set[i]);
+			bm_count_bits_tail(device, ctx->count_pages);
+		} else {
+			bm_count_bits(device);
+		}
 		drbd_info(device, "recounting of set bits took additional %ums\n",
 		     jiffies_to_msecs(jiffies - now));
 	}
@@ -1398,8 +2116,11 @@ int drbd_bm_read(struct drbd_device *device,
 static void push_al_bitmap_hint(struct drbd_device *device, unsigned int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page = b->bm_pages[page_nr];
+	struct page *page = READ_ONCE(b->bm_pages[page_nr]);
 	BUG_ON(b->n_bitmap_hints >= ARRAY_SIZE(b->al_bitmap_hints));
+	/* absent pages are unchanged, nothing to write */
+	if (!page)
+		return;
 	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, &page_private(page)))
 		b->al_bitmap_hints[b->n_bitmap_hints++] = page_nr;
 }
@@ -1429,6 +2150,34 @@ void drbd_bm_mark_range_for_writeout(struct drbd_device *device, unsigned long s
 		push_al_bitmap_hint(device, page_nr);
 }
 
+/**
+ * drbd_bm_sparse_prepare() - Have the bitmap pages of a range present
+ * @device:	DRBD device.
+ * @start:	First bit of the range.
+ * @end:	Last bit of the range.
+ *
+ * With a sparse bitmap, allocates the pages holding these bits of all slots,
+ * so that setting bits on them later, maybe in atomic context, needs no
+ * allocation. May sleep.
+ */
+void drbd_bm_sparse_prepare(struct drbd_device *device, unsigned long start, unsigned long end)
+{
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int page_nr, last_page;
+
+	if (!b || !(b->bm_flags & BM_SPARSE) || start >= b->bm_bits)
+		return;
+	if (end >= b->bm_bits)
+		end = b->bm_bits - 1;
+
+	page_nr = bit_to_page_interleaved(b, 0, start);
+	last_page = bit_to_page_interleaved(b, b->bm_max_peers - 1, end);
+	for (; page_nr <= last_page; page_nr++) {
+		if (bm_page_absent(b, page_nr))
+			bm_sparse_materialize_noio(b, page_nr);
+	}
+}
+
 
 /**
  * drbd_bm_write() - Write the whole bitmap to its on disk location.
@@ -1532,12 +2281,24 @@ __bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigne
 	if (end >= bitmap->bm_bits)
 		end = bitmap->bm_bits - 1;
 
+	/* The whole slot gets set below, with no bits lost on the way */
+	if (op == BM_OP_SET && start == 0 && end == bitmap->bm_bits - 1)
+		clear_bit(bitmap_index, &bitmap->bm_lost_slots);
+
 	while (bit <= end) {
 		unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
+		unsigned int page_nr = bit_to_page_interleaved(bitmap, bitmap_index, bit);
 
 		if (end < last_bit)
 			last_bit = end;
 
+		/* allocate here rather than with GFP_ATOMIC in __bm_op() */
+		while (op == BM_OP_SET && bm_page_absent(bitmap, page_nr)) {
+			spin_unlock_irq(&bitmap->bm_lock);
+			bm_sparse_materialize_noio(bitmap, page_nr);
+			spin_lock_irq(&bitmap->bm_lock);
+		}
+
 		__bm_op(device, bitmap_index, bit, last_bit, op, NULL);
 		bit = last_bit + 1;
 		if (need_resched()) {
@@ -1641,6 +2402,7 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 	spin_lock_irq(&bitmap->bm_lock);
 
 	bitmap->bm_set[to_index] = 0;
+	bitmap_zero(bm_summary(bitmap, to_index), bitmap->bm_number_of_pages);
 	current_page_nr = 0;
 	addr = bm_map(bitmap, current_page_nr);
 	for (word_nr = 0; word_nr < words32_total; word_nr += bitmap->bm_max_peers) {
@@ -1667,9 +2429,21 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 			addr = bm_map(bitmap, current_page_nr);
 		}
 
-		if (addr[word32_in_page(to_word_nr)] != data_word)
+		if (addr[word32_in_page(to_word_nr)] != data_word) {
+			if (bm_page_absent(bitmap, current_page_nr)) {
+				bm_unmap(bitmap, addr);
+				do {
+					spin_unlock_irq(&bitmap->bm_lock);
+					bm_sparse_materialize_noio(bitmap, current_page_nr);
+					spin_lock_irq(&bitmap->bm_lock);
+				} while (bm_page_absent(bitmap, current_page_nr));
+				addr = bm_map(bitmap, current_page_nr);
+			}
 			bm_set_page_need_writeout(bitmap, current_page_nr);
-		addr[word32_in_page(to_word_nr)] = data_word;
+			addr[word32_in_page(to_word_nr)] = data_word;
+		}
+		if (data_word)
+			__set_bit(current_page_nr, bm_summary(bitmap, to_index));
 		bitmap->bm_set[to_index] += hweight32(data_word);
 	}
 	bm_unmap(bitmap, addr);
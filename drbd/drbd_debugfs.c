@@ -25,6 +25,7 @@ static struct dentry *drbd_debugfs_refcounts;
 static struct dentry *drbd_debugfs_resources;
 static struct dentry *drbd_debugfs_minors;
 static struct dentry *drbd_debugfs_compat;
+static struct dentry *drbd_debugfs_request_cache;
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 static void seq_print_age_or_dash(struct seq_file *m, bool valid, ktime_t dt)
@@ -68,6 +69,7 @@ static void seq_print_request_state(struct seq_file *m, struct drbd_request *req
 	__seq_print_rq_state_bit(m, req->master_bio, &sep, "pending", "completed");
 	seq_print_rq_state_bit(m, s & RQ_POSTPONED, &sep, "postponed");
 	seq_print_rq_state_bit(m, s & RQ_COMPLETION_SUSP, &sep, "suspended");
+	seq_print_rq_state_bit(m, s & RQ_HEDGED, &sep, "hedged");
 
 	/* RQ_WRITE ignored, already reported */
 	seq_puts(m, "\tlocal:");
@@ -81,7 +83,7 @@ static void seq_print_request_state(struct seq_file *m, struct drbd_request *req
 		seq_puts(m, " -");
 
 	for_each_peer_device(peer_device, device) {
-		s = req->net_rq_state[peer_device->node_id];
+		s = req_net_state(req, peer_device->node_id);
 		seq_printf(m, "\tnet[%d]:", peer_device->node_id);
 		sep = ' ';
 		seq_print_rq_state_bit(m, s & RQ_NET_PENDING, &sep, "pending");
@@ -98,27 +100,27 @@ static void seq_print_request_state(struct seq_file *m, struct drbd_request *req
 		seq_print_rq_state_bit(m, s & RQ_EXP_RECEIVE_ACK, &sep, "B");
 		seq_print_rq_state_bit(m, s & RQ_EXP_WRITE_ACK, &sep, "C");
 		seq_print_rq_state_bit(m, s & RQ_EXP_BARR_ACK, &sep, "barr");
+		seq_print_rq_state_bit(m, s & RQ_EXP_READ_REPLY, &sep, "lost");
+		seq_print_rq_state_bit(m, s & RQ_NET_COALESCED, &sep, "coalesced");
 		if (sep == ' ')
 			seq_puts(m, " -");
 	}
 	seq_putc(m, '\n');
 }
 
-#define memberat(PTR, TYPE, OFFSET) (*(TYPE *)((char *)PTR + OFFSET))
-
 #ifdef CONFIG_DRBD_TIMING_STATS
 static void print_one_age_or_dash(struct seq_file *m, struct drbd_request *req,
 				  unsigned int set_mask, unsigned int clear_mask,
-				  ktime_t now, size_t offset)
+				  ktime_t now, ktime_t *kt)
 {
 	struct drbd_device *device = req->device;
 	struct drbd_peer_device *peer_device;
 
 	for_each_peer_device(peer_device, device) {
-		unsigned int s = req->net_rq_state[peer_device->node_id];
+		unsigned int s = req_net_state(req, peer_device->node_id);
 
 		if (s & set_mask && !(s & clear_mask)) {
-			ktime_t ktime = ktime_sub(now, memberat(req, ktime_t, offset));
+			ktime_t ktime = ktime_sub(now, kt[peer_device->node_id]);
 			seq_printf(m, "\t[%d]%d", peer_device->node_id, (int)ktime_to_ms(ktime));
 			return;
 		}
@@ -147,9 +149,9 @@ static void seq_print_one_request(struct seq_file *m, struct drbd_request *req,
 	seq_print_age_or_dash(m, s & RQ_LOCAL_PENDING, ktime_sub(now, req->pre_submit_kt));
 
 #define RQ_HDR_3 "\tsent\tacked\tdone"
-	print_one_age_or_dash(m, req, RQ_NET_SENT, 0, now, offsetof(typeof(*req), pre_send_kt));
-	print_one_age_or_dash(m, req, RQ_NET_SENT, RQ_NET_PENDING, now, offsetof(typeof(*req), acked_kt));
-	print_one_age_or_dash(m, req, RQ_NET_DONE, 0, now, offsetof(typeof(*req), net_done_kt));
+	print_one_age_or_dash(m, req, RQ_NET_SENT, 0, now, req->pre_send_kt);
+	print_one_age_or_dash(m, req, RQ_NET_SENT, RQ_NET_PENDING, now, req->acked_kt);
+	print_one_age_or_dash(m, req, RQ_NET_DONE, 0, now, req->net_done_kt);
 #else
 #define RQ_HDR_2 "\tstart"
 #define RQ_HDR_3 ""
@@ -403,7 +405,7 @@ static void seq_print_resource_transfer_log_summary(struct seq_file *m,
 			tmp |= 2;
 
 		for_each_peer_device_rcu(peer_device, device) {
-			s = READ_ONCE(req->net_rq_state[peer_device->node_id]);
+			s = req_net_state(req, peer_device->node_id);
 			if (s & RQ_NET_MASK) {
 				if (!(s & RQ_NET_SENT))
 					tmp |= 4;
@@ -594,6 +596,58 @@ static int resource_members_show(struct seq_file *m, void *pos)
 	return 0;
 }
 
+static int resource_al_group_commit_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+	struct drbd_al_group *grp = &resource->al_group;
+	unsigned int commits, transactions;
+
+	spin_lock_irq(&grp->lock);
+	commits = grp->commits;
+	transactions = grp->transactions;
+	spin_unlock_irq(&grp->lock);
+
+	seq_printf(m, "enabled: %s\n", drbd_al_group_commit ? "yes" : "no");
+	seq_printf(m, "%u transactions in %u commits\n", transactions, commits);
+	return 0;
+}
+
+static int resource_read_weights_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_resource *resource = m->private;
+	int node_id;
+
+	seq_puts(m, "# node-id weight; write \"<node-id> <weight>\" to change, 0 means 100\n");
+	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
+		unsigned int weight = READ_ONCE(resource->read_weights[node_id]);
+
+		if (weight)
+			seq_printf(m, "%d %u\n", node_id, weight);
+	}
+	return 0;
+}
+
+static ssize_t resource_read_weights_write(struct file *file, const char __user *ubuf,
+					   size_t cnt, loff_t *ppos)
+{
+	struct drbd_resource *resource = file_inode(file)->i_private;
+	unsigned int node_id, weight;
+	char buffer[32];
+
+	if (cnt >= sizeof(buffer))
+		return -EINVAL;
+	if (copy_from_user(buffer, ubuf, cnt))
+		return -EFAULT;
+	buffer[cnt] = '\0';
+
+	if (sscanf(buffer, "%u %u", &node_id, &weight) != 2 || node_id >= DRBD_NODE_ID_MAX)
+		return -EINVAL;
+	WRITE_ONCE(resource->read_weights[node_id], weight);
+
+	*ppos += cnt;
+	return cnt;
+}
+
 /* make sure at *open* time that the respective object won't go away. */
 static int drbd_single_open(struct file *file, int (*show)(struct seq_file *, void *),
 		                void *data, struct kref *kref,
@@ -631,7 +685,7 @@ static int resource_attr_release(struct inode *inode, struct file *file)
 	return single_release(inode, file);
 }
 
-#define drbd_debugfs_resource_attr(name)				\
+#define __drbd_debugfs_resource_attr(name, write_fn)			\
 static int resource_ ## name ## _open(struct inode *inode, struct file *file) \
 {									\
 	struct drbd_resource *resource = inode->i_private;		\
@@ -641,15 +695,19 @@ static int resource_ ## name ## _open(struct inode *inode, struct file *file) \
 static const struct file_operations resource_ ## name ## _fops = {	\
 	.owner		= THIS_MODULE,					\
 	.open		= resource_ ## name ## _open,			\
+	.write		= write_fn,					\
 	.read		= seq_read,					\
 	.llseek		= seq_lseek,					\
 	.release	= resource_attr_release,			\
 };
+#define drbd_debugfs_resource_attr(name) __drbd_debugfs_resource_attr(name, NULL)
 
 drbd_debugfs_resource_attr(in_flight_summary)
 drbd_debugfs_resource_attr(state_twopc)
 drbd_debugfs_resource_attr(worker_pid)
 drbd_debugfs_resource_attr(members)
+drbd_debugfs_resource_attr(al_group_commit)
+__drbd_debugfs_resource_attr(read_weights, resource_read_weights_write)
 
 #define drbd_dcf(top, obj, attr, perm) do {			\
 	dentry = debugfs_create_file(#attr, perm,		\
@@ -687,6 +745,8 @@ void drbd_debugfs_resource_add(struct drbd_resource *resource)
 	res_dcf(state_twopc);
 	res_dcf(worker_pid);
 	res_dcf(members);
+	res_dcf(al_group_commit);
+	drbd_dcf(resource->debugfs_res, resource, read_weights, 0600);
 }
 
 static void drbd_debugfs_remove(struct dentry **dp)
@@ -705,6 +765,8 @@ void drbd_debugfs_resource_cleanup(struct drbd_resource *resource)
 	 * and call debugfs_remove on all of them separately.
 	 */
 	/* it is ok to call debugfs_remove(NULL) */
+	drbd_debugfs_remove(&resource->debugfs_res_read_weights);
+	drbd_debugfs_remove(&resource->debugfs_res_al_group_commit);
 	drbd_debugfs_remove(&resource->debugfs_res_members);
 	drbd_debugfs_remove(&resource->debugfs_res_worker_pid);
 	drbd_debugfs_remove(&resource->debugfs_res_state_twopc);
@@ -896,6 +958,36 @@ static int connection_debug_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int connection_congestion_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+	struct drbd_drain_ctl *dc = &connection->drain;
+	unsigned int target_ms = READ_ONCE(drbd_congestion_target_ms);
+	unsigned int out_rate = READ_ONCE(dc->out_rate);
+	unsigned int fill_ms = READ_ONCE(dc->fill_ms);
+	int in_flight = atomic_read(&connection->ap_in_flight);
+
+	seq_puts(m, "content and format of this will change without notice\n");
+
+	seq_printf(m, "        target: %u ms\n", target_ms);
+	seq_printf(m, "       in rate: %u KiB/s\n", READ_ONCE(dc->in_rate) / 2);
+	seq_printf(m, "    drain rate: %u KiB/s\n", out_rate / 2);
+	seq_printf(m, "           rtt: %u us\n", READ_ONCE(dc->rtt_us));
+	seq_printf(m, "  ap_in_flight: %d KiB\n", in_flight / 2);
+	if (fill_ms)
+		seq_printf(m, "  buffer fills: in %u ms\n", fill_ms);
+	else
+		seq_puts(m, "  buffer fills: -\n");
+	if (out_rate && in_flight > 0)
+		seq_printf(m, "backlog drains: in %llu ms\n",
+			   div_u64((u64)in_flight * MSEC_PER_SEC, out_rate));
+	else
+		seq_puts(m, "backlog drains: -\n");
+	seq_printf(m, "  pulled ahead: %u\n", READ_ONCE(dc->pull_ahead_cnt));
+	seq_printf(m, "  early resync: %u\n", READ_ONCE(dc->early_resync_cnt));
+	return 0;
+}
+
 static void pid_show(struct seq_file *m, struct drbd_thread *thi)
 {
 	struct task_struct *task = NULL;
@@ -958,6 +1050,7 @@ drbd_debugfs_connection_attr(oldest_requests)
 drbd_debugfs_connection_attr(callback_history)
 drbd_debugfs_connection_attr(transport)
 drbd_debugfs_connection_attr(debug)
+drbd_debugfs_connection_attr(congestion)
 drbd_debugfs_connection_attr(receiver_pid)
 drbd_debugfs_connection_attr(ack_receiver_pid)
 drbd_debugfs_connection_attr(sender_pid)
@@ -982,6 +1075,7 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 	conn_dcf(oldest_requests);
 	conn_dcf(transport);
 	conn_dcf(debug);
+	conn_dcf(congestion);
 	conn_dcf(receiver_pid);
 	conn_dcf(ack_receiver_pid);
 	conn_dcf(sender_pid);
@@ -997,6 +1091,7 @@ void drbd_debugfs_connection_cleanup(struct drbd_connection *connection)
 	drbd_debugfs_remove(&connection->debugfs_conn_sender_pid);
 	drbd_debugfs_remove(&connection->debugfs_conn_ack_receiver_pid);
 	drbd_debugfs_remove(&connection->debugfs_conn_receiver_pid);
+	drbd_debugfs_remove(&connection->debugfs_conn_congestion);
 	drbd_debugfs_remove(&connection->debugfs_conn_debug);
 	drbd_debugfs_remove(&connection->debugfs_conn_transport);
 	drbd_debugfs_remove(&connection->debugfs_conn_callback_history);
@@ -1036,11 +1131,26 @@ static int device_act_log_histogram_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
 
+	static const char * const policy_names[AL_POLICY_NR] = {
+		[AL_POLICY_LRU] = "lru",
+		[AL_POLICY_2Q] = "2q",
+	};
+	struct drbd_al_policy *pol = &device->al_policy;
+	int i;
+
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 2);
 
 	if (get_ldev_if_state(device, D_FAILED)) {
 		seq_printf_nice_histogram(m, device->al_histogram, AL_UPDATES_PER_TRANSACTION);
+		seq_putc(m, '\n');
+		spin_lock_irq(&device->al_lock);
+		for (i = 0; i < AL_POLICY_NR; i++)
+			seq_printf(m, "%s: hits:%lu misses:%lu evictions:%lu\n", policy_names[i],
+				   pol->hits[i], pol->misses[i], pol->evictions[i]);
+		seq_printf(m, "2q: a1in:%u ghost_hits:%lu\n", pol->a1in_len, pol->ghost_hits);
+		seq_printf(m, "prefetched: %lu\n", device->al_prefetch.prefetched);
+		spin_unlock_irq(&device->al_lock);
 		put_ldev(device);
 	}
 	return 0;
@@ -1138,14 +1248,22 @@ static void seq_printf_interval_tree(struct seq_file *m, struct rb_root *root)
 static int device_interval_tree_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
+	int i;
 
-	spin_lock_irq(&device->interval_lock);
+	/* one shard at a time, the dump need not be a consistent snapshot */
 	seq_puts(m, "Write requests:\n");
-	seq_printf_interval_tree(m, &device->write_requests);
+	for (i = 0; i <= DRBD_INTERVAL_SHARDS; i++) {
+		spin_lock_irq(&device->interval_shards[i].lock);
+		seq_printf_interval_tree(m, &device->interval_shards[i].write_requests);
+		spin_unlock_irq(&device->interval_shards[i].lock);
+	}
 	seq_putc(m, '\n');
 	seq_puts(m, "Read requests:\n");
-	seq_printf_interval_tree(m, &device->read_requests);
-	spin_unlock_irq(&device->interval_lock);
+	for (i = 0; i <= DRBD_INTERVAL_SHARDS; i++) {
+		spin_lock_irq(&device->interval_shards[i].lock);
+		seq_printf_interval_tree(m, &device->interval_shards[i].read_requests);
+		spin_unlock_irq(&device->interval_shards[i].lock);
+	}
 
 	return 0;
 }
@@ -1459,9 +1577,10 @@ static int peer_device_resync_extents_show(struct seq_file *m, void *ignored)
 	struct drbd_device *device = peer_device->device;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 2);
 
 	if (get_ldev_if_state(device, D_FAILED)) {
+		seq_printf(m, "priority: %u\n", READ_ONCE(peer_device->rs_prio_count));
 		lc_seq_printf_stats(m, peer_device->resync_lru);
 		lc_seq_dump_details(m, peer_device->resync_lru, "rs_left flags", resync_dump_detail);
 		put_ldev(device);
@@ -1493,7 +1612,7 @@ static void drbd_get_syncer_progress(struct drbd_peer_device *pd,
 	*rs_total = pd->rs_total;
 
 	/* note: both rs_total and rs_left are in bits, i.e. in
-	 * units of BM_BLOCK_SIZE.
+	 * units of bm_block_size().
 	 * for the percentage, we don't care. */
 
 	if (repl_state == L_VERIFY_S || repl_state == L_VERIFY_T)
@@ -1529,6 +1648,7 @@ static void drbd_get_syncer_progress(struct drbd_peer_device *pd,
 static void drbd_syncer_progress(struct drbd_peer_device *pd, struct seq_file *seq,
 		enum drbd_repl_state repl_state)
 {
+	struct drbd_bitmap *bm = pd->device->bitmap;
 	unsigned long db, dt, dbdt, rt, rs_total, rs_left;
 	unsigned int res;
 	int i, x, y;
@@ -1553,14 +1673,14 @@ static void drbd_syncer_progress(struct drbd_peer_device *pd, struct seq_file *s
 	seq_printf(seq, "%3u.%u%% ", res / 10, res % 10);
 
 	/* if more than a few GB, display in MB */
-	if (rs_total > (4UL << (30 - BM_BLOCK_SHIFT)))
+	if (rs_total > (4UL << (30 - bm->bm_block_shift)))
 		seq_printf(seq, "(%lu/%lu)M",
-			    (unsigned long) Bit2KB(rs_left >> 10),
-			    (unsigned long) Bit2KB(rs_total >> 10));
+			    bm_bit_to_kb(bm, rs_left >> 10),
+			    bm_bit_to_kb(bm, rs_total >> 10));
 	else
 		seq_printf(seq, "(%lu/%lu)K",
-			    (unsigned long) Bit2KB(rs_left),
-			    (unsigned long) Bit2KB(rs_total));
+			    bm_bit_to_kb(bm, rs_left),
+			    bm_bit_to_kb(bm, rs_total));
 
 	seq_puts(seq, "\n\t");
 
@@ -1590,7 +1710,7 @@ static void drbd_syncer_progress(struct drbd_peer_device *pd, struct seq_file *s
 	seq_printf(seq, "finish: %lu:%02lu:%02lu",
 		rt / 3600, (rt % 3600) / 60, rt % 60);
 
-	dbdt = Bit2KB(db/dt);
+	dbdt = bm_bit_to_kb(bm, db/dt);
 	seq_puts(seq, " speed: ");
 	seq_printf_with_thousands_grouping(seq, dbdt);
 	seq_puts(seq, " (");
@@ -1602,7 +1722,7 @@ static void drbd_syncer_progress(struct drbd_peer_device *pd, struct seq_file *s
 		if (!dt)
 			dt++;
 		db = pd->rs_mark_left[i] - rs_left;
-		dbdt = Bit2KB(db/dt);
+		dbdt = bm_bit_to_kb(bm, db/dt);
 		seq_printf_with_thousands_grouping(seq, dbdt);
 		seq_puts(seq, " -- ");
 	}
@@ -1614,7 +1734,7 @@ static void drbd_syncer_progress(struct drbd_peer_device *pd, struct seq_file *s
 	if (dt == 0)
 		dt = 1;
 	db = rs_total - rs_left;
-	dbdt = Bit2KB(db/dt);
+	dbdt = bm_bit_to_kb(bm, db/dt);
 	seq_printf_with_thousands_grouping(seq, dbdt);
 	seq_putc(seq, ')');
 
@@ -1643,8 +1763,8 @@ static void drbd_syncer_progress(struct drbd_peer_device *pd, struct seq_file *s
 		seq_printf(seq,
 			"\t%3d%% sector pos: %llu/%llu",
 			(int)(bit_pos / (bm_bits/100+1)),
-			(unsigned long long)bit_pos * BM_SECT_PER_BIT,
-			(unsigned long long)bm_bits * BM_SECT_PER_BIT);
+			(unsigned long long)bm_bit_to_sect(bm, bit_pos),
+			(unsigned long long)bm_bit_to_sect(bm, bm_bits));
 		if (stop_sector != 0 && stop_sector != ULLONG_MAX)
 			seq_printf(seq, " stop sector: %llu", stop_sector);
 		seq_putc(seq, '\n');
@@ -1710,7 +1830,7 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 		   device->resource->write_ordering
 		);
 		seq_printf(m, " oos:%llu\n",
-			   Bit2KB((unsigned long long)
+			   (unsigned long long)bm_bit_to_kb(device->bitmap,
 				   drbd_bm_total_weight(peer_device)));
 	}
 	if (state.conn == L_SYNC_SOURCE ||
@@ -1833,6 +1953,37 @@ static const struct file_operations drbd_refcounts_fops = {
 	.release = single_release,
 };
 
+static int drbd_request_cache_show(struct seq_file *m, void *ignored)
+{
+	int i;
+
+	seq_puts(m, "slots\thits\tmisses\thit%\trecycled\treleased\n");
+	for (i = 0; i < DRBD_REQ_POOLS; i++) {
+		struct drbd_req_cache_stats st;
+		unsigned long total;
+
+		drbd_request_cache_stats(i, &st);
+		total = st.hits + st.misses;
+		seq_printf(m, "%u\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+			   1U << (i + DRBD_REQ_SLOTS_MIN_SHIFT), st.hits, st.misses,
+			   total ? st.hits * 100 / total : 0, st.recycled, st.released);
+	}
+	return 0;
+}
+
+static int drbd_request_cache_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, drbd_request_cache_show, NULL);
+}
+
+static const struct file_operations drbd_request_cache_fops = {
+	.owner = THIS_MODULE,
+	.open = drbd_request_cache_open,
+	.llseek = seq_lseek,
+	.read = seq_read,
+	.release = single_release,
+};
+
 static int drbd_compat_show(struct seq_file *m, void *ignored)
 {
 	return 0;
@@ -1856,6 +2007,7 @@ static const struct file_operations drbd_compat_fops = {
 void drbd_debugfs_cleanup(void)
 {
 	drbd_debugfs_remove(&drbd_debugfs_compat);
+	drbd_debugfs_remove(&drbd_debugfs_request_cache);
 	drbd_debugfs_remove(&drbd_debugfs_resources);
 	drbd_debugfs_remove(&drbd_debugfs_minors);
 	drbd_debugfs_remove(&drbd_debugfs_version);
@@ -1876,6 +2028,9 @@ void __init drbd_debugfs_init(void)
 	dentry = debugfs_create_file("reference_counts", 0444, drbd_debugfs_root, NULL, &drbd_refcounts_fops);
 	drbd_debugfs_refcounts = dentry;
 
+	dentry = debugfs_create_file("request_cache", 0444, drbd_debugfs_root, NULL, &drbd_request_cache_fops);
+	drbd_debugfs_request_cache = dentry;
+
 	dentry = debugfs_create_dir("resources", drbd_debugfs_root);
 	drbd_debugfs_resources = dentry;
 
@@ -46,6 +46,18 @@
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
+extern bool drbd_read_balance_latency;
+extern unsigned int drbd_read_hedge_delay_us;
+extern unsigned int drbd_coalesce_writes_kb;
+extern unsigned int drbd_congestion_target_ms;
+extern bool drbd_al_group_commit;
+extern bool drbd_al_pipeline;
+extern unsigned int drbd_al_policy;
+extern unsigned int drbd_al_prefetch_extents;
+extern unsigned int drbd_al_extent_mb;
+extern bool drbd_al_percpu_refs;
+extern unsigned int drbd_al_warm_extents;
+extern bool drbd_bitmap_sparse;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -79,6 +91,7 @@ enum {
 
 struct drbd_device;
 struct drbd_connection;
+struct drbd_rs_batch;
 
 /* I want to be able to grep for "drbd $resource_name"
  * and get all relevant log lines. */
@@ -247,7 +260,7 @@ struct drbd_request {
 	struct bio *private_bio;
 
 	/* Fields sector and size are "immutable". Other fields protected
-	 * by interval_lock. */
+	 * by the interval shard locks, see drbd_lock_intervals(). */
 	struct drbd_interval i;
 
 	/* epoch: used to check on "completion" whether this req was in
@@ -281,9 +294,16 @@ struct drbd_request {
 	 * protected by the locks for those lists */
 	struct list_head list;
 
+	/* submit shard this request was queued on, see drbd_queue_write() */
+	unsigned int submit_cpu;
+
 	/* master bio pointer; "immutable" */
 	struct bio *master_bio;
 
+	/* stable copy of a WRITE payload, if data-integrity is enabled;
+	 * see drbd_send_dblock(), freed on master bio completion */
+	struct drbd_req_snapshot *snapshot;
+
 	/* see struct drbd_device */
 	struct list_head req_pending_master_completion;
 	struct list_head req_pending_local;
@@ -293,7 +313,11 @@ struct drbd_request {
 
 	/* for request_timer_fn() */
 	unsigned long pre_submit_jif;
-	unsigned long pre_send_jif[DRBD_PEERS_MAX];
+	/* when a READ was handed to the local disk or queued for a peer,
+	 * for the read latency averages used in read balancing */
+	ktime_t read_issue_kt;
+	/* per-node arrays below point into node_area[], see drbd_req_new() */
+	unsigned long *pre_send_jif;
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 	/* for DRBD internal statistics */
@@ -306,9 +330,9 @@ struct drbd_request {
 	ktime_t pre_submit_kt;
 
 	/* per connection */
-	ktime_t pre_send_kt[DRBD_PEERS_MAX];
-	ktime_t acked_kt[DRBD_PEERS_MAX];
-	ktime_t net_done_kt[DRBD_PEERS_MAX];
+	ktime_t *pre_send_kt;
+	ktime_t *acked_kt;
+	ktime_t *net_done_kt;
 #endif
 	/* Possibly even more detail to track each phase:
 	 *  master_completion_kt
@@ -359,12 +383,58 @@ struct drbd_request {
 	/* lock to protect state flags */
 	spinlock_t rq_lock;
 	unsigned int local_rq_state;
-	u16 net_rq_state[DRBD_NODE_ID_MAX];
+	u16 *net_rq_state;
+
+	/* Number of entries in each per-node array, enough for every node id
+	 * of the resource when the request was allocated; "immutable" */
+	unsigned int node_slots;
 
 	/* for reclaim from transfer log */
 	struct rcu_head rcu;
+
+	/* pre_send_jif[], the per connection ktimes, net_rq_state[] */
+	u64 node_area[];
 };
 
+/* Requests are allocated in size classes of 4, 8, 16 and 32 node slots,
+ * so a two node resource does not pay for DRBD_NODE_ID_MAX peers. */
+#define DRBD_REQ_SLOTS_MIN_SHIFT 2
+#define DRBD_REQ_SLOTS_MAX_SHIFT 5
+#define DRBD_REQ_POOLS (DRBD_REQ_SLOTS_MAX_SHIFT - DRBD_REQ_SLOTS_MIN_SHIFT + 1)
+
+static inline unsigned int drbd_req_node_slots(int max_node_id)
+{
+	return max_t(unsigned int, roundup_pow_of_two(max_node_id + 1),
+		     1 << DRBD_REQ_SLOTS_MIN_SHIFT);
+}
+
+static inline int drbd_req_pool_index(unsigned int node_slots)
+{
+	return ilog2(node_slots) - DRBD_REQ_SLOTS_MIN_SHIFT;
+}
+
+static inline size_t drbd_req_size(unsigned int node_slots)
+{
+	size_t per_node = sizeof(unsigned long) + sizeof(u16);
+
+#ifdef CONFIG_DRBD_TIMING_STATS
+	per_node += 3 * sizeof(ktime_t);
+#endif
+	return sizeof(struct drbd_request) + ALIGN(node_slots * per_node, sizeof(u64));
+}
+
+/* A request allocated before a connection to a higher node id was added
+ * has no slot for that node. It was never sent there, either. */
+static inline bool req_has_node_slot(struct drbd_request *req, int node_id)
+{
+	return node_id < req->node_slots;
+}
+
+static inline unsigned int req_net_state(struct drbd_request *req, int node_id)
+{
+	return req_has_node_slot(req, node_id) ? READ_ONCE(req->net_rq_state[node_id]) : 0;
+}
+
 /* Used to multicast peer acks. */
 struct drbd_peer_ack {
 	struct drbd_resource *resource;
@@ -532,6 +602,7 @@ enum device_flag {
         /* to be used in drbd_device_post_work() */
         GO_DISKLESS,            /* tell worker to schedule cleanup before detach */
 	MD_SYNC,		/* tell worker to call drbd_md_sync() */
+	MD_SYNC_KICK,		/* tell worker to submit queued superblock updates */
 	MAKE_NEW_CUR_UUID,	/* tell worker to ping peers and eventually write new current uuid */
 
 	STABLE_RESYNC,		/* One peer_device finished the resync stable! */
@@ -615,6 +686,7 @@ enum bm_flag {
 
 	BM_LOCK_SINGLE_SLOT = 0x10,
 	BM_ON_DAX_PMEM = 0x10000,
+	BM_SPARSE = 0x20000, /* all zero pages are not allocated, see drbd_bitmap_sparse */
 };
 
 struct drbd_bitmap {
@@ -629,12 +701,25 @@ struct drbd_bitmap {
 	size_t   bm_words; /* platform specitif word size; not 32bit!! */
 	size_t   bm_number_of_pages;
 	sector_t bm_dev_capacity;
+
+	/* Per bitmap slot, one bit per page: the page may have bits of that
+	 * slot set. Clear bits let find_next skip clean pages unmapped. */
+	unsigned long *bm_summary;
+	size_t   bm_summary_longs; /* per slot */
 	struct mutex bm_change; /* serializes resize operations */
 
 	wait_queue_head_t bm_io_wait; /* used to serialize IO of single pages */
 
+	/* With BM_SPARSE: pages taken out of bm_pages again, freed once no
+	 * bm_rw_range() and no drbd_bm_lock() holder may still look at them */
+	struct list_head bm_reclaimed;
+	unsigned int bm_io_users;
+	/* slots that lost bits to a failed allocation, see drbd_bm_lost_bits() */
+	unsigned long bm_lost_slots;
+
 	enum bm_flag bm_flags;
 	unsigned int bm_max_peers;
+	unsigned int bm_block_shift; /* storage per bit, from the meta data */
 
 	/* exclusively to be used by __al_write_transaction(),
 	 * and drbd_bm_write_hinted() -> bm_rw() called from there.
@@ -680,6 +765,7 @@ struct drbd_md {
 
 	s32 al_offset;	/* signed relative sector offset to activity log */
 	s32 bm_offset;	/* signed relative sector offset to bitmap */
+	u32 bm_block_shift; /* recorded as bm_bytes_per_bit */
 
 	struct drbd_peer_md peers[DRBD_NODE_ID_MAX];
 	u64 history_uuids[HISTORY_UUIDS];
@@ -716,6 +802,136 @@ struct drbd_md_io {
 	int error;
 };
 
+/* Superblock writes. Updates asked for while one is in flight are written
+ * together by the next one, see drbd_md_sync_async() */
+struct drbd_md_sb_io {
+	struct page *page;	/* image of the asynchronous write */
+	spinlock_t lock;
+	u64 queued;		/* newest update asked for */
+	u64 submitted;		/* newest update in the write in flight */
+	u64 written;		/* newest update on stable storage */
+	u64 failed;		/* newest update given up on */
+	int error;
+	bool busy;		/* a superblock write is in flight */
+};
+
+/* Activity log transactions of the volumes of a resource that are written
+ * together, see al_group_commit() */
+struct drbd_al_group {
+	spinlock_t lock;
+	struct list_head queued;
+	bool committing;
+	wait_queue_head_t wait;
+	unsigned int commits;		/* batches written */
+	unsigned int transactions;	/* transactions in them */
+};
+
+/* Activity log transactions in flight while the next one is prepared,
+ * see drbd_al_commit_pipelined() */
+#define DRBD_AL_PIPE_DEPTH 2
+
+enum al_pipe_slot_state {
+	AL_SLOT_FREE,
+	AL_SLOT_IN_FLIGHT,
+	AL_SLOT_DONE,		/* written, but an older one is still in flight */
+	AL_SLOT_DURABLE,	/* it and all older ones are on disk */
+};
+
+struct drbd_al_pipe_slot {
+	struct drbd_device *device;
+	struct page *page;
+	enum al_pipe_slot_state state;
+	int error;
+	/* extents activated by this transaction, until it is durable */
+	unsigned int n_extents;
+	unsigned int extents[AL_UPDATES_PER_TRANSACTION];
+	/* to be submitted once it is durable */
+	struct list_head peer_requests;
+	struct list_head requests;
+};
+
+/* Replacement policies for the activity log, see al_policy_pick_victim() */
+enum drbd_al_policy_kind {
+	AL_POLICY_LRU,
+	AL_POLICY_2Q,
+	AL_POLICY_NR
+};
+
+struct drbd_al_ghost {
+	struct hlist_node colision;
+	unsigned int enr;
+};
+
+/* protected by al_lock */
+struct drbd_al_policy {
+	/* 2Q: extents seen once, in activation order, and those that were
+	 * activated again while remembered as recently evicted from a1in */
+	struct list_head a1in;
+	struct list_head am;
+	unsigned int a1in_len;
+	/* ring of extent numbers recently evicted from a1in, followed in the
+	 * same allocation by ghost_size hash slots to look them up */
+	struct drbd_al_ghost *ghost;
+	struct hlist_head *ghost_slot;
+	unsigned int ghost_size;
+	unsigned int ghost_next;
+	/* by the policy in effect at the time */
+	unsigned long hits[AL_POLICY_NR];
+	unsigned long misses[AL_POLICY_NR];
+	unsigned long evictions[AL_POLICY_NR];
+	unsigned long ghost_hits;
+};
+
+/* Sequential writers, see al_prefetch() */
+#define DRBD_AL_STREAMS 4
+#define DRBD_AL_PREFETCH_MAX 8
+
+/* protected by al_lock */
+struct drbd_al_prefetch {
+	/* per stream, the first extent it has not been seen in yet */
+	unsigned int stream_next[DRBD_AL_STREAMS];
+	unsigned int stream_victim;
+	/* references held on prefetched extents until they are committed */
+	struct lc_element *held[DRBD_AL_PREFETCH_MAX];
+	unsigned int n_held;
+	unsigned long prefetched;
+};
+
+/* Extents the activity log had when the device was last demoted or detached,
+ * in 4 MiB units and most recently used first, see drbd_al_save_hints() */
+#define DRBD_AL_HINTS_MAX AL_UPDATES_PER_TRANSACTION
+
+/* protected by al_lock */
+struct drbd_al_hints {
+	unsigned int enr[DRBD_AL_HINTS_MAX];
+	unsigned int n;
+};
+
+/* Activity log extents whose references are counted per CPU, see al_hot_get() */
+#define DRBD_AL_HOT_SLOTS 32
+
+struct drbd_al_hot_refs {
+	long refs[DRBD_AL_HOT_SLOTS];
+};
+
+/* protected by al_lock, hot is also read under rcu_read_lock() */
+struct drbd_al_hot {
+	struct drbd_device *device;
+	struct lc_element *e;	/* holds one reference on it while set */
+	unsigned int enr;
+	bool hot;		/* references go to the per CPU counters */
+	bool draining;		/* no longer hot, counters not folded yet */
+	struct rcu_head rcu;
+};
+
+/* protected by al_lock */
+struct drbd_al_pipe {
+	struct drbd_al_pipe_slot slot[DRBD_AL_PIPE_DEPTH];
+	unsigned int head;	/* oldest slot in use */
+	unsigned int used;
+	unsigned int in_flight;	/* used, but not yet durable */
+};
+
 struct bm_io_work {
 	struct drbd_work w;
 	struct drbd_device *device;
@@ -858,6 +1074,8 @@ struct drbd_resource {
 	struct dentry *debugfs_res_state_twopc;
 	struct dentry *debugfs_res_worker_pid;
 	struct dentry *debugfs_res_members;
+	struct dentry *debugfs_res_al_group_commit;
+	struct dentry *debugfs_res_read_weights;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -870,7 +1088,13 @@ struct drbd_resource {
 
 	struct list_head resources;     /* list entry in global resources list */
 	struct res_opts res_opts;
+	/* relative read weight per node id, 0 means 100;
+	 * see find_peer_device_least_latency() */
+	unsigned int read_weights[DRBD_NODE_ID_MAX];
 	int max_node_id;
+	/* node slots of newly allocated requests, drbd_req_node_slots(max_node_id)
+	 * or more; only grows, see drbd_req_grow_node_slots() */
+	unsigned int req_node_slots;
 	struct mutex conf_update;	/* for read-copy-update of net_conf and disk_conf
 					   and devices, connection and peer_devices lists */
 	struct mutex adm_mutex;		/* mutex to serialize administrative requests */
@@ -943,6 +1167,8 @@ struct drbd_resource {
 
 	cpumask_var_t cpu_mask;
 
+	struct drbd_al_group al_group;
+
 	struct drbd_work_queue work;
 	struct drbd_thread worker;
 
@@ -981,6 +1207,22 @@ struct drbd_resource {
 	wait_queue_head_t pp_wait;
 };
 
+/* How fast the data stream towards a peer drains, and what follows from that
+ * for the congestion policy. Sampled by the sender, see drain_sample(),
+ * rtt_us by the ack receiver. */
+#define DRBD_DRAIN_SAMPLE_MS 100
+struct drbd_drain_ctl {
+	ktime_t last_sample;
+	u64 last_dagtag;		/* resource->dagtag_sector at last_sample */
+	u64 last_done;			/* ap_done_sectors at last_sample */
+	unsigned int in_rate;		/* sectors/s written by the application */
+	unsigned int out_rate;		/* sectors/s acked by the peer */
+	unsigned int rtt_us;		/* from handing a write over to its ack */
+	unsigned int fill_ms;		/* until the send buffer is full, 0: not filling */
+	unsigned int pull_ahead_cnt;	/* pulled ahead on fill_ms */
+	unsigned int early_resync_cnt;	/* left L_AHEAD after less than the default second */
+};
+
 struct drbd_connection {
 	struct list_head connections;
 	struct drbd_resource *resource;
@@ -990,6 +1232,7 @@ struct drbd_connection {
 	struct dentry *debugfs_conn_oldest_requests;
 	struct dentry *debugfs_conn_transport;
 	struct dentry *debugfs_conn_debug;
+	struct dentry *debugfs_conn_congestion;
 	struct dentry *debugfs_conn_receiver_pid;
 	struct dentry *debugfs_conn_ack_receiver_pid;
 	struct dentry *debugfs_conn_sender_pid;
@@ -1022,6 +1265,8 @@ struct drbd_connection {
 	unsigned long last_received;	/* in jiffies, either socket */
 	atomic_t ap_in_flight; /* App sectors in flight (waiting for ack) */
 	atomic_t rs_in_flight; /* Resync sectors in flight */
+	atomic64_t ap_done_sectors; /* ever taken from ap_in_flight */
+	struct drbd_drain_ctl drain;
 
 	struct drbd_work connect_timer_work;
 	struct timer_list connect_timer;
@@ -1206,6 +1451,8 @@ struct drbd_peer_device {
 	unsigned int resync_locked;
 	/* resync extent number waiting for application requests */
 	unsigned int resync_wenr;
+	/* number of resync extents with BME_PRIORITY set */
+	unsigned int rs_prio_count;
 	enum drbd_disk_state resync_finished_pdsk; /* Finished while starting resync */
 	int resync_again; /* decided to resync again while resync running */
 	unsigned long resync_next_bit; /* bitmap bit to search from for next resync request */
@@ -1258,6 +1505,7 @@ struct drbd_peer_device {
 	int rs_last_events;  /* counter of read or write "events" (unit sectors)
 			      * on the lower level device when we last looked. */
 	int rs_in_flight; /* resync sectors in flight (to proxy, in proxy and from proxy) */
+	unsigned int rs_sect_carry; /* fixed resync rate: less than a bitmap block, not yet requested */
 	ktime_t rs_last_mk_req_kt;
 	atomic64_t ov_left; /* in bits */
 	unsigned long ov_skipped; /* in bits */
@@ -1285,18 +1533,40 @@ struct drbd_peer_device {
 	ktime_t acked_kt;
 	ktime_t net_done_kt;
 
+	/* average P_DATA_REQUEST to P_DATA_REPLY latency, in ns */
+	atomic64_t read_latency_ns;
+
 	struct {/* sender todo per peer_device */
 		bool was_ahead;
 	} todo;
 	union drbd_state connect_state;
 };
 
+/* Application writes that miss the activity log fast path are queued on the
+ * shard of the CPU they were submitted on.  A single committer (the ordered
+ * submit.wq) collects them from all shards, prepares and commits the activity
+ * log transaction, and then hands the requests back to their shard's ready
+ * list.  The per CPU workers send and submit them from there, so only the AL
+ * transaction itself is serialized. */
+struct submit_shard {
+	struct drbd_device *device;
+	struct work_struct worker;
+
+	spinlock_t lock;
+	struct list_head writes;	/* incoming, not yet seen by the committer */
+	struct list_head ready;		/* in the activity log, to be sent and submitted */
+};
+
 struct submit_worker {
 	struct workqueue_struct *wq;
 	struct work_struct worker;
 
+	/* per CPU send and submit of requests prepared by the committer */
+	struct workqueue_struct *shard_wq;
+	struct submit_shard __percpu *shards;
+	cpumask_var_t ready_cpus;	/* shards to kick, only used by the committer */
+
 	spinlock_t lock;
-	struct list_head writes;
 	struct list_head peer_writes;
 };
 
@@ -1307,6 +1577,21 @@ struct opener {
 	ktime_t opened;
 };
 
+/* The interval trees for conflict detection and block_id verification are
+ * sharded by activity log extent, so that IO to different areas of a device
+ * does not contend for one lock. Intervals crossing a shard boundary live in
+ * the extra "wide" shard. See drbd_lock_intervals(). */
+#define DRBD_INTERVAL_SHARDS 16
+#define DRBD_INTERVAL_WIDE DRBD_INTERVAL_SHARDS
+
+struct drbd_interval_shard {
+	spinlock_t lock;
+	struct rb_root read_requests;
+	struct rb_root write_requests;
+	/* intervals in the wide shard that cover this shard */
+	unsigned int nr_wide;
+} ____cacheline_aligned_in_smp;
+
 struct drbd_device {
 	struct drbd_resource *resource;
 
@@ -1355,6 +1640,7 @@ struct drbd_device {
 	unsigned long last_reattach_jif;
 	struct timer_list md_sync_timer;
 	struct timer_list request_timer;
+	struct timer_list read_hedge_timer;
 
 	enum drbd_disk_state disk_state[2];
 	wait_queue_head_t misc_wait;
@@ -1372,10 +1658,8 @@ struct drbd_device {
 
 	atomic_t suspend_cnt;	/* recursive suspend counter, if non-zero, IO will be blocked. */
 
-	/* Interval trees of pending local requests */
-	spinlock_t interval_lock;
-	struct rb_root read_requests;
-	struct rb_root write_requests;
+	/* Interval trees of pending local requests and peer writes */
+	struct drbd_interval_shard interval_shards[DRBD_INTERVAL_SHARDS + 1];
 
 	/* for statistics and timeouts */
 	/* [0] read, [1] write */
@@ -1391,12 +1675,22 @@ struct drbd_device {
 
 	int next_barrier_nr;
 	struct drbd_md_io md_io;
+	struct drbd_md_sb_io md_sb;
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
+	struct drbd_al_policy al_policy;
+	struct drbd_al_prefetch al_prefetch;
 	unsigned al_histogram[AL_UPDATES_PER_TRANSACTION+1];
 	unsigned int al_tr_number;
 	int al_tr_cycle;
+	/* size of the extents in act_log, AL_EXTENT_SHIFT or a multiple of it,
+	 * see drbd_check_al_size() */
+	unsigned int al_extent_shift;
+	struct drbd_al_pipe al_pipe;
+	struct drbd_al_hot al_hot[DRBD_AL_HOT_SLOTS];
+	struct drbd_al_hot_refs __percpu *al_hot_refs;
+	struct drbd_al_hints al_hints;
 	wait_queue_head_t seq_wait;
 	u64 exposed_data_uuid; /* UUID of the exposed data */
 	u64 next_exposed_data_uuid;
@@ -1410,9 +1704,11 @@ struct drbd_device {
 	struct device_conf device_conf;
 
 	/* any requests that would block in drbd_submit_bio()
-	 * are deferred to this single-threaded work queue */
+	 * are deferred to the per CPU submit shards, see struct submit_worker */
 	struct submit_worker submit;
 	u64 read_nodes; /* used for balancing read requests among peers */
+	atomic64_t read_latency_ns; /* average local read latency, in ns */
+	atomic_t local_reads_pending; /* reads on the local disk (RQ_LOCAL_PENDING) */
 	bool have_quorum[2];	/* no quorum -> suspend IO or error IO */
 	bool cached_state_unstable; /* updates with each state change */
 	bool cached_err_io; /* complete all IOs with error */
@@ -1451,6 +1747,10 @@ struct drbd_bm_aio_ctx {
 #define BM_AIO_WRITE_LAZY      16
 	int error;
 	struct kref kref;
+	/* BM_AIO_READ of the whole bitmap: pages below count_pages are
+	 * counted on completion, into bm_set[] (see drbd_bm_endio) */
+	unsigned long count_pages;
+	atomic_long_t bm_set[DRBD_PEERS_MAX];
 };
 
 struct drbd_config_context {
@@ -1568,7 +1868,11 @@ extern int drbd_send_sync_param(struct drbd_peer_device *);
 extern int drbd_send_out_of_sync(struct drbd_peer_device *, sector_t, unsigned int);
 extern int drbd_send_block(struct drbd_peer_device *, enum drbd_packet,
 			   struct drbd_peer_request *);
-extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req);
+/* requests sent along with another one in a single P_DATA, at most */
+#define DRBD_COALESCE_MAX 16
+extern int drbd_send_dblock(struct drbd_peer_device *, struct drbd_request *req,
+			    struct drbd_request **coalesced, int nr_coalesced);
+extern void drbd_free_req_snapshot(struct drbd_request *req);
 extern int drbd_send_drequest(struct drbd_peer_device *, int cmd,
 			      sector_t sector, int size, u64 block_id);
 extern void *drbd_prepare_drequest_csum(struct drbd_peer_request *peer_req, int digest_size);
@@ -1589,12 +1893,16 @@ extern void drbd_cleanup_device(struct drbd_device *device);
 extern void drbd_print_uuids(struct drbd_peer_device *peer_device, const char *text);
 extern void drbd_queue_unplug(struct drbd_device *device);
 
-extern u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers);
+extern u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers,
+					    unsigned int bm_block_shift);
 extern void drbd_md_set_sector_offsets(struct drbd_device *device,
 				       struct drbd_backing_dev *bdev);
 extern int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer);
 extern int drbd_md_sync(struct drbd_device *device);
 extern int drbd_md_sync_if_dirty(struct drbd_device *device);
+extern u64 drbd_md_sync_async(struct drbd_device *device);
+extern void drbd_md_sync_kick(struct drbd_device *device);
+extern int drbd_md_sync_wait(struct drbd_device *device, u64 ticket) __must_hold(local);
 extern void drbd_uuid_received_new_current(struct drbd_peer_device *, u64 , u64) __must_hold(local);
 extern void drbd_uuid_set_bitmap(struct drbd_peer_device *peer_device, u64 val) __must_hold(local);
 extern void _drbd_uuid_set_bitmap(struct drbd_peer_device *peer_device, u64 val) __must_hold(local);
@@ -1679,9 +1987,14 @@ extern sector_t drbd_get_max_capacity(
  *  but is about to become configurable.
  */
 
-/* One activity log extent represents 4M of storage */
+/* One activity log extent represents 4M of storage. Devices may use larger
+ * extents in memory (device->al_extent_shift); on disk they are always
+ * recorded as the 4M extents they consist of. */
 #define AL_EXTENT_SHIFT 22
 #define AL_EXTENT_SIZE (1<<AL_EXTENT_SHIFT)
+/* A request may span DRBD_MAX_BATCH_BIO_SIZE / extent size + 1 extents, all
+ * of which have to fit one transaction. */
+#define AL_EXTENT_SHIFT_MAX 26	/* 64M */
 
 /* drbd_bitmap.c */
 /*
@@ -1695,8 +2008,10 @@ extern sector_t drbd_get_max_capacity(
 #define RS_MAKE_REQS_INTV_NS (NSEC_PER_SEC/10)
 
 /* We do bitmap IO in units of 4k blocks.
- * We also still have a hardcoded 4k per bit relation. */
+ * One bit represents 4k of storage by default; the meta data may record
+ * a coarser granularity, see drbd_bitmap.bm_block_shift. */
 #define BM_BLOCK_SHIFT	12			 /* 4k per bit */
+#define BM_BLOCK_SHIFT_MAX 20			 /* 1M per bit */
 #define BM_BLOCK_SIZE	 (1<<BM_BLOCK_SHIFT)
 /* mostly arbitrarily set the represented size of one bitmap extent,
  * aka resync extent, to 128 MiB (which is also 4096 Byte worth of bitmap
@@ -1709,26 +2024,51 @@ extern sector_t drbd_get_max_capacity(
 #endif
 
 /* thus many _storage_ sectors are described by one bit */
-#define BM_SECT_TO_BIT(x)   ((x)>>(BM_BLOCK_SHIFT-9))
-#define BM_BIT_TO_SECT(x)   ((sector_t)(x)<<(BM_BLOCK_SHIFT-9))
-#define BM_SECT_PER_BIT     BM_BIT_TO_SECT(1)
+static inline unsigned long bm_sect_to_bit(struct drbd_bitmap *bm, sector_t sect)
+{
+	return sect >> (bm->bm_block_shift - SECTOR_SHIFT);
+}
+
+static inline sector_t bm_bit_to_sect(struct drbd_bitmap *bm, unsigned long bit)
+{
+	return (sector_t)bit << (bm->bm_block_shift - SECTOR_SHIFT);
+}
+
+static inline sector_t bm_sect_per_bit(struct drbd_bitmap *bm)
+{
+	return bm_bit_to_sect(bm, 1);
+}
+
+static inline unsigned int bm_block_size(struct drbd_bitmap *bm)
+{
+	return 1U << bm->bm_block_shift;
+}
 
 /* bit to represented kilo byte conversion */
-#define Bit2KB(bits) ((bits)<<(BM_BLOCK_SHIFT-10))
+static inline unsigned long bm_bit_to_kb(struct drbd_bitmap *bm, unsigned long bits)
+{
+	return bits << (bm->bm_block_shift - 10);
+}
 
 /* in which _bitmap_ extent (resp. sector) the bit for a certain
  * _storage_ sector is located in */
 #define BM_SECT_TO_EXT(x)   ((x)>>(BM_EXT_SHIFT-9))
-#define BM_BIT_TO_EXT(x)    ((x) >> (BM_EXT_SHIFT - BM_BLOCK_SHIFT))
+
+static inline unsigned int bm_bit_to_ext(struct drbd_bitmap *bm, unsigned long bit)
+{
+	return bit >> (BM_EXT_SHIFT - bm->bm_block_shift);
+}
 
 /* first storage sector a bitmap extent corresponds to */
 #define BM_EXT_TO_SECT(x)   ((sector_t)(x) << (BM_EXT_SHIFT-9))
 /* how much _storage_ sectors we have per bitmap extent */
 #define BM_SECT_PER_EXT     BM_EXT_TO_SECT(1)
-/* how many bits are covered by one bitmap extent (resync extent) */
-#define BM_BITS_PER_EXT     (1UL << (BM_EXT_SHIFT - BM_BLOCK_SHIFT))
 
-#define BM_BLOCKS_PER_BM_EXT_MASK  (BM_BITS_PER_EXT - 1)
+/* how many bits are covered by one bitmap extent (resync extent) */
+static inline unsigned long bm_bits_per_ext(struct drbd_bitmap *bm)
+{
+	return 1UL << (BM_EXT_SHIFT - bm->bm_block_shift);
+}
 
 
 /* in one sector of the bitmap, we have this many activity_log extents. */
@@ -1748,7 +2088,7 @@ extern sector_t drbd_get_max_capacity(
 /* With large block device support, the size is limited by the fact that we
  * want to be able to address bitmap bits with a long. Additionally adjust by
  * one page worth of bitmap, so we don't wrap around when iterating. */
-#define DRBD_MAX_SECTORS BM_BIT_TO_SECT(0xffff7fff)
+#define DRBD_MAX_SECTORS ((sector_t)0xffff7fff << (BM_BLOCK_SHIFT - 9))
 #endif
 #else
 /* We allow up to 1 PiB on 64 bit architectures as long as our meta data
@@ -1766,10 +2106,10 @@ extern sector_t drbd_get_max_capacity(
 #define DRBD_MAX_BBIO_SECTORS    (DRBD_MAX_BATCH_BIO_SIZE >> 9)
 
 /* how many activity log extents are touched by this interval? */
-static inline int interval_to_al_extents(struct drbd_interval *i)
+static inline int interval_to_al_extents(struct drbd_device *device, struct drbd_interval *i)
 {
-	unsigned int first = i->sector >> (AL_EXTENT_SHIFT-9);
-	unsigned int last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned int first = i->sector >> (device->al_extent_shift - 9);
+	unsigned int last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (device->al_extent_shift - 9);
 	return 1 + last - first; /* worst case: all touched extends are cold. */
 }
 
@@ -1792,6 +2132,8 @@ extern int drbd_bm_test_bit(struct drbd_peer_device *, unsigned long);
 extern int  drbd_bm_read(struct drbd_device *, struct drbd_peer_device *) __must_hold(local);
 extern void drbd_bm_reset_al_hints(struct drbd_device *device) __must_hold(local);
 extern void drbd_bm_mark_range_for_writeout(struct drbd_device *, unsigned long, unsigned long);
+extern void drbd_bm_sparse_prepare(struct drbd_device *, unsigned long, unsigned long);
+extern bool drbd_bm_lost_bits(struct drbd_device *, unsigned int);
 extern int  drbd_bm_write(struct drbd_device *, struct drbd_peer_device *) __must_hold(local);
 extern int  drbd_bm_write_hinted(struct drbd_device *device) __must_hold(local);
 extern int  drbd_bm_write_lazy(struct drbd_device *device, unsigned upper_idx) __must_hold(local);
@@ -1822,12 +2164,22 @@ extern void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device);
 extern void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index);
 /* drbd_main.c */
 
-extern struct kmem_cache *drbd_request_cache;
 extern struct kmem_cache *drbd_ee_cache;	/* peer requests */
 extern struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
-extern mempool_t drbd_request_mempool;
 extern mempool_t drbd_ee_mempool;
+extern int drbd_create_request_mempool(unsigned int node_slots);
+extern struct drbd_request *drbd_alloc_request(unsigned int node_slots);
+extern void drbd_free_request(struct drbd_request *req);
+
+/* per size class, summed over all CPUs for debugfs */
+struct drbd_req_cache_stats {
+	unsigned long hits;	/* allocations served from a per-CPU magazine */
+	unsigned long misses;	/* allocations that went to the mempool */
+	unsigned long recycled;	/* reclaimed requests parked in a magazine */
+	unsigned long released;	/* requests handed back to the mempool */
+};
+extern void drbd_request_cache_stats(int pool, struct drbd_req_cache_stats *sum);
 
 /* We also need a standard (emergency-reserve backed) page pool
  * for meta data IO (activity log, bitmap).
@@ -1836,6 +2188,8 @@ extern mempool_t drbd_ee_mempool;
  */
 #define DRBD_MIN_POOL_PAGES	128
 extern mempool_t drbd_md_io_page_pool;
+extern mempool_t drbd_bm_sparse_page_pool;
+extern struct workqueue_struct *drbd_bm_io_wq;
 
 /* We also need to make sure we get a bio
  * when we need it for housekeeping purposes */
@@ -1870,6 +2224,7 @@ extern void conn_free_crypto(struct drbd_connection *connection);
 
 /* drbd_req */
 extern void do_submit(struct work_struct *ws);
+extern void do_submit_shard(struct work_struct *ws);
 #ifndef CONFIG_DRBD_TIMING_STATS
 #define __drbd_make_request(d,b,k,j) __drbd_make_request(d,b,j)
 #endif
@@ -1981,6 +2336,7 @@ extern int w_e_end_ov_req(struct drbd_work *, int);
 extern int w_resync_timer(struct drbd_work *, int);
 extern int w_send_dblock(struct drbd_work *, int);
 extern int w_send_read_req(struct drbd_work *, int);
+extern int w_send_hedged_read(struct drbd_work *, int);
 extern int w_e_reissue(struct drbd_work *, int);
 extern int w_restart_disk_io(struct drbd_work *, int);
 extern int w_send_uuids(struct drbd_work *, int);
@@ -2110,12 +2466,21 @@ extern bool drbd_al_try_lock(struct drbd_device *device);
 extern bool drbd_al_try_lock_for_transaction(struct drbd_device *device);
 extern int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *i);
 extern void drbd_al_begin_io_commit(struct drbd_device *device);
+extern struct drbd_al_pipe_slot *drbd_al_commit_pipelined(struct drbd_device *device);
+extern void drbd_al_policy_init(struct drbd_device *device);
+extern unsigned int drbd_al_pipe_reap(struct drbd_device *device,
+				      struct list_head *peer_requests, struct list_head *requests);
 extern bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i);
 extern int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_interval *i);
 extern bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i);
 extern void drbd_rs_complete_io(struct drbd_peer_device *, sector_t);
 extern int drbd_rs_begin_io(struct drbd_peer_device *, sector_t);
 extern int drbd_try_rs_begin_io(struct drbd_peer_device *, sector_t, bool);
+extern int drbd_try_rs_begin_io_refs(struct drbd_peer_device *, sector_t, unsigned int, bool);
+extern void drbd_rs_put_refs(struct drbd_peer_device *, sector_t, unsigned int);
+extern int drbd_rs_batch_get(struct drbd_peer_device *, struct drbd_rs_batch *,
+			     sector_t, unsigned int, bool);
+extern void drbd_rs_batch_put(struct drbd_peer_device *, struct drbd_rs_batch *);
 extern void drbd_rs_cancel_all(struct drbd_peer_device *);
 extern int drbd_rs_del_all(struct drbd_peer_device *);
 extern void drbd_rs_failed_io(struct drbd_peer_device *, sector_t, int);
@@ -2132,6 +2497,11 @@ extern int __drbd_change_sync(struct drbd_peer_device *peer_device, sector_t sec
 #define drbd_rs_failed_io(peer_device, sector, size) \
 	__drbd_change_sync(peer_device, sector, size, RECORD_RS_FAILED)
 extern void drbd_al_shrink(struct drbd_device *device);
+extern void drbd_al_hot_demote(struct drbd_device *device);
+extern void drbd_al_hot_flush(struct drbd_device *device);
+extern unsigned int drbd_al_used_extents(struct drbd_device *device);
+extern void drbd_al_save_hints(struct drbd_device *device);
+extern void drbd_al_warm(struct drbd_device *device);
 extern bool drbd_sector_has_priority(struct drbd_peer_device *, sector_t);
 extern int drbd_al_initialize(struct drbd_device *, void *);
 
@@ -2631,10 +3001,29 @@ struct bm_extent {
 	struct lc_element lce;
 };
 
+/* 4MB sized activity log extent */
+struct al_extent {
+	struct list_head policy_list;	/* on al_policy.a1in or .am */
+	unsigned int policy_enr;	/* extent the policy last saw in this slot */
+	bool policy_am;
+	struct lc_element lce;
+};
+
 #define BME_NO_WRITES  0  /* bm_extent.flags: no more requests on this one! */
 #define BME_LOCKED     1  /* bm_extent.flags: syncer active on this one. */
 #define BME_PRIORITY   2  /* finish resync IO on this extent ASAP! App IO waiting! */
 
+/* references on one resync extent, taken at once for consecutive requests */
+struct drbd_rs_batch {
+	unsigned int enr;
+	unsigned int refs;
+};
+
+static inline void drbd_rs_batch_unget(struct drbd_rs_batch *batch)
+{
+	batch->refs++;
+}
+
 static inline struct drbd_connection *first_connection(struct drbd_resource *resource)
 {
 	return list_first_entry_or_null(&resource->connections,
@@ -129,6 +129,117 @@ static const struct kernel_param_ops param_ops_drbd_protocol_version = {
 unsigned int drbd_protocol_version_min = PRO_VERSION_MIN;
 module_param_named(protocol_version_min, drbd_protocol_version_min, drbd_protocol_version, 0644);
 
+/* The tunables below belong with the resource, net and disk options. Those
+ * are generated from the genl_api headers shared with drbd-utils, which are
+ * not part of this tree, so they are module parameters until the options
+ * exist. Each defaults to the behaviour from before it was added. */
+
+/* read balancing by expected service time, see find_peer_device_for_read() */
+bool drbd_read_balance_latency;
+MODULE_PARM_DESC(read_balance_latency, "With the least-pending, congested-remote and "
+		 "prefer-remote read-balancing policies, pick the node with the least "
+		 "expected service time (weights per resource in debugfs read_weights)");
+module_param_named(read_balance_latency, drbd_read_balance_latency, bool, 0644);
+
+/* hedged remote reads, see read_hedge_timer_fn() */
+unsigned int drbd_read_hedge_delay_us;
+MODULE_PARM_DESC(read_hedge_delay_us, "Also ask a second up-to-date peer for a remote read not "
+		 "answered after this many microseconds, or four times the average read latency "
+		 "of its peer, if that is longer (0 disables hedging)");
+module_param_named(read_hedge_delay_us, drbd_read_hedge_delay_us, uint, 0644);
+
+/* write coalescing on the replication stream, see coalesce_writes() */
+unsigned int drbd_coalesce_writes_kb;
+MODULE_PARM_DESC(coalesce_writes_kb, "Send adjacent queued writes of one epoch and plug as a "
+		 "single P_DATA packet of up to this many KiB (0 disables coalescing)");
+module_param_named(coalesce_writes_kb, drbd_coalesce_writes_kb, uint, 0644);
+
+/* predictive on-congestion pull-ahead, see __maybe_pull_ahead() */
+unsigned int drbd_congestion_target_ms;
+MODULE_PARM_DESC(congestion_target_ms, "With on-congestion pull-ahead, pull ahead when the send "
+		 "buffer is predicted to fill within this many milliseconds, and start the resync "
+		 "as soon as what is in flight drains within that time (0 disables the prediction)");
+module_param_named(congestion_target_ms, drbd_congestion_target_ms, uint, 0644);
+
+/* see al_group_commit() */
+bool drbd_al_group_commit;
+MODULE_PARM_DESC(al_group_commit, "Write the activity log transactions of the volumes of a "
+		 "resource together, with one flush per meta data device");
+module_param_named(al_group_commit, drbd_al_group_commit, bool, 0644);
+
+/* see drbd_al_commit_pipelined() */
+bool drbd_al_pipeline;
+MODULE_PARM_DESC(al_pipeline, "Prepare and submit the next activity log transaction while the "
+		 "previous one is still being written");
+module_param_named(al_pipeline, drbd_al_pipeline, bool, 0644);
+
+/* see al_policy_pick_victim() */
+unsigned int drbd_al_policy;
+MODULE_PARM_DESC(al_policy, "Replacement policy of the activity log: 0 = LRU, "
+		 "1 = 2Q (scan resistant)");
+module_param_named(al_policy, drbd_al_policy, uint, 0644);
+
+/* see al_prefetch() */
+unsigned int drbd_al_prefetch_extents;
+MODULE_PARM_DESC(al_prefetch_extents, "Activate up to this many activity log extents ahead of a "
+		 "sequential writer, in the transaction of its current miss (0 disables prefetching)");
+module_param_named(al_prefetch_extents, drbd_al_prefetch_extents, uint, 0644);
+
+/* see al_extent_shift_for() */
+unsigned int drbd_al_extent_mb = AL_EXTENT_SIZE >> 20;
+MODULE_PARM_DESC(al_extent_mb, "Size of the activity log extents in MiB: 4, 16 or 64. "
+		 "Takes effect when a device attaches, or its al-extents change");
+module_param_named(al_extent_mb, drbd_al_extent_mb, uint, 0644);
+
+/* see al_hot_get() */
+bool drbd_al_percpu_refs;
+
+static int param_set_drbd_al_percpu_refs(const char *s, const struct kernel_param *kp)
+{
+	struct drbd_device *device;
+	int vnr, err;
+
+	err = param_set_bool(s, kp);
+	if (err || drbd_al_percpu_refs)
+		return err;
+
+	/* idle hot extents would stay pinned until the next miss */
+	rcu_read_lock();
+	idr_for_each_entry(&drbd_devices, device, vnr) {
+		if (get_ldev(device)) {
+			drbd_al_hot_demote(device);
+			put_ldev(device);
+		}
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+#define param_check_drbd_al_percpu_refs	param_check_bool
+
+static const struct kernel_param_ops param_ops_drbd_al_percpu_refs = {
+	.flags = KERNEL_PARAM_OPS_FL_NOARG,
+	.set = param_set_drbd_al_percpu_refs,
+	.get = param_get_bool,
+};
+
+MODULE_PARM_DESC(al_percpu_refs, "Count the references on busy activity log extents per CPU, "
+		 "without taking the al_lock for each request");
+module_param_named(al_percpu_refs, drbd_al_percpu_refs, drbd_al_percpu_refs, 0644);
+
+/* see drbd_al_warm() */
+unsigned int drbd_al_warm_extents;
+MODULE_PARM_DESC(al_warm_extents, "When promoted, activate up to this many of the activity log "
+		 "extents that were in use when it was last demoted or detached, in one transaction, "
+		 "as long as it has free slots. Not kept across reboots (0 disables)");
+module_param_named(al_warm_extents, drbd_al_warm_extents, uint, 0644);
+
+/* see bm_sparse_alloc_page() */
+bool drbd_bitmap_sparse;
+MODULE_PARM_DESC(bitmap_sparse, "Do not keep bitmap pages without any bit set in memory. "
+		 "Takes effect when a device attaches");
+module_param_named(bitmap_sparse, drbd_bitmap_sparse, bool, 0644);
+
 
 /* in 2.6.x, our device mapping and config info contains our virtual gendisks
  * as member "struct gendisk *vdisk;"
@@ -138,14 +249,35 @@ struct list_head drbd_resources;
 static DEFINE_SPINLOCK(drbd_devices_lock);
 DEFINE_MUTEX(resources_mutex);
 
-struct kmem_cache *drbd_request_cache;
+static struct kmem_cache *drbd_request_caches[DRBD_REQ_POOLS];
+static DEFINE_MUTEX(drbd_request_pools_mutex);
 struct kmem_cache *drbd_ee_cache;	/* peer requests */
 struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
-mempool_t drbd_request_mempool;
+static mempool_t drbd_request_mempools[DRBD_REQ_POOLS];
+
+/* Per-CPU magazines of drbd_request objects, one per size class.
+ * Requests coming back from RCU reclaim are parked in the magazine of the
+ * CPU running the callback and handed out again by drbd_alloc_request(),
+ * so that most application bios never touch the mempool or the slab. */
+#define DRBD_REQ_MAGAZINE_SIZE 32
+
+struct drbd_req_magazine {
+	unsigned int nr;
+	struct drbd_request *reqs[DRBD_REQ_MAGAZINE_SIZE];
+};
+
+struct drbd_req_cpu_cache {
+	struct drbd_req_magazine mag[DRBD_REQ_POOLS];
+	struct drbd_req_cache_stats stats[DRBD_REQ_POOLS];
+};
+static DEFINE_PER_CPU(struct drbd_req_cpu_cache, drbd_req_cpu_cache);
 mempool_t drbd_ee_mempool;
 mempool_t drbd_md_io_page_pool;
+mempool_t drbd_bm_sparse_page_pool;
 struct bio_set drbd_md_io_bio_set;
+/* see bm_rw_pages_parallel() */
+struct workqueue_struct *drbd_bm_io_wq;
 struct bio_set drbd_io_bio_set;
 
 static const struct block_device_operations drbd_ops = {
@@ -288,7 +420,7 @@ static void dump_epoch(struct drbd_resource *resource, int node_id, int epoch)
 			drbd_info(req->device, "XXX %u %llu+%u 0x%x 0x%x\n",
 					req->epoch,
 					(unsigned long long)req->i.sector, req->i.size >> 9,
-					req->local_rq_state, req->net_rq_state[node_id]
+					req->local_rq_state, req_net_state(req, node_id)
 				 );
 		}
 	}
@@ -331,12 +463,18 @@ void tl_release(struct drbd_connection *connection,
 	struct drbd_request *req_y = NULL;
 	int expect_epoch = 0;
 	int expect_size = 0;
-	bool found_epoch = false;
+	bool past_y = false;
 
 	rcu_read_lock();
 	/* find oldest not yet barrier-acked write request,
-	 * count writes in its epoch. */
-	list_for_each_entry_rcu(r, &resource->transfer_log, tl_requests) {
+	 * count writes in its epoch.
+	 * Everything older than req_not_net_done is done towards this peer,
+	 * so start there; a deep transfer log kept by slower connections
+	 * then does not make every barrier ack walk it from the start. */
+	r = READ_ONCE(connection->req_not_net_done);
+	if (!r)
+		r = list_entry_rcu(resource->transfer_log.next, struct drbd_request, tl_requests);
+	list_for_each_entry_from_rcu(r, &resource->transfer_log, tl_requests) {
 		struct drbd_peer_device *peer_device =
 			conn_peer_device(connection, r->device->vnr);
 		const int idx = peer_device->node_id;
@@ -344,9 +482,13 @@ void tl_release(struct drbd_connection *connection,
 
 		spin_lock_irq(&r->rq_lock);
 		local_rq_state = r->local_rq_state;
-		net_rq_state = r->net_rq_state[idx];
+		net_rq_state = req_net_state(r, idx);
 		spin_unlock_irq(&r->rq_lock);
 
+		/* the requests coalesced into the P_DATA of req_y are stable, too */
+		if (req_y && !(net_rq_state & RQ_NET_COALESCED))
+			break;
+
 		if (!req) {
 			if (!(local_rq_state & RQ_WRITE))
 				continue;
@@ -356,9 +498,10 @@ void tl_release(struct drbd_connection *connection,
 				continue;
 			req = r;
 			expect_epoch = req->epoch;
-			expect_size ++;
+			if (!(net_rq_state & RQ_NET_COALESCED))
+				expect_size++;
 		} else {
-			const u16 s = r->net_rq_state[idx];
+			const u16 s = req_net_state(r, idx);
 			if (r->epoch != expect_epoch)
 				break;
 			if (!(local_rq_state & RQ_WRITE))
@@ -375,12 +518,12 @@ void tl_release(struct drbd_connection *connection,
 				drbd_warn(connection, "unexpected state flags: 0x%x during BarrierAck #%u\n",
 					s, barrier_nr);
 			}
-			expect_size++;
+			/* the peer counts packets, not requests */
+			if (!(s & RQ_NET_COALESCED))
+				expect_size++;
 		}
-		if (y_block_id && (struct drbd_request*)(unsigned long)y_block_id == r) {
+		if (y_block_id && (struct drbd_request*)(unsigned long)y_block_id == r)
 			req_y = r;
-			break;
-		}
 	}
 
 	/* first some paranoia code */
@@ -432,23 +575,23 @@ void tl_release(struct drbd_connection *connection,
 		goto bail;
 	}
 
-	/* Clean up list of requests processed during current epoch. */
-	/* Walking the list from the start is paranoia,
-	 * to catch requests being barrier-acked "unexpectedly".
-	 * It usually should find the same req again, or some READ preceding it. */
-	list_for_each_entry_rcu(req, &resource->transfer_log, tl_requests) {
-		if (!found_epoch && req->epoch == expect_epoch)
-			found_epoch = true;
+	/* Clean up list of requests processed during current epoch.
+	 * Requests of that epoch preceding req are READs, or not on the
+	 * wire towards this peer, or done already; BARRIER_ACKED would
+	 * ignore them. So start at req. It holds a reference until it
+	 * is RQ_NET_DONE. */
+	list_for_each_entry_from_rcu(req, &resource->transfer_log, tl_requests) {
+		struct drbd_peer_device *peer_device;
 
-		if (found_epoch) {
-			struct drbd_peer_device *peer_device;
-			if (req->epoch != expect_epoch)
-				break;
-			peer_device = conn_peer_device(connection, req->device->vnr);
-			req_mod(req, BARRIER_ACKED, peer_device);
-			if (req == req_y)
-				break;
-		}
+		if (req->epoch != expect_epoch)
+			break;
+		peer_device = conn_peer_device(connection, req->device->vnr);
+		if (past_y &&
+		    !(req_net_state(req, peer_device->node_id) & RQ_NET_COALESCED))
+			break;
+		if (req == req_y)
+			past_y = true;
+		req_mod(req, BARRIER_ACKED, peer_device);
 	}
 	rcu_read_unlock();
 
@@ -2005,7 +2148,7 @@ static int _drbd_send_bitmap(struct drbd_device *device,
 				 * but otherwise process as per normal - need to tell other
 				 * side that a full resync is required! */
 				drbd_err(device, "Failed to write bitmap to disk!\n");
-			} else {
+			} else if (!drbd_bm_lost_bits(device, peer_device->bitmap_index)) {
 				drbd_md_clear_peer_flag(peer_device, MDF_PEER_FULL_SYNC);
 				drbd_md_sync(device);
 			}
@@ -2271,23 +2414,171 @@ static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio
 	return bio->bi_opf & REQ_SYNC ? DP_RW_SYNC : 0;
 }
 
+/* With data-integrity enabled, each write is copied once, before it is sent
+ * to the first peer. All connections send that copy with zero copy, so the
+ * data on the wire can not change under us, and need to hash it only if
+ * they use a different integrity algorithm than the one that went first. */
+struct drbd_req_snapshot {
+	char digest_alg[SHARED_SECRET_MAX];
+	unsigned int digest_size;
+	u8 digest[64];
+	unsigned int nr_pages;
+	struct page *pages[];
+};
+
+static void free_snapshot(struct drbd_req_snapshot *snap)
+{
+	unsigned int i;
+
+	/* the network stack may still hold references to these */
+	for (i = 0; i < snap->nr_pages; i++)
+		put_page(snap->pages[i]);
+	kfree(snap);
+}
+
+void drbd_free_req_snapshot(struct drbd_request *req)
+{
+	struct drbd_req_snapshot *snap = xchg(&req->snapshot, NULL);
+
+	if (snap)
+		free_snapshot(snap);
+}
+
+static void snapshot_csum(struct crypto_shash *tfm, struct drbd_req_snapshot *snap,
+			  unsigned int size, void *digest)
+{
+	SHASH_DESC_ON_STACK(desc, tfm);
+	unsigned int i;
+
+	desc->tfm = tfm;
+
+	crypto_shash_init(desc);
+	for (i = 0; i < snap->nr_pages; i++) {
+		unsigned int len = min_t(unsigned int, size, PAGE_SIZE);
+
+		crypto_shash_update(desc, page_address(snap->pages[i]), len);
+		size -= len;
+	}
+	crypto_shash_final(desc, digest);
+	shash_desc_zero(desc);
+}
+
+/* Returns the snapshot of this request, taking it if this is the first
+ * connection to send it. NULL if out of memory; then the caller falls back
+ * to sending a copy of the master bio. Senders of different connections may
+ * race here, the loser frees its copy again. */
+static struct drbd_req_snapshot *
+drbd_req_snapshot(struct drbd_request *req, struct crypto_shash *tfm)
+{
+	unsigned int nr_pages = DIV_ROUND_UP(req->i.size, PAGE_SIZE);
+	struct drbd_req_snapshot *snap, *old;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	unsigned int i, offset = 0;
+
+	snap = READ_ONCE(req->snapshot);
+	if (snap)
+		return snap;
+
+	snap = kmalloc(struct_size(snap, pages, nr_pages), GFP_NOIO | __GFP_NOWARN);
+	if (!snap)
+		return NULL;
+	for (snap->nr_pages = 0; snap->nr_pages < nr_pages; snap->nr_pages++) {
+		struct page *page = alloc_page(GFP_NOIO | __GFP_NOWARN);
+
+		if (!page) {
+			free_snapshot(snap);
+			return NULL;
+		}
+		snap->pages[snap->nr_pages] = page;
+	}
+
+	i = 0;
+	bio_for_each_segment(bvec, req->master_bio, iter) {
+		char *src = bvec_kmap_local(&bvec);
+		unsigned int done = 0;
+
+		while (done < bvec.bv_len) {
+			unsigned int len = min(bvec.bv_len - done, (unsigned int)PAGE_SIZE - offset);
+
+			memcpy(page_address(snap->pages[i]) + offset, src + done, len);
+			done += len;
+			offset += len;
+			if (offset == PAGE_SIZE) {
+				offset = 0;
+				i++;
+			}
+		}
+		kunmap_local(src);
+	}
+
+	strscpy(snap->digest_alg, crypto_shash_alg_name(tfm), sizeof(snap->digest_alg));
+	snap->digest_size = crypto_shash_digestsize(tfm);
+	snapshot_csum(tfm, snap, req->i.size, snap->digest);
+
+	old = cmpxchg(&req->snapshot, NULL, snap);
+	if (old) {
+		free_snapshot(snap);
+		snap = old;
+	}
+	return snap;
+}
+
+static void snapshot_digest(struct drbd_req_snapshot *snap, struct crypto_shash *tfm,
+			    unsigned int size, void *digest)
+{
+	if (!strcmp(snap->digest_alg, crypto_shash_alg_name(tfm)))
+		memcpy(digest, snap->digest, snap->digest_size);
+	else
+		snapshot_csum(tfm, snap, size, digest);
+}
+
+static int _drbd_send_snapshot(struct drbd_peer_device *peer_device,
+			       struct drbd_req_snapshot *snap, unsigned int size)
+{
+	unsigned int i;
+	int err;
+
+	flush_send_buffer(peer_device->connection, DATA_STREAM);
+	/* hint all but last page with MSG_MORE */
+	for (i = 0; i < snap->nr_pages; i++) {
+		unsigned int len = min_t(unsigned int, size, PAGE_SIZE);
+
+		err = _drbd_send_page(peer_device, snap->pages[i], 0, len,
+				      i + 1 < snap->nr_pages ? MSG_MORE : 0);
+		if (err)
+			return err;
+		size -= len;
+	}
+	return 0;
+}
+
 /* Used to send write or TRIM aka REQ_OP_DISCARD requests
  * R_PRIMARY -> Peer	(P_DATA, P_TRIM)
+ * The payload of the @nr_coalesced requests in @coalesced, which continue
+ * the write of @req on disk, is appended to the same P_DATA.
  */
-int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
+int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req,
+		     struct drbd_request **coalesced, int nr_coalesced)
 {
 	struct drbd_device *device = peer_device->device;
 	char *const before = peer_device->connection->scratch_buffer.d.before;
 	char *const after = peer_device->connection->scratch_buffer.d.after;
+	struct crypto_shash *integrity_tfm = peer_device->connection->integrity_tfm;
+	struct drbd_req_snapshot *snap = NULL;
 	struct p_trim *trim = NULL;
 	struct p_data *p;
 	void *digest_out = NULL;
 	unsigned int dp_flags = 0;
 	int digest_size = 0;
-	int err;
-	const unsigned s = req->net_rq_state[peer_device->node_id];
+	unsigned int size = req->i.size;
+	int i, err;
+	const unsigned s = req_net_state(req, peer_device->node_id);
 	const int op = bio_op(req->master_bio);
 
+	for (i = 0; i < nr_coalesced; i++)
+		size += coalesced[i]->i.size;
+
 	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES) {
 		trim = drbd_prepare_command(peer_device, sizeof(*trim), DATA_STREAM);
 		if (!trim)
@@ -2295,8 +2586,10 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		p = &trim->p_data;
 		trim->size = cpu_to_be32(req->i.size);
 	} else {
-		if (peer_device->connection->integrity_tfm)
-			digest_size = crypto_shash_digestsize(peer_device->connection->integrity_tfm);
+		if (integrity_tfm) {
+			digest_size = crypto_shash_digestsize(integrity_tfm);
+			snap = drbd_req_snapshot(req, integrity_tfm);
+		}
 
 		p = drbd_prepare_command(peer_device, sizeof(*p) + digest_size, DATA_STREAM);
 		if (!p)
@@ -2326,11 +2619,15 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 
 	if (digest_size && digest_out) {
 		BUG_ON(digest_size > sizeof(peer_device->connection->scratch_buffer.d.before));
-		drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, before);
-		memcpy(digest_out, before, digest_size);
+		if (snap) {
+			snapshot_digest(snap, integrity_tfm, req->i.size, digest_out);
+		} else {
+			drbd_csum_bio(integrity_tfm, req->master_bio, before);
+			memcpy(digest_out, before, digest_size);
+		}
 	}
 
-	additional_size_command(peer_device->connection, DATA_STREAM, req->i.size);
+	additional_size_command(peer_device->connection, DATA_STREAM, size);
 	err = __send_command(peer_device->connection, device->vnr, P_DATA, DATA_STREAM);
 	if (!err) {
 		/* For protocol A, we have to memcpy the payload into
@@ -2338,20 +2635,30 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		 * as soon as we handed it over to tcp, at which point the data
 		 * pages may become invalid.
 		 *
-		 * For data-integrity enabled, we copy it as well, so we can be
-		 * sure that even if the bio pages may still be modified, it
-		 * won't change the data on the wire, thus if the digest checks
-		 * out ok after sending on this side, but does not fit on the
-		 * receiving side, we sure have detected corruption elsewhere.
+		 * For data-integrity enabled, we send our snapshot, which the
+		 * upper layers can not modify, thus if the digest does not fit
+		 * on the receiving side, we sure have detected corruption
+		 * elsewhere. Without a snapshot, we copy the bio pages, and
+		 * double check the digest after sending.
 		 */
-		if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
+		if (snap)
+			err = _drbd_send_snapshot(peer_device, snap, req->i.size);
+		else if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)) || digest_size)
 			err = _drbd_send_bio(peer_device, req->master_bio);
 		else
 			err = _drbd_send_zc_bio(peer_device, req->master_bio);
 
+		/* coalesce_writes() does not merge with data-integrity enabled */
+		for (i = 0; i < nr_coalesced && !err; i++) {
+			if (!(s & (RQ_EXP_RECEIVE_ACK | RQ_EXP_WRITE_ACK)))
+				err = _drbd_send_bio(peer_device, coalesced[i]->master_bio);
+			else
+				err = _drbd_send_zc_bio(peer_device, coalesced[i]->master_bio);
+		}
+
 		/* double check digest, sometimes buffers have been modified in flight. */
-		if (digest_size > 0) {
-			drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, after);
+		if (digest_size > 0 && !snap) {
+			drbd_csum_bio(integrity_tfm, req->master_bio, after);
 			if (memcmp(before, after, digest_size)) {
 				drbd_warn(device,
 					"Digest mismatch, buffer modified by upper layers during write: %llus +%u\n",
@@ -2921,24 +3228,49 @@ void drbd_cleanup_device(struct drbd_device *device)
 }
 
 
+static void drbd_drain_request_magazines(void)
+{
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_req_cpu_cache *cc = per_cpu_ptr(&drbd_req_cpu_cache, cpu);
+
+		for (i = 0; i < DRBD_REQ_POOLS; i++) {
+			struct drbd_req_magazine *mag = &cc->mag[i];
+
+			while (mag->nr)
+				mempool_free(mag->reqs[--mag->nr], &drbd_request_mempools[i]);
+		}
+	}
+}
+
 static void drbd_destroy_mempools(void)
 {
+	int i;
+
+	/* pending drbd_reclaim_req() callbacks fill the magazines */
+	rcu_barrier();
+	drbd_drain_request_magazines();
+
 	bioset_exit(&drbd_io_bio_set);
 	bioset_exit(&drbd_md_io_bio_set);
 	mempool_exit(&drbd_md_io_page_pool);
+	mempool_exit(&drbd_bm_sparse_page_pool);
 	mempool_exit(&drbd_ee_mempool);
-	mempool_exit(&drbd_request_mempool);
+	for (i = 0; i < DRBD_REQ_POOLS; i++) {
+		mempool_exit(&drbd_request_mempools[i]);
+		if (drbd_request_caches[i])
+			kmem_cache_destroy(drbd_request_caches[i]);
+		drbd_request_caches[i] = NULL;
+	}
 	if (drbd_ee_cache)
 		kmem_cache_destroy(drbd_ee_cache);
-	if (drbd_request_cache)
-		kmem_cache_destroy(drbd_request_cache);
 	if (drbd_bm_ext_cache)
 		kmem_cache_destroy(drbd_bm_ext_cache);
 	if (drbd_al_ext_cache)
 		kmem_cache_destroy(drbd_al_ext_cache);
 
 	drbd_ee_cache        = NULL;
-	drbd_request_cache   = NULL;
 	drbd_bm_ext_cache    = NULL;
 	drbd_al_ext_cache    = NULL;
 
@@ -2950,12 +3282,8 @@ static int drbd_create_mempools(void)
 	const int number = (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count;
 	int ret;
 
-	/* caches */
-	drbd_request_cache = kmem_cache_create(
-		"drbd_req", sizeof(struct drbd_request), 0, 0, NULL);
-	if (drbd_request_cache == NULL)
-		goto Enomem;
-
+	/* caches; those for drbd_request are created on demand,
+	 * see drbd_create_request_mempool() */
 	drbd_ee_cache = kmem_cache_create(
 		"drbd_ee", sizeof(struct drbd_peer_request), 0, 0, NULL);
 	if (drbd_ee_cache == NULL)
@@ -2967,7 +3295,7 @@ static int drbd_create_mempools(void)
 		goto Enomem;
 
 	drbd_al_ext_cache = kmem_cache_create(
-		"drbd_al", sizeof(struct lc_element), 0, 0, NULL);
+		"drbd_al", sizeof(struct al_extent), 0, 0, NULL);
 	if (drbd_al_ext_cache == NULL)
 		goto Enomem;
 
@@ -2985,8 +3313,7 @@ static int drbd_create_mempools(void)
 	if (ret)
 		goto Enomem;
 
-	ret = mempool_init_slab_pool(&drbd_request_mempool, number,
-				     drbd_request_cache);
+	ret = mempool_init_page_pool(&drbd_bm_sparse_page_pool, DRBD_MIN_POOL_PAGES, 0);
 	if (ret)
 		goto Enomem;
 
@@ -3001,6 +3328,113 @@ Enomem:
 	return -ENOMEM;
 }
 
+/* Makes sure the size class for requests with node_slots per-node entries
+ * exists.  Classes are only ever added, and torn down on module unload. */
+int drbd_create_request_mempool(unsigned int node_slots)
+{
+	static const char * const names[DRBD_REQ_POOLS] = {
+		"drbd_req4", "drbd_req8", "drbd_req16", "drbd_req32"
+	};
+	const int number = (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * drbd_minor_count;
+	int i = drbd_req_pool_index(node_slots);
+	struct kmem_cache *cache;
+	int err = 0;
+
+	BUILD_BUG_ON(1 << DRBD_REQ_SLOTS_MAX_SHIFT != DRBD_NODE_ID_MAX);
+
+	mutex_lock(&drbd_request_pools_mutex);
+	if (drbd_request_caches[i])
+		goto out;
+
+	cache = kmem_cache_create(names[i], drbd_req_size(node_slots), 0, 0, NULL);
+	if (!cache) {
+		err = -ENOMEM;
+		goto out;
+	}
+	err = mempool_init_slab_pool(&drbd_request_mempools[i], number, cache);
+	if (err) {
+		kmem_cache_destroy(cache);
+		goto out;
+	}
+	drbd_request_caches[i] = cache;
+out:
+	mutex_unlock(&drbd_request_pools_mutex);
+	return err;
+}
+
+struct drbd_request *drbd_alloc_request(unsigned int node_slots)
+{
+	int i = drbd_req_pool_index(node_slots);
+	struct drbd_req_cpu_cache *cc;
+	struct drbd_request *req = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cc = this_cpu_ptr(&drbd_req_cpu_cache);
+	if (cc->mag[i].nr) {
+		req = cc->mag[i].reqs[--cc->mag[i].nr];
+		cc->stats[i].hits++;
+	} else {
+		cc->stats[i].misses++;
+	}
+	local_irq_restore(flags);
+
+	if (!req)
+		req = mempool_alloc(&drbd_request_mempools[i], GFP_NOIO);
+	return req;
+}
+
+void drbd_free_request(struct drbd_request *req)
+{
+	int i = drbd_req_pool_index(req->node_slots);
+	mempool_t *pool = &drbd_request_mempools[i];
+	struct drbd_request *batch[DRBD_REQ_MAGAZINE_SIZE / 2];
+	struct drbd_req_cpu_cache *cc;
+	struct drbd_req_magazine *mag;
+	unsigned int n = 0;
+	unsigned long flags;
+
+	/* Refill the emergency reserve first, magazines are only a cache */
+	if (READ_ONCE(pool->curr_nr) < pool->min_nr) {
+		mempool_free(req, pool);
+		return;
+	}
+
+	local_irq_save(flags);
+	cc = this_cpu_ptr(&drbd_req_cpu_cache);
+	mag = &cc->mag[i];
+	if (mag->nr == DRBD_REQ_MAGAZINE_SIZE) {
+		/* Full: give back the coldest half in one go */
+		n = ARRAY_SIZE(batch);
+		memcpy(batch, mag->reqs, sizeof(batch));
+		memmove(mag->reqs, mag->reqs + n, (mag->nr - n) * sizeof(mag->reqs[0]));
+		mag->nr -= n;
+		cc->stats[i].released += n;
+	}
+	mag->reqs[mag->nr++] = req;
+	cc->stats[i].recycled++;
+	local_irq_restore(flags);
+
+	while (n)
+		mempool_free(batch[--n], pool);
+}
+
+void drbd_request_cache_stats(int pool, struct drbd_req_cache_stats *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct drbd_req_cache_stats *stats =
+			&per_cpu_ptr(&drbd_req_cpu_cache, cpu)->stats[pool];
+
+		sum->hits += READ_ONCE(stats->hits);
+		sum->misses += READ_ONCE(stats->misses);
+		sum->recycled += READ_ONCE(stats->recycled);
+		sum->released += READ_ONCE(stats->released);
+	}
+}
+
 static void free_peer_device(struct drbd_peer_device *peer_device)
 {
 	if (test_and_clear_bit(HOLDING_UUID_READ_LOCK, &peer_device->flags))
@@ -3035,6 +3469,7 @@ void drbd_destroy_device(struct kref *kref)
 {
 	struct drbd_device *device = container_of(kref, struct drbd_device, kref);
 	struct drbd_peer_device *peer_device, *tmp;
+	int i;
 
 	/* cleanup stuff that may have been allocated during
 	 * device (re-)configuration or state changes */
@@ -3042,12 +3477,17 @@ void drbd_destroy_device(struct kref *kref)
 	free_openers(device);
 
 	lc_destroy(device->act_log);
+	kfree(device->al_policy.ghost);
 	for_each_peer_device_safe(peer_device, tmp, device) {
 		kref_debug_put(&peer_device->connection->kref_debug, 3);
 		kref_put(&peer_device->connection->kref, drbd_destroy_connection);
 		free_peer_device(peer_device);
 	}
 
+	for (i = 0; i < DRBD_AL_PIPE_DEPTH; i++)
+		__free_page(device->al_pipe.slot[i].page);
+	free_percpu(device->al_hot_refs);
+	__free_page(device->md_sb.page);
 	__free_page(device->md_io.page);
 	kref_debug_destroy(&device->kref_debug);
 
@@ -3091,7 +3531,8 @@ void drbd_reclaim_resource(struct rcu_head *rp)
 		kref_debug_put(&connection->kref_debug, 9);
 		kref_put(&connection->kref, drbd_destroy_connection);
 	}
-	mempool_free(resource->peer_ack_req, &drbd_request_mempool);
+	if (resource->peer_ack_req)
+		drbd_free_request(resource->peer_ack_req);
 	kref_debug_put(&resource->kref_debug, 8);
 	kref_put(&resource->kref, drbd_destroy_resource);
 }
@@ -3202,6 +3643,8 @@ static void drbd_cleanup(void)
 
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
+	if (drbd_bm_io_wq)
+		destroy_workqueue(drbd_bm_io_wq);
 
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
@@ -3439,6 +3882,9 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	const int page_pool_count = DRBD_MAX_BIO_SIZE/PAGE_SIZE;
 	int i;
 
+	if (drbd_create_request_mempool(drbd_req_node_slots(res_opts->node_id)))
+		goto fail;
+
 	resource = kzalloc(sizeof(struct drbd_resource), GFP_KERNEL);
 	if (!resource)
 		goto fail;
@@ -3463,6 +3909,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	sema_init(&resource->state_sem, 1);
 	resource->role[NOW] = R_SECONDARY;
 	resource->max_node_id = res_opts->node_id;
+	resource->req_node_slots = drbd_req_node_slots(res_opts->node_id);
 	resource->twopc_reply.initiator_node_id = -1;
 	mutex_init(&resource->conf_update);
 	mutex_init(&resource->adm_mutex);
@@ -3473,6 +3920,9 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	init_waitqueue_head(&resource->state_wait);
 	init_waitqueue_head(&resource->twopc_wait);
 	init_waitqueue_head(&resource->barrier_wait);
+	spin_lock_init(&resource->al_group.lock);
+	INIT_LIST_HEAD(&resource->al_group.queued);
+	init_waitqueue_head(&resource->al_group.wait);
 	INIT_LIST_HEAD(&resource->twopc_parents);
 	timer_setup(&resource->twopc_timer, twopc_timer_fn, 0);
 	INIT_LIST_HEAD(&resource->twopc_work.list);
@@ -3542,6 +3992,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 
 	atomic_set(&connection->ap_in_flight, 0);
 	atomic_set(&connection->rs_in_flight, 0);
+	atomic64_set(&connection->ap_done_sectors, 0);
 	connection->send.seen_any_write_yet = false;
 	connection->send.current_epoch_nr = 0;
 	connection->send.current_epoch_writes = 0;
@@ -3705,8 +4156,14 @@ static void drbd_ldev_destroy(struct work_struct *ws)
 		peer_device->resync_lru = NULL;
 	}
 	rcu_read_unlock();
+	drbd_al_hot_flush(device);
+	/* while secondary, it follows a peer; keep what it had when demoted */
+	if (device->resource->role[NOW] == R_PRIMARY || !device->al_hints.n)
+		drbd_al_save_hints(device);
 	lc_destroy(device->act_log);
 	device->act_log = NULL;
+	kfree(device->al_policy.ghost);
+	device->al_policy.ghost = NULL;
 	__acquire(local);
 	drbd_backing_dev_free(device, device->ldev);
 	device->ldev = NULL;
@@ -3717,21 +4174,59 @@ static void drbd_ldev_destroy(struct work_struct *ws)
 	kref_put(&device->kref, drbd_destroy_device);
 }
 
+static void destroy_submitter(struct drbd_device *device)
+{
+	/* The committer hands requests to the shards, drain it first. */
+	if (device->submit.wq)
+		destroy_workqueue(device->submit.wq);
+	device->submit.wq = NULL;
+	if (device->submit.shard_wq)
+		destroy_workqueue(device->submit.shard_wq);
+	device->submit.shard_wq = NULL;
+	free_percpu(device->submit.shards);
+	device->submit.shards = NULL;
+	free_cpumask_var(device->submit.ready_cpus);
+}
+
 static int init_submitter(struct drbd_device *device)
 {
+	int cpu;
+
+	if (!zalloc_cpumask_var(&device->submit.ready_cpus, GFP_KERNEL))
+		return -ENOMEM;
+	device->submit.shards = alloc_percpu(struct submit_shard);
+	if (!device->submit.shards) {
+		free_cpumask_var(device->submit.ready_cpus);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		struct submit_shard *shard = per_cpu_ptr(device->submit.shards, cpu);
+
+		shard->device = device;
+		INIT_WORK(&shard->worker, do_submit_shard);
+		spin_lock_init(&shard->lock);
+		INIT_LIST_HEAD(&shard->writes);
+		INIT_LIST_HEAD(&shard->ready);
+	}
+
 	/* opencoded create_singlethread_workqueue(),
 	 * to be able to use format string arguments */
 	device->submit.wq =
 		alloc_ordered_workqueue("drbd%u_submit", WQ_MEM_RECLAIM, device->minor);
-	if (!device->submit.wq)
+	device->submit.shard_wq =
+		alloc_workqueue("drbd%u_submit_pcpu", WQ_MEM_RECLAIM, 0, device->minor);
+	if (!device->submit.wq || !device->submit.shard_wq) {
+		destroy_submitter(device);
 		return -ENOMEM;
+	}
 	INIT_WORK(&device->submit.worker, do_submit);
-	INIT_LIST_HEAD(&device->submit.writes);
 	INIT_LIST_HEAD(&device->submit.peer_writes);
 	spin_lock_init(&device->submit.lock);
 	return 0;
 }
 
+static struct lock_class_key drbd_interval_shard_key[DRBD_INTERVAL_SHARDS + 1];
+
 enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsigned int minor,
 				      struct device_conf *device_conf, struct drbd_device **p_device)
 {
@@ -3742,7 +4237,7 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	struct gendisk *disk;
 	LIST_HEAD(peer_devices);
 	LIST_HEAD(tmp);
-	int id;
+	int id, i;
 	int vnr = adm_ctx->volume;
 	enum drbd_ret_code err = ERR_NOMEM;
 	bool locked = false;
@@ -3797,9 +4292,13 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 
 	timer_setup(&device->md_sync_timer, md_sync_timer_fn, 0);
 	timer_setup(&device->request_timer, request_timer_fn, 0);
+	timer_setup(&device->read_hedge_timer, read_hedge_timer_fn, 0);
 
 	init_waitqueue_head(&device->misc_wait);
 	init_waitqueue_head(&device->al_wait);
+	device->al_extent_shift = AL_EXTENT_SHIFT;
+	INIT_LIST_HEAD(&device->al_policy.a1in);
+	INIT_LIST_HEAD(&device->al_policy.am);
 	init_waitqueue_head(&device->seq_wait);
 
 	init_rwsem(&device->uuid_sem);
@@ -3827,13 +4326,42 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	device->md_io.page = alloc_page(GFP_KERNEL);
 	if (!device->md_io.page)
 		goto out_no_io_page;
+	device->md_sb.page = alloc_page(GFP_KERNEL);
+	if (!device->md_sb.page)
+		goto out_no_sb_page;
+	spin_lock_init(&device->md_sb.lock);
+
+	for (i = 0; i < DRBD_AL_PIPE_DEPTH; i++) {
+		struct drbd_al_pipe_slot *slot = &device->al_pipe.slot[i];
+
+		slot->device = device;
+		INIT_LIST_HEAD(&slot->peer_requests);
+		INIT_LIST_HEAD(&slot->requests);
+		slot->page = alloc_page(GFP_KERNEL);
+		if (!slot->page)
+			goto out_no_al_pipe_page;
+	}
+
+	for (i = 0; i < DRBD_AL_HOT_SLOTS; i++) {
+		device->al_hot[i].device = device;
+		device->al_hot[i].enr = LC_FREE;
+	}
+	device->al_hot_refs = alloc_percpu(struct drbd_al_hot_refs);
+	if (!device->al_hot_refs)
+		goto out_no_al_hot_refs;
 
 	device->bitmap = drbd_bm_alloc();
 	if (!device->bitmap)
 		goto out_no_bitmap;
-	spin_lock_init(&device->interval_lock);
-	device->read_requests = RB_ROOT;
-	device->write_requests = RB_ROOT;
+	for (i = 0; i <= DRBD_INTERVAL_SHARDS; i++) {
+		struct drbd_interval_shard *shard = &device->interval_shards[i];
+
+		spin_lock_init(&shard->lock);
+		/* shards are locked in index order, see drbd_lock_intervals() */
+		lockdep_set_class(&shard->lock, &drbd_interval_shard_key[i]);
+		shard->read_requests = RB_ROOT;
+		shard->write_requests = RB_ROOT;
+	}
 
 	BUG_ON(!mutex_is_locked(&resource->conf_update));
 	for_each_connection(connection, resource) {
@@ -3919,8 +4447,7 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	return NO_ERROR;
 
 out_destroy_submitter:
-	destroy_workqueue(device->submit.wq);
-	device->submit.wq = NULL;
+	destroy_submitter(device);
 out_remove_peer_device:
 	list_add_rcu(&tmp, &device->peer_devices);
 	list_del_init(&device->peer_devices);
@@ -3956,6 +4483,15 @@ out_no_peer_device:
 
 	drbd_bm_free(device->bitmap);
 out_no_bitmap:
+	free_percpu(device->al_hot_refs);
+out_no_al_hot_refs:
+out_no_al_pipe_page:
+	for (i = 0; i < DRBD_AL_PIPE_DEPTH; i++) {
+		if (device->al_pipe.slot[i].page)
+			__free_page(device->al_pipe.slot[i].page);
+	}
+	__free_page(device->md_sb.page);
+out_no_sb_page:
 	__free_page(device->md_io.page);
 out_no_io_page:
 	put_disk(disk);
@@ -3997,9 +4533,9 @@ void drbd_unregister_device(struct drbd_device *device)
 	drbd_debugfs_device_cleanup(device);
 	del_gendisk(device->vdisk);
 
-	destroy_workqueue(device->submit.wq);
-	device->submit.wq = NULL;
+	destroy_submitter(device);
 	del_timer_sync(&device->request_timer);
+	del_timer_sync(&device->read_hedge_timer);
 }
 
 void drbd_reclaim_device(struct rcu_head *rp)
@@ -4143,6 +4679,13 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	/* unbound, so that work can be queued close to the memory it touches */
+	drbd_bm_io_wq = alloc_workqueue("drbd-bm-io", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_bm_io_wq) {
+		pr_err("unable to create bitmap io workqueue\n");
+		goto fail;
+	}
+
 	drbd_debugfs_init();
 
 	pr_info("initialized. "
@@ -4175,8 +4718,10 @@ void drbd_md_encode(struct drbd_device *device, struct meta_data_on_disk_9 *buff
 
 	buffer->md_size_sect  = cpu_to_be32(device->ldev->md.md_size_sect);
 	buffer->al_offset     = cpu_to_be32(device->ldev->md.al_offset);
-	buffer->al_nr_extents = cpu_to_be32(device->act_log->nr_elements);
-	buffer->bm_bytes_per_bit = cpu_to_be32(BM_BLOCK_SIZE);
+	/* as recorded in the activity log transactions */
+	buffer->al_nr_extents = cpu_to_be32(device->act_log->nr_elements <<
+					    (device->al_extent_shift - AL_EXTENT_SHIFT));
+	buffer->bm_bytes_per_bit = cpu_to_be32(1U << device->ldev->md.bm_block_shift);
 	buffer->device_uuid = cpu_to_be64(device->ldev->md.device_uuid);
 
 	buffer->bm_offset = cpu_to_be32(device->ldev->md.bm_offset);
@@ -4199,6 +4744,48 @@ void drbd_md_encode(struct drbd_device *device, struct meta_data_on_disk_9 *buff
 	buffer->al_stripe_size_4k = cpu_to_be32(device->ldev->md.al_stripe_size_4k);
 }
 
+static bool md_sb_claim(struct drbd_device *device, bool pending_only)
+{
+	struct drbd_md_sb_io *sb = &device->md_sb;
+	bool claimed = false;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	if (!sb->busy && (!pending_only ||
+			  sb->queued > max(sb->submitted, sb->failed))) {
+		sb->busy = true;
+		sb->submitted = sb->queued;
+		claimed = true;
+	}
+	spin_unlock_irqrestore(&sb->lock, flags);
+
+	return claimed;
+}
+
+/* Ends the superblock write claimed by md_sb_claim(). On error, all updates
+ * asked for so far fail; later ones try again. */
+static void md_sb_release(struct drbd_device *device, int err)
+{
+	struct drbd_md_sb_io *sb = &device->md_sb;
+	unsigned long flags;
+	bool again;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	if (err) {
+		sb->error = err;
+		sb->failed = sb->queued;
+	} else {
+		sb->written = max(sb->written, sb->submitted);
+	}
+	sb->busy = false;
+	again = sb->queued > max(sb->submitted, sb->failed);
+	spin_unlock_irqrestore(&sb->lock, flags);
+
+	if (again)
+		drbd_device_post_work(device, MD_SYNC_KICK);
+	wake_up(&device->misc_wait);
+}
+
 int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer)
 {
 	sector_t sector;
@@ -4211,6 +4798,9 @@ int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer
 		return 0;
 	}
 
+	/* an asynchronous write of an older image must not land after ours */
+	wait_event(device->misc_wait, md_sb_claim(device, false));
+
 	memset(buffer, 0, sizeof(*buffer));
 
 	drbd_md_encode(device, buffer);
@@ -4223,19 +4813,175 @@ int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer
 		drbd_err(device, "meta data update failed!\n");
 		drbd_handle_io_error(device, DRBD_META_IO_ERROR);
 	}
+	md_sb_release(device, err);
 
 	return err;
 }
 
+static void md_sb_endio(struct bio *bio)
+{
+	struct drbd_device *device = bio->bi_private;
+	int err = blk_status_to_errno(bio->bi_status);
+
+	if (err) {
+		drbd_err(device, "meta data update failed!\n");
+		drbd_handle_io_error(device, DRBD_META_IO_ERROR);
+		drbd_md_mark_dirty(device);
+	}
+	put_ldev(device);
+	bio_put(bio);
+	md_sb_release(device, err);
+}
+
+/* Writes the superblock from device->md_sb.page, claimed by md_sb_claim().
+ * It carries its own PREFLUSH, also when submitted next to an activity log
+ * transaction: the two writes are in flight at the same time, but they do
+ * not share one flush. */
+static void md_sb_submit(struct drbd_device *device)
+{
+	int op_flags = REQ_META | REQ_SYNC;
+	struct bio *bio;
+
+	if (!get_ldev_if_state(device, D_DETACHING)) {
+		md_sb_release(device, -ENODEV);
+		return;
+	}
+
+	/* whatever gets marked dirty from now on goes into the next write */
+	clear_bit(MD_DIRTY, &device->flags);
+	del_timer(&device->md_sync_timer);
+
+	if (drbd_md_dax_active(device->ldev)) {
+		drbd_md_encode(device, drbd_dax_md_addr(device->ldev));
+		arch_wb_cache_pmem(drbd_dax_md_addr(device->ldev),
+				   sizeof(struct meta_data_on_disk_9));
+		put_ldev(device);
+		md_sb_release(device, 0);
+		return;
+	}
+
+	memset(page_address(device->md_sb.page), 0, sizeof(struct meta_data_on_disk_9));
+	drbd_md_encode(device, page_address(device->md_sb.page));
+
+	if (!test_bit(MD_NO_FUA, &device->flags))
+		op_flags |= REQ_FUA | REQ_PREFLUSH;
+	bio = bio_alloc_bioset(device->ldev->md_bdev, 1, REQ_OP_WRITE | op_flags,
+			       GFP_NOIO, &drbd_md_io_bio_set);
+	bio->bi_iter.bi_sector = device->ldev->md.md_offset;
+	if (bio_add_page(bio, device->md_sb.page, 4096, 0) != 4096) {
+		bio_put(bio);
+		put_ldev(device);
+		md_sb_release(device, -EIO);
+		return;
+	}
+	bio->bi_private = device;
+	bio->bi_end_io = md_sb_endio;
+
+	if (drbd_insert_fault(device, DRBD_FAULT_MD_WR)) {
+		bio->bi_status = BLK_STS_IOERR;
+		bio_endio(bio);
+	} else {
+		submit_bio(bio);
+	}
+}
+
+/**
+ * drbd_md_sync_kick() - Submits superblock updates asked for meanwhile
+ * @device:	DRBD device.
+ */
+void drbd_md_sync_kick(struct drbd_device *device)
+{
+	if (md_sb_claim(device, true))
+		md_sb_submit(device);
+}
+
+/**
+ * drbd_md_sync_async() - Writes the meta data super block without waiting
+ * @device:	DRBD device.
+ *
+ * Returns a ticket for drbd_md_sync_wait(). If a superblock write is in
+ * flight already, the update goes out together with all others asked for
+ * until that one completes.
+ */
+u64 drbd_md_sync_async(struct drbd_device *device)
+{
+	unsigned long flags;
+	u64 ticket;
+
+	spin_lock_irqsave(&device->md_sb.lock, flags);
+	ticket = ++device->md_sb.queued;
+	spin_unlock_irqrestore(&device->md_sb.lock, flags);
+
+	drbd_md_sync_kick(device);
+	return ticket;
+}
+
+/* 0 once the update is on disk, an error if it failed, 1 while pending */
+static int md_sb_result(struct drbd_device *device, u64 ticket)
+{
+	struct drbd_md_sb_io *sb = &device->md_sb;
+	unsigned long flags;
+	int r = 1;
+
+	spin_lock_irqsave(&sb->lock, flags);
+	if (sb->written >= ticket)
+		r = 0;
+	else if (sb->failed >= ticket)
+		r = sb->error ?: -EIO;
+	spin_unlock_irqrestore(&sb->lock, flags);
+
+	return r;
+}
+
+/**
+ * drbd_md_sync_wait() - Waits for a superblock update to reach stable storage
+ * @device:	DRBD device.
+ * @ticket:	as returned by drbd_md_sync_async().
+ *
+ * Submits the update itself if it is still queued, so the worker may wait
+ * for its own updates.
+ */
+int drbd_md_sync_wait(struct drbd_device *device, u64 ticket) __must_hold(local)
+{
+	long dt;
+	int r;
+
+	rcu_read_lock();
+	dt = rcu_dereference(device->ldev->disk_conf)->disk_timeout;
+	rcu_read_unlock();
+	dt = dt * HZ / 10;
+	if (dt == 0)
+		dt = MAX_SCHEDULE_TIMEOUT;
+
+	for (;;) {
+		dt = wait_event_timeout(device->misc_wait,
+				(r = md_sb_result(device, ticket)) <= 0 ||
+				!READ_ONCE(device->md_sb.busy) ||
+				test_bit(FORCE_DETACH, &device->flags), dt);
+		if (r <= 0)
+			return r;
+		if (test_bit(FORCE_DETACH, &device->flags))
+			return -EIO;
+		if (dt == 0) {
+			drbd_err(device, "meta-data IO operation timed out\n");
+			drbd_handle_io_error(device, DRBD_FORCE_DETACH);
+			return -EIO;
+		}
+		drbd_md_sync_kick(device);
+	}
+}
+
 /**
  * __drbd_md_sync() - Writes the meta data super block (conditionally) if the MD_DIRTY flag bit is set
  * @device:	DRBD device.
  * @maybe:	meta data may in fact be "clean", the actual write may be skipped.
+ *
+ * Concurrent callers share one write; see drbd_md_sync_async().
  */
 static int __drbd_md_sync(struct drbd_device *device, bool maybe)
 {
-	struct meta_data_on_disk_9 *buffer;
-	int err = -EIO;
+	u64 ticket;
+	int err;
 
 	/* Don't accidentally change the DRBD meta data layout. */
 	BUILD_BUG_ON(DRBD_PEERS_MAX != 32);
@@ -4245,21 +4991,13 @@ static int __drbd_md_sync(struct drbd_device *device, bool maybe)
 	if (!get_ldev_if_state(device, D_DETACHING))
 		return -EIO;
 
-	buffer = drbd_md_get_buffer(device, __func__);
-	if (!buffer)
-		goto out;
-
-	del_timer(&device->md_sync_timer);
-	/* timer may be rearmed by drbd_md_mark_dirty() now. */
-
-	if (test_and_clear_bit(MD_DIRTY, &device->flags) || !maybe) {
-		err = drbd_md_write(device, buffer);
-		if (err)
-			set_bit(MD_DIRTY, &device->flags);
-	}
+	if (maybe && !test_bit(MD_DIRTY, &device->flags))
+		/* only wait for what others asked for already */
+		ticket = READ_ONCE(device->md_sb.queued);
+	else
+		ticket = drbd_md_sync_async(device);
+	err = drbd_md_sync_wait(device, ticket);
 
-	drbd_md_put_buffer(device);
-out:
 	put_ldev(device);
 
 	return err;
@@ -5171,7 +5909,7 @@ int drbd_bmio_set_n_write(struct drbd_device *device,
 
 	rv = drbd_bm_write(device, NULL);
 
-	if (!rv) {
+	if (!rv && !drbd_bm_lost_bits(device, peer_device->bitmap_index)) {
 		drbd_md_clear_peer_flag(peer_device, MDF_PEER_FULL_SYNC);
 		drbd_md_sync(device);
 	}
@@ -5490,13 +6228,14 @@ u64 directly_connected_nodes(struct drbd_resource *resource, enum which_state wh
 	return directly_connected;
 }
 
-static sector_t bm_sect_to_max_capacity(unsigned int bm_max_peers, sector_t bm_sect)
+static sector_t bm_sect_to_max_capacity(unsigned int bm_max_peers, unsigned int bm_block_shift,
+					sector_t bm_sect)
 {
 	/* we do our meta data IO in 4k units */
 	u64 bm_bytes = ALIGN_DOWN(bm_sect << SECTOR_SHIFT, 4096);
 	u64 bm_bytes_per_peer = div_u64(bm_bytes, bm_max_peers);
 	u64 bm_bits_per_peer = bm_bytes_per_peer * BITS_PER_BYTE;
-	return BM_BIT_TO_SECT(bm_bits_per_peer);
+	return (sector_t)bm_bits_per_peer << (bm_block_shift - SECTOR_SHIFT);
 }
 
 /**
@@ -5534,7 +6273,7 @@ sector_t drbd_get_max_capacity(
 		backing_capacity_remaining = backing_bdev_capacity;
 	}
 
-	metadata_limit = bm_sect_to_max_capacity(bm_max_peers, bm_sect);
+	metadata_limit = bm_sect_to_max_capacity(bm_max_peers, bdev->md.bm_block_shift, bm_sect);
 
 	dynamic_drbd_dbg(device,
 			"Backing device capacity: %llus, remaining: %llus, bitmap sectors: %llus\n",
@@ -1326,15 +1326,17 @@ out:
 	return 0;
 }
 
-u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers)
+u64 drbd_capacity_to_on_disk_bm_sect(u64 capacity_sect, unsigned int max_peers,
+				     unsigned int bm_block_shift)
 {
+	unsigned int sect_shift = bm_block_shift - SECTOR_SHIFT;
 	u64 bits, bytes;
 
 	/* round up storage sectors to full "bitmap sectors per bit", then
 	 * convert to number of bits needed, and round that up to 64bit words
 	 * to ease interoperability between 32bit and 64bit architectures.
 	 */
-	bits = ALIGN(BM_SECT_TO_BIT(ALIGN(capacity_sect, BM_SECT_PER_BIT)), 64);
+	bits = ALIGN(ALIGN(capacity_sect, 1ULL << sect_shift) >> sect_shift, 64);
 
 	/* convert to bytes, multiply by number of peers,
 	 * and, because we do all our meta data IO in 4k blocks,
@@ -1404,7 +1406,7 @@ void drbd_md_set_sector_offsets(struct drbd_device *device,
 		 * and the activity log; */
 		md_size_sect = drbd_capacity_to_on_disk_bm_sect(
 				drbd_get_capacity(bdev->backing_bdev),
-				max_peers)
+				max_peers, bdev->md.bm_block_shift)
 			+ (4096 >> 9) + al_size_sect;
 
 		bdev->md.md_size_sect = md_size_sect;
@@ -1666,7 +1668,8 @@ drbd_determine_dev_size(struct drbd_device *device, sector_t peer_current_size,
 		if (!prev_al_disabled)
 			md->flags &= ~MDF_AL_DISABLED;
 		for (i = 0; i < DRBD_PEERS_MAX; i++) {
-			if (0 == (prev_peer_full_sync & (1 << i)))
+			if (0 == (prev_peer_full_sync & (1 << i)) &&
+			    !drbd_bm_lost_bits(device, md->peers[i].bitmap_index))
 				md->peers[i].flags &= ~MDF_PEER_FULL_SYNC;
 		}
 		drbd_md_write(device, buffer);
@@ -1836,34 +1839,86 @@ drbd_new_dev_size(struct drbd_device *device,
 	return size;
 }
 
+static unsigned int drbd_al_extents_max(struct drbd_backing_dev *bdev);
+
+/* The activity log extent size for @bdev, as the al_extent_mb module
+ * parameter asks for. Each extent takes up as many slots of the on-disk
+ * activity log as it has 4M extents, so larger extents may not fit with
+ * @al_extents. The on-disk activity log does not depend on it, the size may
+ * differ from one attach to the next. */
+static unsigned int al_extent_shift_for(struct drbd_device *device,
+					struct drbd_backing_dev *bdev, unsigned int al_extents)
+{
+	unsigned int mb = READ_ONCE(drbd_al_extent_mb);
+	unsigned int shift = AL_EXTENT_SHIFT;
+
+	if (mb == 4 || mb == 16 || mb == 64)
+		shift = ilog2(mb) + 20;
+	else
+		drbd_warn(device, "al_extent_mb=%u not supported, using %u\n",
+			  mb, 1U << (shift - 20));
+	mb = 1U << (shift - 20);
+
+	/* the pmem activity log has one extent number per element */
+	if (drbd_md_dax_active(bdev))
+		return AL_EXTENT_SHIFT;
+
+	while (shift > AL_EXTENT_SHIFT &&
+	       (al_extents << (shift - AL_EXTENT_SHIFT)) > drbd_al_extents_max(bdev))
+		shift -= 2;
+	if (mb != 1U << (shift - 20))
+		drbd_warn(device, "%u al-extents of %u MiB do not fit the on-disk activity log, "
+			  "using %u MiB\n", al_extents, mb, 1U << (shift - 20));
+	return shift;
+}
+
 /*
  * drbd_check_al_size() - Ensures that the AL is of the right size
  * @device:	DRBD device.
+ * @bdev:	The backing device the AL is for.
  *
  * Returns -EBUSY if current al lru is still used, -ENOMEM when allocation
  * failed, and 0 on success. You should call drbd_md_sync() after you called
  * this function.
  */
-static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
+static int drbd_check_al_size(struct drbd_device *device, struct drbd_backing_dev *bdev,
+			      struct disk_conf *dc)
 {
 	struct lru_cache *n, *t;
 	struct lc_element *e;
 	unsigned int in_use;
+	struct drbd_al_ghost *ghost;
+	unsigned int shift;
 	int i;
 
+	/* every extent a request may touch fits one transaction */
+	BUILD_BUG_ON(((DRBD_MAX_BATCH_BIO_SIZE >> AL_EXTENT_SHIFT_MAX) + 1) <<
+		     (AL_EXTENT_SHIFT_MAX - AL_EXTENT_SHIFT) > AL_UPDATES_PER_TRANSACTION);
+
+	shift = al_extent_shift_for(device, bdev, dc->al_extents);
 	if (device->act_log &&
-	    device->act_log->nr_elements == dc->al_extents)
+	    device->act_log->nr_elements == dc->al_extents &&
+	    device->al_extent_shift == shift)
 		return 0;
 
 	in_use = 0;
 	t = device->act_log;
-	n = lc_create("act_log", drbd_al_ext_cache, AL_UPDATES_PER_TRANSACTION,
-		dc->al_extents, sizeof(struct lc_element), 0);
+	/* each change takes that many update slots in a transaction */
+	n = lc_create("act_log", drbd_al_ext_cache,
+		AL_UPDATES_PER_TRANSACTION >> (shift - AL_EXTENT_SHIFT),
+		dc->al_extents, sizeof(struct al_extent), offsetof(struct al_extent, lce));
 
 	if (n == NULL) {
 		drbd_err(device, "Cannot allocate act_log lru!\n");
 		return -ENOMEM;
 	}
+	ghost = kmalloc_array(max(dc->al_extents / 2, 1U),
+			      sizeof(*ghost) + sizeof(struct hlist_head), GFP_KERNEL);
+	if (ghost == NULL) {
+		drbd_err(device, "Cannot allocate act_log lru!\n");
+		lc_destroy(n);
+		return -ENOMEM;
+	}
 	spin_lock_irq(&device->al_lock);
 	if (t) {
 		for (i = 0; i < t->nr_elements; i++) {
@@ -1874,9 +1929,15 @@ static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
 			in_use += e->refcnt;
 		}
 	}
-	if (!in_use)
+	if (!in_use) {
 		device->act_log = n;
+		device->al_extent_shift = shift;
+		device->al_tr_cycle = 0;
+		swap(ghost, device->al_policy.ghost);
+		drbd_al_policy_init(device);
+	}
 	spin_unlock_irq(&device->al_lock);
+	kfree(ghost);
 	if (in_use) {
 		drbd_err(device, "Activity log still in use!\n");
 		lc_destroy(n);
@@ -2191,7 +2252,7 @@ static int disk_opts_check_al_size(struct drbd_device *device, struct disk_conf
 
 	wait_event(device->al_wait, drbd_al_try_lock(device));
 	drbd_al_shrink(device);
-	err = drbd_check_al_size(device, dc);
+	err = drbd_check_al_size(device, device->ldev, dc);
 	lc_unlock(device->act_log);
 	wake_up(&device->al_wait);
 out:
@@ -2696,7 +2757,7 @@ static int check_offsets_and_sizes(struct drbd_device *device,
 
 	/* can the available bitmap space cover the last agreed device size? */
 	if (on_disk_bm_sect < drbd_capacity_to_on_disk_bm_sect(
-				in_core->effective_size, max_peers))
+				in_core->effective_size, max_peers, in_core->bm_block_shift))
 		goto err;
 
 	return 0;
@@ -2741,7 +2802,7 @@ int drbd_md_decode(struct drbd_config_context *adm_ctx,
 		   struct meta_data_on_disk_9 *buffer)
 {
 	struct drbd_device *device = adm_ctx->device;
-	u32 magic, flags;
+	u32 magic, flags, bm_bytes_per_bit;
 	int i, rv = NO_ERROR;
 	int my_node_id = device->resource->res_opts.node_id;
 	u32 max_peers;
@@ -2765,11 +2826,14 @@ int drbd_md_decode(struct drbd_config_context *adm_ctx,
 		goto err;
 	}
 
-	if (be32_to_cpu(buffer->bm_bytes_per_bit) != BM_BLOCK_SIZE) {
-		drbd_err_and_skb_info(adm_ctx, "unexpected bm_bytes_per_bit: %u (expected %u)\n",
-		    be32_to_cpu(buffer->bm_bytes_per_bit), BM_BLOCK_SIZE);
+	bm_bytes_per_bit = be32_to_cpu(buffer->bm_bytes_per_bit);
+	if (!is_power_of_2(bm_bytes_per_bit) || bm_bytes_per_bit < BM_BLOCK_SIZE ||
+	    bm_bytes_per_bit > 1U << BM_BLOCK_SHIFT_MAX) {
+		drbd_err_and_skb_info(adm_ctx, "unexpected bm_bytes_per_bit: %u (expected a power of 2 from %u to %u)\n",
+		    bm_bytes_per_bit, BM_BLOCK_SIZE, 1U << BM_BLOCK_SHIFT_MAX);
 		goto err;
 	}
+	bdev->md.bm_block_shift = ilog2(bm_bytes_per_bit);
 
 	if (check_activity_log_stripe_size(device, buffer, &bdev->md))
 		goto err;
@@ -3141,7 +3205,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	/* Since we are diskless, fix the activity log first... */
-	if (drbd_check_al_size(device, new_disk_conf)) {
+	if (drbd_check_al_size(device, nbc, new_disk_conf)) {
 		retcode = ERR_NOMEM;
 		goto force_diskless_dec;
 	}
@@ -3152,6 +3216,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	 * clean it up somewhere.  */
 	D_ASSERT(device, device->ldev == NULL);
 	device->ldev = nbc;
+	device->bitmap->bm_block_shift = nbc->md.bm_block_shift;
 	nbc = NULL;
 	new_disk_conf = NULL;
 
@@ -4042,6 +4107,12 @@ static int adm_new_connection(struct drbd_config_context *adm_ctx, struct genl_i
 
 	((char *)new_net_conf->shared_secret)[SHARED_SECRET_MAX-1] = 0;
 
+	err = drbd_req_grow_node_slots(adm_ctx->resource, adm_ctx->peer_node_id);
+	if (err) {
+		retcode = ERR_NOMEM;
+		goto fail_free_connection;
+	}
+
 	mutex_lock(&adm_ctx->resource->conf_update);
 	idr_for_each_entry(&adm_ctx->resource->devices, device, i) {
 		int id;
@@ -5717,6 +5788,7 @@ static void peer_device_to_statistics(struct peer_device_statistics *s,
 				      struct drbd_peer_device *pd)
 {
 	struct drbd_device *device = pd->device;
+	struct drbd_bitmap *bm = device->bitmap;
 	unsigned long now = jiffies;
 	unsigned long rs_left = 0;
 	int i;
@@ -5730,19 +5802,19 @@ static void peer_device_to_statistics(struct peer_device_statistics *s,
 	s->peer_dev_pending = atomic_read(&pd->ap_pending_cnt) +
 			      atomic_read(&pd->rs_pending_cnt);
 	s->peer_dev_unacked = atomic_read(&pd->unacked_cnt);
-	s->peer_dev_out_of_sync = BM_BIT_TO_SECT(drbd_bm_total_weight(pd));
+	s->peer_dev_out_of_sync = bm_bit_to_sect(bm, drbd_bm_total_weight(pd));
 
 	if (is_verify_state(pd, NOW)) {
-		rs_left = BM_BIT_TO_SECT(atomic64_read(&pd->ov_left));
+		rs_left = bm_bit_to_sect(bm, atomic64_read(&pd->ov_left));
 		s->peer_dev_ov_start_sector = pd->ov_start_sector;
 		s->peer_dev_ov_stop_sector = pd->ov_stop_sector;
 		s->peer_dev_ov_position = pd->ov_position;
-		s->peer_dev_ov_left = BM_BIT_TO_SECT(atomic64_read(&pd->ov_left));
-		s->peer_dev_ov_skipped = BM_BIT_TO_SECT(pd->ov_skipped);
+		s->peer_dev_ov_left = bm_bit_to_sect(bm, atomic64_read(&pd->ov_left));
+		s->peer_dev_ov_skipped = bm_bit_to_sect(bm, pd->ov_skipped);
 	} else if (is_sync_state(pd, NOW)) {
-		rs_left = s->peer_dev_out_of_sync - BM_BIT_TO_SECT(pd->rs_failed);
-		s->peer_dev_resync_failed = BM_BIT_TO_SECT(pd->rs_failed);
-		s->peer_dev_rs_same_csum = BM_BIT_TO_SECT(pd->rs_same_csum);
+		rs_left = s->peer_dev_out_of_sync - bm_bit_to_sect(bm, pd->rs_failed);
+		s->peer_dev_resync_failed = bm_bit_to_sect(bm, pd->rs_failed);
+		s->peer_dev_rs_same_csum = bm_bit_to_sect(bm, pd->rs_same_csum);
 	}
 
 	if (rs_left) {
@@ -5750,18 +5822,18 @@ static void peer_device_to_statistics(struct peer_device_statistics *s,
 		if (repl_state == L_SYNC_TARGET || repl_state == L_VERIFY_S)
 			s->peer_dev_rs_c_sync_rate = pd->c_sync_rate;
 
-		s->peer_dev_rs_total = BM_BIT_TO_SECT(pd->rs_total);
+		s->peer_dev_rs_total = bm_bit_to_sect(bm, pd->rs_total);
 
 		s->peer_dev_rs_dt_start_ms = jiffies_to_msecs(now - pd->rs_start);
 		s->peer_dev_rs_paused_ms = jiffies_to_msecs(pd->rs_paused);
 
 		i = (pd->rs_last_mark + 2) % DRBD_SYNC_MARKS;
 		s->peer_dev_rs_dt0_ms = jiffies_to_msecs(now - pd->rs_mark_time[i]);
-		s->peer_dev_rs_db0_sectors = BM_BIT_TO_SECT(pd->rs_mark_left[i]) - rs_left;
+		s->peer_dev_rs_db0_sectors = bm_bit_to_sect(bm, pd->rs_mark_left[i]) - rs_left;
 
 		i = (pd->rs_last_mark + DRBD_SYNC_MARKS-1) % DRBD_SYNC_MARKS;
 		s->peer_dev_rs_dt1_ms = jiffies_to_msecs(now - pd->rs_mark_time[i]);
-		s->peer_dev_rs_db1_sectors = BM_BIT_TO_SECT(pd->rs_mark_left[i]) - rs_left;
+		s->peer_dev_rs_db1_sectors = bm_bit_to_sect(bm, pd->rs_mark_left[i]) - rs_left;
 
 		/* long term average:
 		 * dt = rs_dt_start_ms - rs_paused_ms;
@@ -5948,7 +6020,8 @@ int drbd_adm_start_ov(struct sk_buff *skb, struct genl_info *info)
 	mutex_lock(&adm_ctx.resource->adm_mutex);
 
 	/* w_make_ov_request expects position to be aligned */
-	peer_device->ov_start_sector = parms.ov_start_sector & ~(BM_SECT_PER_BIT-1);
+	peer_device->ov_start_sector = parms.ov_start_sector &
+		~(bm_sect_per_bit(device->bitmap)-1);
 	peer_device->ov_stop_sector = parms.ov_stop_sector;
 
 	/* If there is still bitmap IO pending, e.g. previous resync or verify
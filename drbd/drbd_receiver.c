@@ -1934,14 +1934,19 @@ static void drbd_remove_peer_req_interval(struct drbd_device *device,
 					  struct drbd_peer_request *peer_req)
 {
 	struct drbd_interval *i = &peer_req->i;
+	unsigned long flags, shards;
 
-	drbd_remove_interval(&device->write_requests, i);
+	local_irq_save(flags);
+	shards = drbd_lock_intervals(device, i->sector, i->size);
+	drbd_remove_shard_interval(device, i);
 	drbd_clear_interval(i);
 	peer_req->flags &= ~EE_IN_INTERVAL_TREE;
 
 	/* Wake up any processes waiting for this peer request to complete.  */
 	if (test_bit(INTERVAL_WAITING, &i->flags))
 		wake_up(&device->misc_wait);
+	drbd_unlock_intervals(device, shards);
+	local_irq_restore(flags);
 }
 
 /**
@@ -1994,10 +1999,8 @@ int w_e_reissue(struct drbd_work *w, int cancel) __releases(local)
 		 * and cause a "Network failure" */
 		spin_lock_irq(&connection->peer_reqs_lock);
 		list_del(&peer_req->w.list);
-		spin_unlock(&connection->peer_reqs_lock);
-		spin_lock(&device->interval_lock);
+		spin_unlock_irq(&connection->peer_reqs_lock);
 		drbd_remove_peer_req_interval(device, peer_req);
-		spin_unlock_irq(&device->interval_lock);
 		drbd_al_complete_io(device, &peer_req->i);
 		drbd_may_finish_epoch(connection, peer_req->epoch, EV_PUT | EV_CLEANUP);
 		drbd_free_peer_req(peer_req);
@@ -2374,17 +2377,17 @@ out:
 	return err;
 }
 
-/* caller must hold interval_lock */
+/* caller must hold the interval shard locks for sector */
 static struct drbd_request *
-find_request(struct drbd_device *device, enum drbd_interval_type type, u64 id,
-	     sector_t sector, bool missing_ok, const char *func)
+find_request(struct drbd_device *device, unsigned long shards, enum drbd_interval_type type,
+	     u64 id, sector_t sector, bool missing_ok, const char *func)
 {
-	struct rb_root *root = type == INTERVAL_LOCAL_READ ? &device->read_requests : &device->write_requests;
 	struct drbd_request *req;
 
 	/* Request object according to our peer */
 	req = (struct drbd_request *)(unsigned long)id;
-	if (drbd_contains_interval(root, sector, &req->i) && req->i.type == type)
+	if (drbd_contains_shard_interval(device, shards, type, sector, &req->i) &&
+	    req->i.type == type)
 		return req;
 	if (!missing_ok) {
 		drbd_err(device, "%s: failed to find request 0x%lx, sector %llus\n", func,
@@ -2399,6 +2402,8 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 	struct drbd_device *device;
 	struct drbd_request *req;
 	sector_t sector;
+	unsigned long shards;
+	bool claimed = false;
 	int err;
 	struct p_data *p = pi->data;
 
@@ -2409,12 +2414,25 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 
 	sector = be64_to_cpu(p->sector);
 
-	spin_lock_irq(&device->interval_lock);
-	req = find_request(device, INTERVAL_LOCAL_READ, p->block_id, sector, false, __func__);
-	spin_unlock_irq(&device->interval_lock);
+	local_irq_disable();
+	shards = drbd_lock_intervals(device, sector, 1 << 9);
+	req = find_request(device, shards, INTERVAL_LOCAL_READ, p->block_id, sector, false, __func__);
+	if (req)
+		claimed = drbd_req_claim_read_reply(req, peer_device);
+	drbd_unlock_intervals(device, shards);
+	local_irq_enable();
 	if (unlikely(!req))
 		return -EIO;
 
+	if (!claimed) {
+		/* Hedged read, another peer answered first. Our pending state,
+		 * or RQ_EXP_READ_REPLY, still keeps the request around. */
+		err = ignore_remaining_packet(connection, pi->size);
+		if (!err)
+			req_mod(req, NEG_ACKED, peer_device);
+		return err;
+	}
+
 	err = recv_dless_read(peer_device, req, sector, pi->size);
 	if (!err)
 		req_mod(req, DATA_RECEIVED, peer_device);
@@ -2567,10 +2585,8 @@ static int e_end_block(struct drbd_work *w, int cancel)
 	 * P_WRITE_ACK / P_NEG_ACK, to get the sequence number right.  */
 	if (peer_req->flags & EE_IN_INTERVAL_TREE) {
 		read_lock_irq(&device->resource->state_rwlock);
-		spin_lock(&device->interval_lock);
 		D_ASSERT(device, !drbd_interval_empty(&peer_req->i));
 		drbd_remove_peer_req_interval(device, peer_req);
-		spin_unlock(&device->interval_lock);
 		read_unlock_irq(&device->resource->state_rwlock);
 	} else
 		D_ASSERT(device, drbd_interval_empty(&peer_req->i));
@@ -2719,17 +2735,19 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 	sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
 	struct drbd_interval *i;
+	unsigned long shards;
 	int err = 0;
 
-	spin_lock_irq(&device->interval_lock);
+	local_irq_disable();
+	shards = drbd_lock_intervals(device, sector, size);
 	/*
 	 * Inserting the peer request into the write_requests tree will prevent
 	 * new conflicting local requests from being added.
 	 */
-	drbd_insert_interval(&device->write_requests, &peer_req->i);
+	drbd_insert_shard_interval(device, &peer_req->i);
 	peer_req->flags |= EE_IN_INTERVAL_TREE;
 
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	drbd_for_each_shard_overlap(i, device, shards, INTERVAL_PEER_WRITE, sector, size) {
 		if (i == &peer_req->i)
 			continue;
 
@@ -2744,7 +2762,8 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 		err = -EBUSY;
 		break;
 	}
-	spin_unlock_irq(&device->interval_lock);
+	drbd_unlock_intervals(device, shards);
+	local_irq_enable();
 	return err;
 }
 
@@ -2777,7 +2796,7 @@ prepare_activity_log(struct drbd_peer_request *peer_req)
 	struct drbd_device *device = peer_device->device;
 
 	struct lru_cache *al;
-	int nr_al_extents = interval_to_al_extents(&peer_req->i);
+	int nr_al_extents = interval_to_al_extents(device, &peer_req->i);
 	int nr, used, ecnt;
 	int ret = DRBD_PAL_SUBMIT;
 
@@ -3045,9 +3064,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	return 0;
 
 out_remove_interval:
-	spin_lock_irq(&device->interval_lock);
 	drbd_remove_peer_req_interval(device, peer_req);
-	spin_unlock_irq(&device->interval_lock);
 
 out:
 	if (peer_req->flags & EE_SEND_WRITE_ACK)
@@ -3076,10 +3093,8 @@ void drbd_cleanup_after_failed_submit_peer_write(struct drbd_peer_request *peer_
 	spin_lock_irq(&connection->peer_reqs_lock);
 	list_del(&peer_req->w.list);
 	list_del_init(&peer_req->recv_order);
-	spin_unlock(&connection->peer_reqs_lock);
-	spin_lock(&device->interval_lock);
+	spin_unlock_irq(&connection->peer_reqs_lock);
 	drbd_remove_peer_req_interval(device, peer_req);
-	spin_unlock_irq(&device->interval_lock);
 
 	drbd_may_finish_epoch(connection, peer_req->epoch, EV_PUT + EV_CLEANUP);
 	put_ldev(device);
@@ -3097,18 +3112,16 @@ void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head
 	struct drbd_peer_request *peer_req, *pr_tmp;
 
 	write_lock_irq(&device->resource->state_rwlock);
-	spin_lock(&device->interval_lock);
 	list_for_each_entry(peer_req, cleanup, wait_for_actlog) {
 		list_del(&peer_req->w.list); /* should be on the "->active_ee" list */
 		atomic_dec(&peer_req->peer_device->connection->active_ee_cnt);
 		list_del_init(&peer_req->recv_order);
 		drbd_remove_peer_req_interval(device, peer_req);
 	}
-	spin_unlock(&device->interval_lock);
 	write_unlock_irq(&device->resource->state_rwlock);
 
 	list_for_each_entry_safe(peer_req, pr_tmp, cleanup, wait_for_actlog) {
-		atomic_sub(interval_to_al_extents(&peer_req->i), &device->wait_for_actlog_ecnt);
+		atomic_sub(interval_to_al_extents(device, &peer_req->i), &device->wait_for_actlog_ecnt);
 		atomic_dec(&device->wait_for_actlog);
 		if (peer_req->flags & EE_SEND_WRITE_ACK)
 			dec_unacked(peer_req->peer_device);
@@ -3183,7 +3196,7 @@ bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *peer_device)
 		if (!dt)
 			dt++;
 		db = peer_device->rs_mark_left[i] - rs_left;
-		dbdt = Bit2KB(db/dt);
+		dbdt = bm_bit_to_kb(device->bitmap, db/dt);
 
 		if (dbdt > c_min_rate)
 			return true;
@@ -3378,7 +3391,8 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		    connection->agreed_pro_version >= 90) {
 			unsigned long now = jiffies;
 			int i;
-			unsigned long ov_left = drbd_bm_bits(device) - BM_SECT_TO_BIT(sector);
+			unsigned long ov_left = drbd_bm_bits(device) -
+				bm_sect_to_bit(device->bitmap, sector);
 			atomic64_set(&peer_device->ov_left, ov_left);
 			peer_device->ov_start_sector = sector;
 			peer_device->ov_skipped = 0;
@@ -5278,6 +5292,15 @@ static int receive_sizes(struct drbd_connection *connection, struct packet_info
 			(unsigned long long)my_usize,
 			(unsigned long long)my_max_size);
 
+		/* Bitmaps are exchanged and merged bit by bit, both sides need
+		 * to track the same amount of data per bit. The protocol has no
+		 * way to tell a peer's granularity yet, peers use 4k per bit. */
+		if (p_size && device->ldev->md.bm_block_shift != BM_BLOCK_SHIFT) {
+			drbd_err(peer_device, "Peers use a bitmap granularity of 4k, mine is %uk\n",
+				 1U << (device->ldev->md.bm_block_shift - 10));
+			goto disconnect;
+		}
+
 		if (peer_device->disk_state[NOW] > D_DISKLESS)
 			warn_if_differ_considerably(peer_device, "lower level device sizes",
 				   p_size, my_max_size);
@@ -7899,14 +7922,18 @@ static int receive_UnplugRemote(struct drbd_connection *connection, struct packe
 static int receive_out_of_sync(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_peer_device *peer_device;
+	struct drbd_device *device;
 	struct p_block_desc *p = pi->data;
+	unsigned int size;
 	sector_t sector;
 
 	peer_device = conn_peer_device(connection, pi->vnr);
 	if (!peer_device)
 		return -EIO;
+	device = peer_device->device;
 
 	sector = be64_to_cpu(p->sector);
+	size = be32_to_cpu(p->blksize);
 
 	/* see also process_one_request(), before drbd_send_out_of_sync().
 	 * Make sure any pending write requests that potentially may
@@ -7917,15 +7944,23 @@ static int receive_out_of_sync(struct drbd_connection *connection, struct packet
 	conn_wait_active_ee_empty_or_disconnect(connection);
 	conn_wait_done_ee_empty_or_disconnect(connection);
 
+	/* Not covered by our activity log. Allocate the pages of a sparse
+	 * bitmap here, rather than in atomic context. */
+	if (size && get_ldev(device)) {
+		drbd_bm_sparse_prepare(device, bm_sect_to_bit(device->bitmap, sector),
+				       bm_sect_to_bit(device->bitmap, sector + (size >> 9) - 1));
+		put_ldev(device);
+	}
+
 	mutex_lock(&peer_device->resync_next_bit_mutex);
 
 	if (peer_device->repl_state[NOW] == L_SYNC_TARGET) {
-		unsigned long bit = BM_SECT_TO_BIT(sector);
+		unsigned long bit = bm_sect_to_bit(device->bitmap, sector);
 		if (bit < peer_device->resync_next_bit)
 			peer_device->resync_next_bit = bit;
 	}
 
-	drbd_set_out_of_sync(peer_device, sector, be32_to_cpu(p->blksize));
+	drbd_set_out_of_sync(peer_device, sector, size);
 
 	mutex_unlock(&peer_device->resync_next_bit_mutex);
 
@@ -9134,8 +9169,8 @@ static int got_IsInSync(struct drbd_connection *connection, struct packet_info *
 	if (get_ldev(device)) {
 		drbd_rs_complete_io(peer_device, sector);
 		drbd_set_in_sync(peer_device, sector, blksize);
-		/* rs_same_csums is supposed to count in units of BM_BLOCK_SIZE */
-		peer_device->rs_same_csum += (blksize >> BM_BLOCK_SHIFT);
+		/* rs_same_csums is supposed to count in units of bm_block_size() */
+		peer_device->rs_same_csum += (blksize >> device->bitmap->bm_block_shift);
 		put_ldev(device);
 	}
 	dec_rs_pending(peer_device);
@@ -9151,12 +9186,17 @@ validate_req_change_req_state(struct drbd_peer_device *peer_device, u64 id, sect
 {
 	struct drbd_device *device = peer_device->device;
 	struct drbd_request *req;
+	unsigned long shards;
 
-	spin_lock_irq(&device->interval_lock);
-	req = find_request(device, type, id, sector, missing_ok, func);
-	spin_unlock_irq(&device->interval_lock);
+	local_irq_disable();
+	shards = drbd_lock_intervals(device, sector, 1 << 9);
+	req = find_request(device, shards, type, id, sector, missing_ok, func);
+	drbd_unlock_intervals(device, shards);
+	local_irq_enable();
 	if (unlikely(!req))
 		return -EIO;
+	if (type == INTERVAL_LOCAL_WRITE)
+		req_mod_coalesced(req, what, peer_device);
 	req_mod(req, what, peer_device);
 
 	return 0;
@@ -9300,7 +9340,7 @@ static int got_NegRSDReply(struct drbd_connection *connection, struct packet_inf
 				drbd_verify_skipped_block(peer_device, sector, size);
 				verify_progress(peer_device, sector, size);
 			} else {
-				bit = BM_SECT_TO_BIT(sector);
+				bit = bm_sect_to_bit(peer_device->device->bitmap, sector);
 				mutex_lock(&peer_device->resync_next_bit_mutex);
 				peer_device->resync_next_bit = min(peer_device->resync_next_bit, bit);
 				mutex_unlock(&peer_device->resync_next_bit_mutex);
@@ -9560,7 +9600,7 @@ static void cleanup_peer_ack_list(struct drbd_connection *connection)
 		drbd_destroy_peer_ack_if_done(peer_ack);
 	}
 	req = resource->peer_ack_req;
-	if (req)
+	if (req && req_has_node_slot(req, idx))
 		req->net_rq_state[idx] &= ~RQ_NET_SENT;
 	spin_unlock_irq(&resource->peer_ack_lock);
 }
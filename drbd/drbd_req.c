@@ -22,13 +22,29 @@ static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector,
 
 static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio *bio_src)
 {
+	unsigned int node_slots = READ_ONCE(device->resource->req_node_slots);
 	struct drbd_request *req;
+	void *area;
 
-	req = mempool_alloc(&drbd_request_mempool, GFP_NOIO);
+	req = drbd_alloc_request(node_slots);
 	if (!req)
 		return NULL;
 
-	memset(req, 0, sizeof(*req));
+	memset(req, 0, drbd_req_size(node_slots));
+
+	req->node_slots = node_slots;
+	area = req->node_area;
+	req->pre_send_jif = area;
+	area += node_slots * sizeof(unsigned long);
+#ifdef CONFIG_DRBD_TIMING_STATS
+	req->pre_send_kt = area;
+	area += node_slots * sizeof(ktime_t);
+	req->acked_kt = area;
+	area += node_slots * sizeof(ktime_t);
+	req->net_done_kt = area;
+	area += node_slots * sizeof(ktime_t);
+#endif
+	req->net_rq_state = area;
 
 	kref_get(&device->kref);
 	kref_debug_get(&device->kref_debug, 6);
@@ -63,7 +79,33 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 void drbd_reclaim_req(struct rcu_head *rp)
 {
 	struct drbd_request *req = container_of(rp, struct drbd_request, rcu);
-	mempool_free(req, &drbd_request_mempool);
+	drbd_free_request(req);
+}
+
+/* The request is unreachable now, except for RCU readers */
+static void drbd_release_req(struct drbd_resource *resource, struct drbd_request *req)
+{
+	call_rcu(&req->rcu, drbd_reclaim_req);
+}
+
+/* Requests allocated from now on have a slot for node_id. Those still
+ * around keep their smaller size class: they were never sent to node_id,
+ * and req_net_state() reads nothing for it. Submission skips peers a
+ * request has no slot for, their bits end up out of sync. */
+int drbd_req_grow_node_slots(struct drbd_resource *resource, int node_id)
+{
+	unsigned int node_slots = drbd_req_node_slots(node_id);
+	int err;
+
+	if (node_slots > resource->req_node_slots) {
+		err = drbd_create_request_mempool(node_slots);
+		if (err)
+			return err;
+
+		WRITE_ONCE(resource->req_node_slots, node_slots);
+	}
+
+	return 0;
 }
 
 static u64 peer_ack_mask(struct drbd_request *req)
@@ -80,7 +122,7 @@ static u64 peer_ack_mask(struct drbd_request *req)
 	for_each_connection_rcu(connection, resource) {
 		int node_id = connection->peer_node_id;
 
-		if (req->net_rq_state[node_id] & RQ_NET_OK)
+		if (req_net_state(req, node_id) & RQ_NET_OK)
 			mask |= NODE_MASK(node_id);
 	}
 	rcu_read_unlock();
@@ -99,7 +141,7 @@ static void queue_peer_ack_send(struct drbd_resource *resource,
 		unsigned int node_id = connection->peer_node_id;
 		if (connection->agreed_pro_version < 110 ||
 				connection->cstate[NOW] != C_CONNECTED ||
-				!(req->net_rq_state[node_id] & RQ_NET_SENT))
+				!(req_net_state(req, node_id) & RQ_NET_SENT))
 			continue;
 
 		peer_ack->pending_mask |= NODE_MASK(node_id);
@@ -147,7 +189,7 @@ int w_queue_peer_ack(struct drbd_work *w, int cancel)
 		drbd_destroy_peer_ack_if_done(peer_ack);
 		spin_unlock_irq(&resource->peer_ack_lock);
 
-		call_rcu(&req->rcu, drbd_reclaim_req);
+		drbd_release_req(resource, req);
 	}
 	return 0;
 }
@@ -166,8 +208,8 @@ static bool peer_ack_differs(struct drbd_request *req1, struct drbd_request *req
 	unsigned int node_id;
 
 	for (node_id = 0; node_id <= max_node_id; node_id++)
-		if ((req1->net_rq_state[node_id] & RQ_NET_OK) !=
-		    (req2->net_rq_state[node_id] & RQ_NET_OK))
+		if ((req_net_state(req1, node_id) & RQ_NET_OK) !=
+		    (req_net_state(req2, node_id) & RQ_NET_OK))
 			return true;
 	return false;
 }
@@ -181,15 +223,160 @@ static bool peer_ack_window_full(struct drbd_request *req)
 	return dagtag_newer_eq(req->dagtag_sector, last_dagtag);
 }
 
-static void drbd_remove_request_interval(struct rb_root *root,
-					 struct drbd_request *req)
+/* Shards of [sector, sector + size), plus the wide one if that crosses a
+ * shard boundary. Shards stripe the device by activity log extent. */
+static unsigned long interval_shards(sector_t sector, unsigned int size)
+{
+	const int shift = AL_EXTENT_SHIFT - 9;
+	sector_t end = sector + (size >> 9);
+	u64 first = sector >> shift;
+	u64 last = (end > sector ? end - 1 : sector) >> shift;
+	unsigned long shards = 0;
+
+	if (first == last)
+		return BIT(first & (DRBD_INTERVAL_SHARDS - 1));
+
+	if (last - first >= DRBD_INTERVAL_SHARDS - 1)
+		shards = BIT(DRBD_INTERVAL_SHARDS) - 1;
+	else
+		for (; first <= last; first++)
+			shards |= BIT(first & (DRBD_INTERVAL_SHARDS - 1));
+	return shards | BIT(DRBD_INTERVAL_WIDE);
+}
+
+/* index of the shard whose tree @i is in */
+int drbd_interval_shard(struct drbd_interval *i)
+{
+	unsigned long shards = interval_shards(i->sector, i->size);
+
+	return shards & BIT(DRBD_INTERVAL_WIDE) ? DRBD_INTERVAL_WIDE : __ffs(shards);
+}
+
+static struct rb_root *shard_root(struct drbd_interval_shard *shard,
+				  enum drbd_interval_type type)
+{
+	return type == INTERVAL_LOCAL_READ ? &shard->read_requests : &shard->write_requests;
+}
+
+/**
+ * drbd_lock_intervals() - Lock the interval shards for [sector, sector + size)
+ * @device:	DRBD device.
+ * @sector:	start sector of the range.
+ * @size:	size of the range in bytes.
+ *
+ * Locks every shard the range touches, in index order, and then the wide
+ * shard if the range crosses a shard boundary or some wide interval covers a
+ * touched shard. Wide intervals bump nr_wide of the shards they cover while
+ * holding those locks, so every interval overlapping the range is stable
+ * afterwards, and found by drbd_for_each_shard_overlap() with the returned
+ * mask. Local irqs must be disabled.
+ */
+unsigned long drbd_lock_intervals(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	unsigned long shards = interval_shards(sector, size);
+	bool wide = shards & BIT(DRBD_INTERVAL_WIDE);
+	unsigned int s;
+
+	lockdep_assert_irqs_disabled();
+
+	for_each_set_bit(s, &shards, DRBD_INTERVAL_SHARDS) {
+		spin_lock(&device->interval_shards[s].lock);
+		if (device->interval_shards[s].nr_wide)
+			wide = true;
+	}
+	if (wide) {
+		spin_lock(&device->interval_shards[DRBD_INTERVAL_WIDE].lock);
+		shards |= BIT(DRBD_INTERVAL_WIDE);
+	}
+	return shards;
+}
+
+void drbd_unlock_intervals(struct drbd_device *device, unsigned long shards)
+{
+	unsigned int s;
+
+	for_each_set_bit(s, &shards, DRBD_INTERVAL_SHARDS + 1)
+		spin_unlock(&device->interval_shards[s].lock);
+}
+
+/* Caller holds drbd_lock_intervals() for @i */
+void drbd_insert_shard_interval(struct drbd_device *device, struct drbd_interval *i)
+{
+	unsigned long shards = interval_shards(i->sector, i->size);
+	unsigned int s, home = __ffs(shards);
+
+	if (shards & BIT(DRBD_INTERVAL_WIDE)) {
+		for_each_set_bit(s, &shards, DRBD_INTERVAL_SHARDS)
+			device->interval_shards[s].nr_wide++;
+		home = DRBD_INTERVAL_WIDE;
+	}
+	drbd_insert_interval(shard_root(&device->interval_shards[home], i->type), i);
+}
+
+/* Caller holds drbd_lock_intervals() for @i */
+void drbd_remove_shard_interval(struct drbd_device *device, struct drbd_interval *i)
+{
+	unsigned long shards = interval_shards(i->sector, i->size);
+	unsigned int s, home = __ffs(shards);
+
+	if (drbd_interval_empty(i))
+		return;
+
+	if (shards & BIT(DRBD_INTERVAL_WIDE)) {
+		for_each_set_bit(s, &shards, DRBD_INTERVAL_SHARDS)
+			device->interval_shards[s].nr_wide--;
+		home = DRBD_INTERVAL_WIDE;
+	}
+	drbd_remove_interval(shard_root(&device->interval_shards[home], i->type), i);
+}
+
+/* Iteration step of drbd_for_each_shard_overlap(): the next interval after
+ * @i (or the first one, for NULL) overlapping [sector, sector + size) in the
+ * @type trees of the locked @shards. */
+struct drbd_interval *drbd_shard_overlap(struct drbd_device *device, unsigned long shards,
+					 enum drbd_interval_type type, struct drbd_interval *i,
+					 sector_t sector, unsigned int size)
+{
+	unsigned int s = 0;
+
+	if (i) {
+		struct drbd_interval *next = drbd_next_overlap(i, sector, size);
+
+		if (next)
+			return next;
+		s = drbd_interval_shard(i) + 1;
+	}
+	for_each_set_bit_from(s, &shards, DRBD_INTERVAL_SHARDS + 1) {
+		i = drbd_find_overlap(shard_root(&device->interval_shards[s], type), sector, size);
+		if (i)
+			return i;
+	}
+	return NULL;
+}
+
+/* drbd_contains_interval() over the @type trees of the locked @shards */
+bool drbd_contains_shard_interval(struct drbd_device *device, unsigned long shards,
+				  enum drbd_interval_type type, sector_t sector,
+				  struct drbd_interval *interval)
+{
+	unsigned int s;
+
+	for_each_set_bit(s, &shards, DRBD_INTERVAL_SHARDS + 1)
+		if (drbd_contains_interval(shard_root(&device->interval_shards[s], type),
+					   sector, interval))
+			return true;
+	return false;
+}
+
+static void drbd_remove_request_interval(struct drbd_request *req)
 {
 	struct drbd_device *device = req->device;
 	struct drbd_interval *i = &req->i;
+	unsigned long shards;
 
-	spin_lock(&device->interval_lock); /* local irq already disabled */
-	drbd_remove_interval(root, i);
-	spin_unlock(&device->interval_lock);
+	shards = drbd_lock_intervals(device, i->sector, i->size); /* local irq already disabled */
+	drbd_remove_shard_interval(device, i);
+	drbd_unlock_intervals(device, shards);
 
 	/* Wake up any processes waiting for this request to complete.  */
 	if (test_bit(INTERVAL_WAITING, &i->flags))
@@ -222,7 +409,7 @@ void drbd_req_destroy(struct kref *kref)
 		ktime_aggregate(device, req, pre_submit_kt);
 		for_each_peer_device(peer_device, device) {
 			int node_id = peer_device->node_id;
-			unsigned ns = req->net_rq_state[node_id];
+			unsigned ns = req_net_state(req, node_id);
 			if (!(ns & RQ_NET_MASK))
 				continue;
 			ktime_aggregate_pd(peer_device, node_id, req, pre_send_kt);
@@ -235,7 +422,7 @@ void drbd_req_destroy(struct kref *kref)
 
 	/* paranoia */
 	for_each_peer_device(peer_device, device) {
-		unsigned ns = req->net_rq_state[peer_device->node_id];
+		unsigned ns = req_net_state(req, peer_device->node_id);
 		if (!(ns & RQ_NET_MASK))
 			continue;
 		if (ns & RQ_NET_DONE)
@@ -255,6 +442,9 @@ void drbd_req_destroy(struct kref *kref)
 		return;
 	}
 
+	/* in case it was never completed, e.g. postponed before it was sent */
+	drbd_free_req_snapshot(req);
+
 	spin_lock(&resource->tl_update_lock); /* local irq already disabled */
 	destroy_next = req->destroy_next;
 	list_del_rcu(&req->tl_requests);
@@ -264,15 +454,9 @@ void drbd_req_destroy(struct kref *kref)
 
 	/* finally remove the request from the conflict detection
 	 * respective block_id verification interval tree. */
-	if (!drbd_interval_empty(&req->i)) {
-		struct rb_root *root;
-
-		if (s & RQ_WRITE)
-			root = &device->write_requests;
-		else
-			root = &device->read_requests;
-		drbd_remove_request_interval(root, req);
-	} else if (s & (RQ_NET_MASK & ~RQ_NET_DONE) && req->i.size != 0)
+	if (!drbd_interval_empty(&req->i))
+		drbd_remove_request_interval(req);
+	else if (s & (RQ_NET_MASK & ~RQ_NET_DONE) && req->i.size != 0)
 		drbd_err(device, "drbd_req_destroy: Logic BUG: interval empty, but: rq_state=0x%x, sect=%llu, size=%u\n",
 			s, (unsigned long long)req->i.sector, req->i.size);
 
@@ -292,7 +476,7 @@ void drbd_req_destroy(struct kref *kref)
 			for (node_id = 0; node_id <= max_node_id; node_id++) {
 				unsigned int net_rq_state;
 
-				net_rq_state = req->net_rq_state[node_id];
+				net_rq_state = req_net_state(req, node_id);
 				if (net_rq_state & RQ_NET_OK) {
 					int bitmap_index = peer_md[node_id].bitmap_index;
 
@@ -345,7 +529,7 @@ void drbd_req_destroy(struct kref *kref)
 				drbd_queue_peer_ack(resource, peer_ack_req);
 				peer_ack_req = NULL;
 			} else
-				call_rcu(&peer_ack_req->rcu, drbd_reclaim_req);
+				drbd_release_req(resource, peer_ack_req);
 		}
 		resource->peer_ack_req = req;
 
@@ -356,7 +540,7 @@ void drbd_req_destroy(struct kref *kref)
 		mod_timer(&resource->peer_ack_timer,
 			  jiffies + resource->res_opts.peer_ack_delay * HZ / 1000);
 	} else
-		call_rcu(&req->rcu, drbd_reclaim_req);
+		drbd_release_req(resource, req);
 
 	/* In both branches of the if above, the reference to device gets released */
 	kref_debug_put(&device->kref_debug, 6);
@@ -428,7 +612,7 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 	const unsigned s = req->local_rq_state;
 	struct drbd_device *device = req->device;
 	struct drbd_peer_device *peer_device;
-	unsigned long flags;
+	unsigned long flags, shards;
 	int error, ok = 0;
 
 	/*
@@ -449,7 +633,7 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 	error = PTR_ERR(req->private_bio);
 
 	for_each_peer_device(peer_device, device) {
-		unsigned ns = req->net_rq_state[peer_device->node_id];
+		unsigned ns = req_net_state(req, peer_device->node_id);
 		/* any net ok ok local ok is good enough to complete this bio as OK */
 		if (ns & RQ_NET_OK)
 			++ok;
@@ -542,7 +726,8 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 		m->bio = req->master_bio;
 		req->master_bio = NULL;
 
-		spin_lock_irqsave(&device->interval_lock, flags);
+		local_irq_save(flags);
+		shards = drbd_lock_intervals(device, req->i.sector, req->i.size);
 		/* We leave it in the tree, to be able to verify later
 		 * write-acks in protocol != C during resync.
 		 * But we mark it as "complete", so it won't be counted as
@@ -550,7 +735,8 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 		set_bit(INTERVAL_COMPLETED, &req->i.flags);
 		if (test_bit(INTERVAL_WAITING, &req->i.flags))
 			wake_up(&device->misc_wait);
-		spin_unlock_irqrestore(&device->interval_lock, flags);
+		drbd_unlock_intervals(device, shards);
+		local_irq_restore(flags);
 	}
 
 	/* Either we are about to complete to upper layers,
@@ -560,6 +746,10 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 	spin_lock_irqsave(&device->pending_completion_lock, flags);
 	list_del_init(&req->req_pending_master_completion);
 	spin_unlock_irqrestore(&device->pending_completion_lock, flags);
+
+	/* Nothing is queued for sending anymore, a RESEND would only
+	 * happen before completion. */
+	drbd_free_req_snapshot(req);
 }
 
 static void drbd_req_put_completion_ref(struct drbd_request *req, struct bio_and_error *m, int put)
@@ -599,7 +789,7 @@ static void advance_conn_req_next(struct drbd_connection *connection, struct drb
 		return;
 	rcu_read_lock();
 	list_for_each_entry_continue_rcu(req, &connection->resource->transfer_log, tl_requests) {
-		const unsigned s = req->net_rq_state[connection->peer_node_id];
+		const unsigned s = req_net_state(req, connection->peer_node_id);
 		/* Found a request which is for this peer but not yet queued.
 		 * Do not skip past it. */
 		if (unlikely(s & RQ_NET_PENDING && !(s & (RQ_NET_QUEUED|RQ_NET_SENT))))
@@ -673,7 +863,7 @@ static void advance_cache_ptr(struct drbd_connection *connection,
 		return;
 	}
 	list_for_each_entry_continue_rcu(req, &connection->resource->transfer_log, tl_requests) {
-		const unsigned s = READ_ONCE(req->net_rq_state[connection->peer_node_id]);
+		const unsigned s = req_net_state(req, connection->peer_node_id);
 		if (!(s & RQ_NET_MASK))
 			continue;
 		if (((s & is_set) == is_set) && !(s & is_clear)) {
@@ -701,6 +891,46 @@ static unsigned int req_payload_sectors(struct drbd_request *req)
 	return req->i.size >> 9;
 }
 
+/* Average of read service times, each new sample weighs 1/8, like TCP's srtt.
+ * Concurrent updaters may lose a sample, which does not matter here. */
+static void read_latency_sample(atomic64_t *latency_ns, s64 sample)
+{
+	s64 avg = atomic64_read(latency_ns);
+
+	atomic64_set(latency_ns, avg ? avg - (avg >> 3) + (sample >> 3) : sample);
+}
+
+static void update_read_latency(atomic64_t *latency_ns, struct drbd_request *req)
+{
+	read_latency_sample(latency_ns, ktime_to_ns(ktime_sub(ktime_get(), req->read_issue_kt)));
+}
+
+/* Average of write ack latencies, weighted like update_read_latency().
+ * Jiffies are coarse, but the average over many samples is not. */
+static void drain_rtt_sample(struct drbd_connection *connection, unsigned long pre_send_jif)
+{
+	unsigned int sample = jiffies_to_usecs(jiffies - pre_send_jif);
+	unsigned int avg = READ_ONCE(connection->drain.rtt_us);
+
+	WRITE_ONCE(connection->drain.rtt_us, avg ? avg - (avg >> 3) + (sample >> 3) : sample);
+}
+
+/* In L_AHEAD, the resync starts once everything in flight towards the peer
+ * is acked, after a fixed second to let things settle. With
+ * congestion_target_ms set, that wait is one measured ack round trip
+ * instead, within the target and never more than the second. */
+static long ahead_resync_delay(struct drbd_connection *connection)
+{
+	unsigned int target_ms = READ_ONCE(drbd_congestion_target_ms);
+	unsigned int rtt_us = READ_ONCE(connection->drain.rtt_us);
+
+	if (!target_ms || !rtt_us)
+		return HZ;
+
+	return clamp_t(long, usecs_to_jiffies(rtt_us), 1,
+		       min_t(long, msecs_to_jiffies(target_ms), HZ));
+}
+
 /* I'd like this to be the only place that manipulates
  * req->completion_ref and req->kref. */
 static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
@@ -751,8 +981,11 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 
 	kref_get(&req->kref);
 
-	if (!(old_local & RQ_LOCAL_PENDING) && (set_local & RQ_LOCAL_PENDING))
+	if (!(old_local & RQ_LOCAL_PENDING) && (set_local & RQ_LOCAL_PENDING)) {
 		atomic_inc(&req->completion_ref);
+		if (!(old_local & RQ_WRITE))
+			atomic_inc(&req->device->local_reads_pending);
+	}
 
 	if (!(old_net & RQ_NET_PENDING) && (set & RQ_NET_PENDING)) {
 		inc_ap_pending(peer_device);
@@ -770,11 +1003,14 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	if (!(old_net & RQ_EXP_BARR_ACK) && (set & RQ_EXP_BARR_ACK))
 		kref_get(&req->kref); /* wait for the DONE */
 
+	if (!(old_net & RQ_EXP_READ_REPLY) && (set & RQ_EXP_READ_REPLY))
+		kref_get(&req->kref); /* wait for the DONE */
+
 	if (!(old_net & RQ_NET_SENT) && (set & RQ_NET_SENT)) {
 		/* potentially already completed in the ack_receiver thread */
 		if (!(old_net & RQ_NET_DONE))
 			atomic_add(req_payload_sectors(req), &peer_device->connection->ap_in_flight);
-		if (req->net_rq_state[idx] & RQ_NET_PENDING)
+		if (req_net_state(req, idx) & RQ_NET_PENDING)
 			set_cache_ptr_if_null(&connection->req_ack_pending, req);
 	}
 
@@ -796,6 +1032,8 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	if ((old_local & RQ_LOCAL_PENDING) && (clear_local & RQ_LOCAL_PENDING)) {
 		struct drbd_device *device = req->device;
 
+		if (!(old_local & RQ_WRITE))
+			atomic_dec(&device->local_reads_pending);
 		if (req->local_rq_state & RQ_LOCAL_ABORTED)
 			kref_put(&req->kref, drbd_req_destroy);
 		else
@@ -808,6 +1046,8 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	if ((old_net & RQ_NET_PENDING) && (clear & RQ_NET_PENDING)) {
 		dec_ap_pending(peer_device);
 		++c_put;
+		if ((old_local & RQ_WRITE) && (old_net & RQ_NET_SENT) && (set & RQ_NET_OK))
+			drain_rtt_sample(connection, req->pre_send_jif[idx]);
 		ktime_get_accounting(req->acked_kt[peer_device->node_id]);
 		advance_cache_ptr(connection, &connection->req_ack_pending,
 				  req, RQ_NET_SENT | RQ_NET_PENDING, 0);
@@ -821,14 +1061,19 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 	if (!(old_net & RQ_NET_DONE) && (set & RQ_NET_DONE)) {
 		atomic_t *ap_in_flight = &peer_device->connection->ap_in_flight;
 
-		if (old_net & RQ_NET_SENT)
+		if (old_net & RQ_NET_SENT) {
 			atomic_sub(req_payload_sectors(req), ap_in_flight);
+			atomic64_add(req_payload_sectors(req), &connection->ap_done_sectors);
+		}
 		if (old_net & RQ_EXP_BARR_ACK)
 			kref_put(&req->kref, drbd_req_destroy);
+		if (old_net & RQ_EXP_READ_REPLY)
+			kref_put(&req->kref, drbd_req_destroy);
 		ktime_get_accounting(req->net_done_kt[peer_device->node_id]);
 
 		if (peer_device->repl_state[NOW] == L_AHEAD &&
 		    atomic_read(ap_in_flight) == 0) {
+			long delay = ahead_resync_delay(connection);
 			struct drbd_peer_device *pd;
 			int vnr;
 			/* The first peer device to notice that it is time to
@@ -840,8 +1085,10 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 					continue;
 				if (test_and_set_bit(AHEAD_TO_SYNC_SOURCE, &pd->flags))
 					continue; /* already done */
+				if (delay < HZ)
+					connection->drain.early_resync_cnt++;
 				pd->start_resync_side = L_SYNC_SOURCE;
-				pd->start_resync_timer.expires = jiffies + HZ;
+				pd->start_resync_timer.expires = jiffies + delay;
 				add_timer(&pd->start_resync_timer);
 			}
 		}
@@ -902,11 +1149,36 @@ static int drbd_protocol_state_bits(struct drbd_connection *connection)
 static inline bool is_pending_write_protocol_A(struct drbd_request *req, int idx)
 {
 	return (req->local_rq_state & RQ_WRITE) == 0 ? 0 :
-		(req->net_rq_state[idx] &
+		(req_net_state(req, idx) &
 		   (RQ_NET_PENDING|RQ_EXP_WRITE_ACK|RQ_EXP_RECEIVE_ACK))
 		==  RQ_NET_PENDING;
 }
 
+/* A reply to a hedged read is in. The other peers are still pending, and
+ * their replies will be discarded, see drbd_req_claim_read_reply(). They
+ * keep a reference on the request until then, or until the sender cancels
+ * what it did not send yet.
+ * The time since a loser sent its read is a lower bound of its latency;
+ * account it, from the peer's own send time, as the hedge target was sent
+ * later than the first issue. A loser that did not send yet gets no sample.
+ * The winner's time since the first issue says nothing about the winner. */
+static void abandon_hedged_read(struct drbd_request *req, struct bio_and_error *m,
+		struct drbd_peer_device *winner)
+{
+	struct drbd_peer_device *peer_device;
+
+	for_each_peer_device(peer_device, req->device) {
+		if (peer_device == winner)
+			continue;
+		if (!(req_net_state(req, peer_device->node_id) & RQ_NET_PENDING))
+			continue;
+		if (req_net_state(req, peer_device->node_id) & RQ_NET_SENT)
+			read_latency_sample(&peer_device->read_latency_ns,
+				jiffies_to_nsecs(jiffies - req->pre_send_jif[peer_device->node_id]));
+		mod_rq_state(req, m, peer_device, RQ_NET_PENDING, RQ_EXP_READ_REPLY);
+	}
+}
+
 /* obviously this could be coded as many single functions
  * instead of one huge switch,
  * or by putting the code directly in the respective locations
@@ -938,6 +1210,9 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		m->bio = NULL;
 
 	idx = peer_device ? peer_device->node_id : -1;
+	/* a peer that was added after the request, it has no part in it */
+	if (peer_device && !req_has_node_slot(req, idx))
+		return;
 
 	switch (what) {
 	default:
@@ -947,14 +1222,18 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 	case TO_BE_SUBMITTED: /* locally */
 		/* reached via __drbd_make_request */
 		D_ASSERT(device, !(req->local_rq_state & RQ_LOCAL_MASK));
+		if (!(req->local_rq_state & RQ_WRITE))
+			req->read_issue_kt = ktime_get();
 		mod_rq_state(req, m, peer_device, 0, RQ_LOCAL_PENDING);
 		break;
 
 	case COMPLETED_OK:
-		if (req->local_rq_state & RQ_WRITE)
+		if (req->local_rq_state & RQ_WRITE) {
 			device->writ_cnt += req->i.size >> 9;
-		else
+		} else {
 			device->read_cnt += req->i.size >> 9;
+			update_read_latency(&device->read_latency_ns, req);
+		}
 
 		mod_rq_state(req, m, peer_device, RQ_LOCAL_PENDING,
 				RQ_LOCAL_COMPLETED|RQ_LOCAL_OK);
@@ -992,15 +1271,26 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		/* from __drbd_make_request
 		 * or from bio_endio during read io-error recovery */
 
+		/* or from read_hedge_timer_fn(), as duplicate of an overdue
+		 * remote read. That one is in the interval tree already, and
+		 * the caller holds its interval shard locks. */
+
 		/* So we can verify the handle in the answer packet.
 		 * Corresponding drbd_remove_request_interval is in
 		 * drbd_req_complete() */
-		D_ASSERT(device, drbd_interval_empty(&req->i));
-		spin_lock_irqsave(&device->interval_lock, flags);
-		drbd_insert_interval(&device->read_requests, &req->i);
-		spin_unlock_irqrestore(&device->interval_lock, flags);
+		if (!(req->local_rq_state & RQ_HEDGED)) {
+			unsigned long shards;
+
+			D_ASSERT(device, drbd_interval_empty(&req->i));
+			local_irq_save(flags);
+			shards = drbd_lock_intervals(device, req->i.sector, req->i.size);
+			drbd_insert_shard_interval(device, &req->i);
+			drbd_unlock_intervals(device, shards);
+			local_irq_restore(flags);
+			req->read_issue_kt = ktime_get();
+		}
 
-		D_ASSERT(device, !(req->net_rq_state[idx] & RQ_NET_MASK));
+		D_ASSERT(device, !(req_net_state(req, idx) & RQ_NET_MASK));
 		D_ASSERT(device, !(req->local_rq_state & RQ_LOCAL_MASK));
 		mod_rq_state(req, m, peer_device, 0, RQ_NET_PENDING);
 		break;
@@ -1023,7 +1313,7 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		 *
 		 * Add req to the (now) current epoch (barrier). */
 
-		D_ASSERT(device, !(req->net_rq_state[idx] & RQ_NET_MASK));
+		D_ASSERT(device, !(req_net_state(req, idx) & RQ_NET_MASK));
 
 		/* queue work item to send data */
 		mod_rq_state(req, m, peer_device, 0, RQ_NET_PENDING|RQ_EXP_BARR_ACK|
@@ -1090,7 +1380,7 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 	case CONNECTION_LOST:
 	case CONNECTION_LOST_WHILE_SUSPENDED:
 		/* Only apply to requests that were for this peer but not done. */
-		if (!(req->net_rq_state[idx] & RQ_NET_MASK) || req->net_rq_state[idx] & RQ_NET_DONE)
+		if (!(req_net_state(req, idx) & RQ_NET_MASK) || req_net_state(req, idx) & RQ_NET_DONE)
 			break;
 
 		/* For protocol A, or when not suspended, we consider the
@@ -1107,9 +1397,9 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		 * have already received the corresponding ack. The request may
 		 * complete as far as this peer is concerned. */
 		if (what == CONNECTION_LOST ||
-				!(req->net_rq_state[idx] & (RQ_EXP_RECEIVE_ACK|RQ_EXP_WRITE_ACK)))
+				!(req_net_state(req, idx) & (RQ_EXP_RECEIVE_ACK|RQ_EXP_WRITE_ACK)))
 			mod_rq_state(req, m, peer_device, RQ_NET_PENDING|RQ_NET_OK, RQ_NET_DONE);
-		else if (req->net_rq_state[idx] & RQ_NET_PENDING)
+		else if (req_net_state(req, idx) & RQ_NET_PENDING)
 			mod_rq_state(req, m, peer_device, 0, RQ_COMPLETION_SUSP);
 		break;
 
@@ -1128,7 +1418,7 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		 * for volatile write-back caches on lower level devices. */
 		goto ack_common;
 	case RECV_ACKED_BY_PEER:
-		D_ASSERT(device, req->net_rq_state[idx] & RQ_EXP_RECEIVE_ACK);
+		D_ASSERT(device, req_net_state(req, idx) & RQ_EXP_RECEIVE_ACK);
 		/* protocol B; pretends to be successfully written on peer.
 		 * see also notes above in HANDED_OVER_TO_NETWORK about
 		 * protocol != C */
@@ -1147,7 +1437,7 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 
 	case CANCEL_SUSPENDED_IO:
 		/* Only apply to requests that were for this peer but not done. */
-		if (!(req->net_rq_state[idx] & RQ_NET_MASK) || req->net_rq_state[idx] & RQ_NET_DONE)
+		if (!(req_net_state(req, idx) & RQ_NET_MASK) || req_net_state(req, idx) & RQ_NET_DONE)
 			break;
 
 		/* CONNECTION_LOST_WHILE_SUSPENDED followed by
@@ -1173,16 +1463,16 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		   any dependency between incomplete requests, and we are
 		   allowed to complete this one "out-of-sequence".
 		 */
-		if (req->net_rq_state[idx] & RQ_NET_OK)
+		if (req_net_state(req, idx) & RQ_NET_OK)
 			goto barrier_acked;
 
 		/* Only apply to requests that are pending a response from
 		 * this peer. */
-		if (!(req->net_rq_state[idx] & RQ_NET_PENDING))
+		if (!(req_net_state(req, idx) & RQ_NET_PENDING))
 			break;
 
-		D_ASSERT(device, !(req->net_rq_state[idx] & RQ_NET_QUEUED));
-		mod_rq_state(req, m, peer_device, RQ_NET_SENT, RQ_NET_QUEUED);
+		D_ASSERT(device, !(req_net_state(req, idx) & RQ_NET_QUEUED));
+		mod_rq_state(req, m, peer_device, RQ_NET_SENT|RQ_NET_COALESCED, RQ_NET_QUEUED);
 		break;
 
 	case BARRIER_ACKED:
@@ -1191,7 +1481,7 @@ barrier_acked:
 		if (!(req->local_rq_state & RQ_WRITE))
 			break;
 
-		if (req->net_rq_state[idx] & RQ_NET_PENDING) {
+		if (req_net_state(req, idx) & RQ_NET_PENDING) {
 			/* barrier came in before all requests were acked.
 			 * this is bad, because if the connection is lost now,
 			 * we won't be able to clean them up... */
@@ -1201,26 +1491,62 @@ barrier_acked:
 		/* As this is called for all requests within a matching epoch,
 		 * we need to filter, and only set RQ_NET_DONE for those that
 		 * have actually been on the wire. */
-		if (req->net_rq_state[idx] & RQ_NET_MASK)
+		if (req_net_state(req, idx) & RQ_NET_MASK)
 			mod_rq_state(req, m, peer_device, 0, RQ_NET_DONE);
 		break;
 
 	case DATA_RECEIVED:
-		D_ASSERT(device, req->net_rq_state[idx] & RQ_NET_PENDING);
+		D_ASSERT(device, req_net_state(req, idx) & RQ_NET_PENDING);
+		if (req->local_rq_state & RQ_HEDGED)
+			abandon_hedged_read(req, m, peer_device);
+		else
+			update_read_latency(&peer_device->read_latency_ns, req);
 		mod_rq_state(req, m, peer_device, RQ_NET_PENDING, RQ_NET_OK|RQ_NET_DONE);
 		break;
 
+	case HEDGE_CANCELED:
+		/* from the sender, which noticed that this read was abandoned
+		 * before it was sent, see abandon_hedged_read() */
+		mod_rq_state(req, m, peer_device, RQ_NET_QUEUED, RQ_NET_DONE);
+		break;
+
 	case BARRIER_SENT:
 		mod_rq_state(req, m, peer_device, 0, RQ_NET_OK|RQ_NET_DONE);
 		break;
 	};
 }
 
+/* The peer answers a coalesced P_DATA for its first request only. The
+ * requests sent along with it directly follow that one in the transfer log,
+ * apply the answer to them before it is applied to req, which is still
+ * pending and thus keeps its place in the transfer log until then. */
+void req_mod_coalesced(struct drbd_request *req, enum drbd_req_event what,
+		struct drbd_peer_device *peer_device)
+{
+	struct drbd_resource *resource = req->device->resource;
+	const int idx = peer_device->node_id;
+
+	rcu_read_lock();
+	list_for_each_entry_continue_rcu(req, &resource->transfer_log, tl_requests) {
+		const unsigned s = req_net_state(req, idx);
+
+		if (!(s & RQ_NET_COALESCED) || s & RQ_NET_DONE)
+			break;
+		/* Stop if the request has already been destroyed. */
+		if (!kref_get_unless_zero(&req->kref))
+			break;
+
+		req_mod(req, what, peer_device);
+		kref_put(&req->kref, drbd_req_destroy);
+	}
+	rcu_read_unlock();
+}
+
 /* we may do a local read if:
  * - we are consistent (of course),
  * - or we are generally inconsistent,
  *   BUT we are still/already IN SYNC with all peers for this area.
- *   since size may be bigger than BM_BLOCK_SIZE,
+ *   since size may be bigger than bm_block_size(),
  *   we may need to check several bits.
  */
 static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector, int size)
@@ -1241,8 +1567,8 @@ static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector,
 	D_ASSERT(device, sector  < nr_sectors);
 	D_ASSERT(device, esector < nr_sectors);
 
-	sbnr = BM_SECT_TO_BIT(sector);
-	ebnr = BM_SECT_TO_BIT(esector);
+	sbnr = bm_sect_to_bit(device->bitmap, sector);
+	ebnr = bm_sect_to_bit(device->bitmap, esector);
 
 	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
 		struct drbd_peer_md *peer_md = &md->peers[node_id];
@@ -1302,13 +1628,13 @@ static bool remote_due_to_read_balancing(struct drbd_device *device,
 /*
  * complete_conflicting_writes  -  wait for any conflicting write requests
  *
- * The write_requests tree contains all active write requests which we
+ * The write_requests trees contain all active write requests which we
  * currently know about.  Wait for any requests to complete which conflict with
  * the new one.
  *
  * Only way out: remove the conflicting intervals from the tree.
  */
-static void complete_conflicting_writes(struct drbd_request *req)
+static void complete_conflicting_writes(struct drbd_request *req, unsigned long *shards)
 {
 	DEFINE_WAIT(wait);
 	struct drbd_device *device = req->device;
@@ -1318,7 +1644,7 @@ static void complete_conflicting_writes(struct drbd_request *req)
 	int size = req->i.size;
 
 	for (;;) {
-		drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+		drbd_for_each_shard_overlap(i, device, *shards, INTERVAL_LOCAL_WRITE, sector, size) {
 			/* Ignore, if already completed to upper layers. */
 			if (test_bit(INTERVAL_COMPLETED, &i->flags))
 				continue;
@@ -1332,11 +1658,11 @@ static void complete_conflicting_writes(struct drbd_request *req)
 		/* Indicate to wake up device->misc_wait on progress.  */
 		prepare_to_wait(&device->misc_wait, &wait, TASK_UNINTERRUPTIBLE);
 		set_bit(INTERVAL_WAITING, &i->flags);
-		spin_unlock(&device->interval_lock);
+		drbd_unlock_intervals(device, *shards);
 		read_unlock_irq(&resource->state_rwlock);
 		schedule();
 		read_lock_irq(&resource->state_rwlock);
-		spin_lock(&device->interval_lock);
+		*shards = drbd_lock_intervals(device, sector, size);
 	}
 	finish_wait(&device->misc_wait, &wait);
 }
@@ -1381,6 +1707,23 @@ static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connectio
 	/* if an other volume already found that we are congested, short circuit. */
 	congested = test_bit(CONN_CONGESTED, &connection->flags);
 
+	if (!congested && on_congestion == OC_PULL_AHEAD) {
+		struct drbd_drain_ctl *dc = &connection->drain;
+		unsigned int target_ms = READ_ONCE(drbd_congestion_target_ms);
+		unsigned int fill_ms = READ_ONCE(dc->fill_ms);
+
+		/* acks for what is already on the way take another round trip */
+		if (target_ms && fill_ms &&
+		    fill_ms <= target_ms + READ_ONCE(dc->rtt_us) / USEC_PER_MSEC) {
+			drbd_info(device, "Send buffer predicted to fill in %u ms (target %u ms)\n",
+				  fill_ms, target_ms);
+			dc->pull_ahead_cnt++;
+			/* predict anew once writes are sent again */
+			WRITE_ONCE(dc->fill_ms, 0);
+			congested = true;
+		}
+	}
+
 	if (!congested && cong_fill) {
 		int n = atomic_read(&connection->ap_in_flight) +
 			atomic_read(&connection->rs_in_flight);
@@ -1391,9 +1734,13 @@ static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connectio
 	}
 
 	if (!congested && device->act_log->used >= cong_extents) {
-		drbd_info(device, "Congestion-extents threshold reached (%d >= %d)\n",
-			device->act_log->used, cong_extents);
-		congested = true;
+		unsigned int used = drbd_al_used_extents(device);
+
+		if (used >= cong_extents) {
+			drbd_info(device, "Congestion-extents threshold reached (%u >= %u)\n",
+				used, cong_extents);
+			congested = true;
+		}
 	}
 
 	if (congested) {
@@ -1473,6 +1820,56 @@ static u64 calc_nodes_to_read_from(struct drbd_device *device)
 	return 0;
 }
 
+/* Expected service time of one more read on a node: the average latency,
+ * scaled by what is already in flight there, and by the configured weight. */
+static u64 read_service_time(struct drbd_resource *resource, s64 latency_ns,
+			     int in_flight, int node_id)
+{
+	unsigned int weight = READ_ONCE(resource->read_weights[node_id]) ?: 100;
+
+	return div_u64((u64)latency_ns * (in_flight + 1) * 100, weight);
+}
+
+/* Returns the peer device with the least expected service time, or NULL if
+ * the local disk is expected to be fastest (or nobody has good data).
+ * The local disk only competes with @consider_local.
+ * Nodes we do not have a latency sample for yet are tried first. */
+static struct drbd_peer_device *find_peer_device_least_latency(struct drbd_request *req,
+							       bool consider_local)
+{
+	struct drbd_device *device = req->device;
+	struct drbd_resource *resource = device->resource;
+	struct drbd_peer_device *peer_device, *best = NULL;
+	u64 nodes = calc_nodes_to_read_from(device);
+	u64 best_time = U64_MAX;
+
+	if (req->private_bio && consider_local)
+		best_time = read_service_time(resource,
+				atomic64_read(&device->read_latency_ns),
+				atomic_read(&device->local_reads_pending),
+				resource->res_opts.node_id);
+
+	for_each_peer_device(peer_device, device) {
+		u64 t;
+
+		if (!(nodes & NODE_MASK(peer_device->node_id)) ||
+		    !req_has_node_slot(req, peer_device->node_id))
+			continue;
+		if (peer_device->disk_state[NOW] != D_UP_TO_DATE)
+			continue;
+		t = read_service_time(resource,
+				atomic64_read(&peer_device->read_latency_ns),
+				atomic_read(&peer_device->ap_pending_cnt) +
+				atomic_read(&peer_device->rs_pending_cnt),
+				peer_device->node_id);
+		if (t < best_time) {
+			best_time = t;
+			best = peer_device;
+		}
+	}
+	return best;
+}
+
 /* If this returns NULL, and req->private_bio is still set,
  * the request should be submitted locally.
  *
@@ -1506,7 +1903,14 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		}
 	}
 
-	/* TODO: improve read balancing decisions, allow user to configure node weights */
+	/* The policies that balance by load, or that leave the choice among
+	 * the peers open. Striping and round robin keep their fixed pattern. */
+	if (drbd_read_balance_latency &&
+	    (rbm == RB_LEAST_PENDING || rbm == RB_CONGESTED_REMOTE || rbm == RB_PREFER_REMOTE)) {
+		peer_device = find_peer_device_least_latency(req, rbm != RB_PREFER_REMOTE);
+		goto out;
+	}
+
 	while (true) {
 		if (!device->read_nodes)
 			device->read_nodes = calc_nodes_to_read_from(device);
@@ -1514,7 +1918,7 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 			int peer_node_id = __ffs64(device->read_nodes);
 			device->read_nodes &= ~NODE_MASK(peer_node_id);
 			peer_device = peer_device_by_node_id(device, peer_node_id);
-			if (!peer_device)
+			if (!peer_device || !req_has_node_slot(req, peer_node_id))
 				continue;
 			if (peer_device->disk_state[NOW] != D_UP_TO_DATE)
 				continue;
@@ -1527,6 +1931,7 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		break;
 	}
 
+out:
 	if (peer_device && req->private_bio) {
 		bio_put(req->private_bio);
 		req->private_bio = NULL;
@@ -1546,7 +1951,8 @@ static int drbd_process_empty_flush(struct drbd_request *req)
 		 * is written somewhere in a usable form. Hence only
 		 * D_UP_TO_DATE peers are included and not all peers that
 		 * receive the data. */
-		if (peer_device->disk_state[NOW] == D_UP_TO_DATE) {
+		if (peer_device->disk_state[NOW] == D_UP_TO_DATE &&
+		    req_has_node_slot(req, peer_device->node_id)) {
 			++count;
 
 			/* An empty flush indicates that all previously
@@ -1585,6 +1991,9 @@ static int drbd_process_write_request(struct drbd_request *req)
 	int count = 0;
 
 	for_each_peer_device(peer_device, device) {
+		/* added after the request; drbd_req_destroy() marks it out of sync */
+		if (!req_has_node_slot(req, peer_device->node_id))
+			continue;
 		remote = drbd_should_do_remote(peer_device, NOW);
 		send_oos = drbd_should_send_out_of_sync(peer_device);
 
@@ -1609,7 +2018,7 @@ static void drbd_queue_request(struct drbd_request *req)
 	struct drbd_peer_device *peer_device;
 
 	for_each_peer_device(peer_device, device) {
-		if (req->net_rq_state[peer_device->node_id] & RQ_NET_PENDING)
+		if (req_net_state(req, peer_device->node_id) & RQ_NET_PENDING)
 			_req_mod(req, ADDED_TO_TRANSFER_LOG, peer_device);
 	}
 }
@@ -1665,15 +2074,22 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 
 static void drbd_queue_write(struct drbd_device *device, struct drbd_request *req)
 {
+	struct submit_shard *shard;
+
 	if (req->private_bio)
 		atomic_inc(&device->ap_actlog_cnt);
 	spin_lock_irq(&device->pending_completion_lock);
 	list_add_tail(&req->req_pending_master_completion,
 			&device->pending_master_completion[1 /* WRITE */]);
 	spin_unlock_irq(&device->pending_completion_lock);
-	spin_lock(&device->submit.lock);
-	list_add_tail(&req->list, &device->submit.writes);
-	spin_unlock(&device->submit.lock);
+
+	/* We may be migrated right after reading the CPU number. That is
+	 * harmless, the shard lock is what protects the lists. */
+	req->submit_cpu = raw_smp_processor_id();
+	shard = per_cpu_ptr(device->submit.shards, req->submit_cpu);
+	spin_lock(&shard->lock);
+	list_add_tail(&req->list, &shard->writes);
+	spin_unlock(&shard->lock);
 	queue_work(device->submit.wq, &device->submit.worker);
 	/* do_submit() may sleep internally on al_wait, too */
 	wake_up(&device->al_wait);
@@ -1683,7 +2099,7 @@ static void drbd_req_in_actlog(struct drbd_request *req)
 {
 	req->local_rq_state |= RQ_IN_ACT_LOG;
 	ktime_get_accounting(req->in_actlog_kt);
-	atomic_sub(interval_to_al_extents(&req->i), &req->device->wait_for_actlog_ecnt);
+	atomic_sub(interval_to_al_extents(req->device, &req->i), &req->device->wait_for_actlog_ecnt);
 }
 
 /* returns the new drbd_request pointer, if the caller is expected to
@@ -1736,7 +2152,7 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio,
 	 * in receive_Data() { ... prepare_activity_log(); ... }
 	 */
 	if (req->private_bio)
-		atomic_add(interval_to_al_extents(&req->i), &device->wait_for_actlog_ecnt);
+		atomic_add(interval_to_al_extents(device, &req->i), &device->wait_for_actlog_ecnt);
 
 	/* process discards always from our submitter thread */
 	if ((bio_op(bio) == REQ_OP_WRITE_ZEROES) ||
@@ -1833,7 +2249,7 @@ static void drbd_update_plug(struct drbd_plug_cb *plug, struct drbd_request *req
 		kref_put(&tmp->kref, drbd_req_destroy);
 }
 
-/* caller must hold interval_lock */
+/* caller must hold the interval shard locks of req */
 static void put_req_interval_into_tree(struct drbd_device *device, struct drbd_request *req)
 {
 	struct drbd_peer_device *peer_device;
@@ -1843,7 +2259,7 @@ static void put_req_interval_into_tree(struct drbd_device *device, struct drbd_r
 		remote = drbd_should_do_remote(peer_device, NOW);
 		if (!remote)
 			continue;
-		drbd_insert_interval(&device->write_requests, &req->i);
+		drbd_insert_shard_interval(device, &req->i);
 
 		/* Corresponding drbd_remove_request_interval is in
 		 * drbd_req_complete() */
@@ -1863,14 +2279,16 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 	read_lock_irq(&resource->state_rwlock);
 
 	if (rw == WRITE) {
-		spin_lock(&device->interval_lock);
-		/* This may temporarily give up the state_rwlock and interval_lock,
-		 * but will re-acquire them before it returns here.
+		unsigned long shards;
+
+		shards = drbd_lock_intervals(device, req->i.sector, req->i.size);
+		/* This may temporarily give up the state_rwlock and interval
+		 * shard locks, but will re-acquire them before it returns here.
 		 * Needs to be before the check on drbd_suspended() */
-		complete_conflicting_writes(req);
+		complete_conflicting_writes(req, &shards);
 		/* no more giving up state_rwlock from now on! */
 		put_req_interval_into_tree(device, req);
-		spin_unlock(&device->interval_lock);
+		drbd_unlock_intervals(device, shards);
 
 		/* check for congestion, and potentially stop sending
 		 * full data updates, but start sending "dirty bits" only. */
@@ -1965,8 +2383,12 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 
 	if (rw == WRITE)
 		wake_all_senders(resource);
-	else if (peer_device)
+	else if (peer_device) {
 		wake_up(&peer_device->connection->sender_work.q_wait);
+		if (drbd_read_hedge_delay_us && !timer_pending(&device->read_hedge_timer))
+			mod_timer(&device->read_hedge_timer,
+				  jiffies + usecs_to_jiffies(drbd_read_hedge_delay_us) + 1);
+	}
 
 	if (no_remote == false) {
 		struct drbd_plug_cb *plug = drbd_check_plugged(resource);
@@ -2129,7 +2551,7 @@ static void __drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 	int err;
 
 	peer_req->flags |= EE_IN_ACTLOG;
-	atomic_sub(interval_to_al_extents(&peer_req->i), &device->wait_for_actlog_ecnt);
+	atomic_sub(interval_to_al_extents(device, &peer_req->i), &device->wait_for_actlog_ecnt);
 	atomic_dec(&device->wait_for_actlog);
 	list_del_init(&peer_req->wait_for_actlog);
 
@@ -2139,6 +2561,56 @@ static void __drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 		drbd_cleanup_after_failed_submit_peer_write(peer_req);
 }
 
+/* Hand a request that is ready to go back to the shard it was queued on.
+ * The shard workers are only kicked by submit_shards_kick(), so that a whole
+ * batch becomes visible at once. */
+static void submit_shard_add_ready(struct drbd_device *device, struct drbd_request *req)
+{
+	struct submit_shard *shard = per_cpu_ptr(device->submit.shards, req->submit_cpu);
+
+	spin_lock(&shard->lock);
+	list_move_tail(&req->list, &shard->ready);
+	spin_unlock(&shard->lock);
+	cpumask_set_cpu(req->submit_cpu, device->submit.ready_cpus);
+}
+
+static void submit_shards_kick(struct drbd_device *device)
+{
+	int cpu;
+
+	for_each_cpu(cpu, device->submit.ready_cpus) {
+		struct submit_shard *shard = per_cpu_ptr(device->submit.shards, cpu);
+
+		/* A bound work item queued on an offline CPU would not run
+		 * until that CPU comes back. */
+		if (cpu_online(cpu))
+			queue_work_on(cpu, device->submit.shard_wq, &shard->worker);
+		else
+			queue_work(device->submit.shard_wq, &shard->worker);
+	}
+	cpumask_clear(device->submit.ready_cpus);
+}
+
+void do_submit_shard(struct work_struct *ws)
+{
+	struct submit_shard *shard = container_of(ws, struct submit_shard, worker);
+	struct drbd_device *device = shard->device;
+	struct drbd_request *req, *tmp;
+	struct blk_plug plug;
+	LIST_HEAD(ready);
+
+	spin_lock(&shard->lock);
+	list_splice_init(&shard->ready, &ready);
+	spin_unlock(&shard->lock);
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(req, tmp, &ready, list) {
+		list_del_init(&req->list);
+		drbd_send_and_submit(device, req);
+	}
+	blk_finish_plug(&plug);
+}
+
 static void submit_fast_path(struct drbd_device *device, struct waiting_for_act_log *wfa)
 {
 	struct blk_plug plug;
@@ -2152,6 +2624,8 @@ static void submit_fast_path(struct drbd_device *device, struct waiting_for_act_
 
 		__drbd_submit_peer_request(pr);
 	}
+	blk_finish_plug(&plug);
+
 	list_for_each_entry_safe(req, tmp, &wfa->requests.incoming, list) {
 		const int rw = bio_data_dir(req->master_bio);
 
@@ -2164,10 +2638,9 @@ static void submit_fast_path(struct drbd_device *device, struct waiting_for_act_
 			atomic_dec(&device->ap_actlog_cnt);
 		}
 
-		list_del_init(&req->list);
-		drbd_send_and_submit(device, req);
+		submit_shard_add_ready(device, req);
 	}
-	blk_finish_plug(&plug);
+	submit_shards_kick(device);
 }
 
 static struct drbd_request *wfa_next_request(struct waiting_for_act_log *wfa)
@@ -2238,23 +2711,84 @@ static bool prepare_al_transaction_nonblock(struct drbd_device *device,
 	return made_progress;
 }
 
-static void send_and_submit_pending(struct drbd_device *device, struct waiting_for_act_log *wfa)
+static void submit_in_actlog(struct drbd_device *device,
+			     struct list_head *peer_requests, struct list_head *requests)
 {
 	struct blk_plug plug;
 	struct drbd_request *req, *tmp;
 	struct drbd_peer_request *pr, *pr_tmp;
 
 	blk_start_plug(&plug);
-	list_for_each_entry_safe(pr, pr_tmp, &wfa->peer_requests.pending, wait_for_actlog) {
+	list_for_each_entry_safe(pr, pr_tmp, peer_requests, wait_for_actlog) {
 		__drbd_submit_peer_request(pr);
 	}
-	list_for_each_entry_safe(req, tmp, &wfa->requests.pending, list) {
+	blk_finish_plug(&plug);
+
+	list_for_each_entry_safe(req, tmp, requests, list) {
 		drbd_req_in_actlog(req);
 		atomic_dec(&device->ap_actlog_cnt);
-		list_del_init(&req->list);
-		drbd_send_and_submit(device, req);
+		submit_shard_add_ready(device, req);
 	}
-	blk_finish_plug(&plug);
+	submit_shards_kick(device);
+}
+
+static void send_and_submit_pending(struct drbd_device *device, struct waiting_for_act_log *wfa)
+{
+	submit_in_actlog(device, &wfa->peer_requests.pending, &wfa->requests.pending);
+}
+
+/* Waits until at most @max_in_flight pipelined activity log transactions are
+ * still being written, and submits the requests of those on disk. */
+static void al_pipe_drain(struct drbd_device *device, unsigned int max_in_flight)
+{
+	LIST_HEAD(peer_requests);
+	LIST_HEAD(requests);
+
+	wait_event(device->al_wait, READ_ONCE(device->al_pipe.in_flight) <= max_in_flight);
+	drbd_al_pipe_reap(device, &peer_requests, &requests);
+	submit_in_actlog(device, &peer_requests, &requests);
+}
+
+/* It is ok to look outside the lock, we only decide whether to sleep */
+static bool al_pipe_reapable(struct drbd_device *device)
+{
+	return READ_ONCE(device->al_pipe.used) > READ_ONCE(device->al_pipe.in_flight);
+}
+
+static void commit_and_submit_pending(struct drbd_device *device, struct waiting_for_act_log *wfa)
+{
+	struct drbd_al_pipe_slot *slot;
+
+	if (!READ_ONCE(drbd_al_pipeline) || drbd_md_dax_active(device->ldev)) {
+		drbd_al_begin_io_commit(device);
+		send_and_submit_pending(device, wfa);
+		return;
+	}
+
+	/* make room for the next transaction */
+	al_pipe_drain(device, DRBD_AL_PIPE_DEPTH - 1);
+	slot = drbd_al_commit_pipelined(device);
+	if (!slot) {
+		send_and_submit_pending(device, wfa);
+		return;
+	}
+	/* Only we reap, so the slot cannot go away underneath us */
+	list_splice_tail_init(&wfa->peer_requests.pending, &slot->peer_requests);
+	list_splice_tail_init(&wfa->requests.pending, &slot->requests);
+}
+
+/* It is ok to look outside the locks, it's only an optimization anyways */
+static bool submit_writes_queued(struct drbd_device *device)
+{
+	int cpu;
+
+	if (!list_empty(&device->submit.peer_writes))
+		return true;
+	for_each_possible_cpu(cpu) {
+		if (!list_empty(&per_cpu_ptr(device->submit.shards, cpu)->writes))
+			return true;
+	}
+	return false;
 }
 
 /* more: for non-blocking fill-up # of updates in the transaction */
@@ -2264,10 +2798,20 @@ static bool grab_new_incoming_requests(struct drbd_device *device, struct waitin
 	struct list_head *reqs = more ? &wfa->requests.more_incoming : &wfa->requests.incoming;
 	struct list_head *peer_reqs = more ? &wfa->peer_requests.more_incoming : &wfa->peer_requests.incoming;
 	bool found_new = false;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct submit_shard *shard = per_cpu_ptr(device->submit.shards, cpu);
+
+		if (list_empty(&shard->writes))
+			continue;
+		spin_lock(&shard->lock);
+		found_new |= !list_empty(&shard->writes);
+		list_splice_tail_init(&shard->writes, reqs);
+		spin_unlock(&shard->lock);
+	}
 
 	spin_lock(&device->submit.lock);
-	found_new = !list_empty(&device->submit.writes);
-	list_splice_tail_init(&device->submit.writes, reqs);
 	found_new |= !list_empty(&device->submit.peer_writes);
 	list_splice_tail_init(&device->submit.peer_writes, peer_reqs);
 	spin_unlock(&device->submit.lock);
@@ -2295,6 +2839,10 @@ void do_submit(struct work_struct *ws)
 			break;
 
 		for (;;) {
+			/* Requests of transactions that made it to disk
+			 * hold references on extents we may be waiting for. */
+			al_pipe_drain(device, DRBD_AL_PIPE_DEPTH);
+
 			/*
 			 * We put ourselves on device->al_wait, then check if
 			 * we can need to actually sleep and wait for someone
@@ -2327,6 +2875,11 @@ void do_submit(struct work_struct *ws)
 			if (made_progress)
 				break;
 
+			if (al_pipe_reapable(device)) {
+				finish_wait(&device->al_wait, &wait);
+				continue;
+			}
+
 			schedule();
 
 			/* If all currently "hot" activity log extents are kept busy by
@@ -2367,10 +2920,7 @@ void do_submit(struct work_struct *ws)
 		 */
 
 		while (wfa_lists_empty(&wfa, incoming)) {
-			/* It is ok to look outside the lock,
-			 * it's only an optimization anyways */
-			if (list_empty(&device->submit.writes) &&
-			    list_empty(&device->submit.peer_writes))
+			if (!submit_writes_queued(device))
 				break;
 
 			if (!grab_new_incoming_requests(device, &wfa, true))
@@ -2385,10 +2935,11 @@ void do_submit(struct work_struct *ws)
 		if (!list_empty(&wfa.peer_requests.cleanup))
 			drbd_cleanup_peer_requests_wfa(device, &wfa.peer_requests.cleanup);
 
-		drbd_al_begin_io_commit(device);
-
-		send_and_submit_pending(device, &wfa);
+		commit_and_submit_pending(device, &wfa);
 	}
+
+	/* do not leave pipelined transactions behind */
+	al_pipe_drain(device, 0);
 }
 
 static bool drbd_fail_request_early(struct drbd_device *device, struct bio *bio)
@@ -2482,7 +3033,7 @@ static bool net_timeout_reached(struct drbd_request *net_req,
 	if (time_in_range(now, connection->last_reconnect_jif, connection->last_reconnect_jif + ent))
 		return false;
 
-	if (net_req->net_rq_state[peer_node_id] & RQ_NET_PENDING) {
+	if (req_net_state(net_req, peer_node_id) & RQ_NET_PENDING) {
 		drbd_warn(peer_device, "Remote failed to finish a request within %ums > ko-count (%u) * timeout (%u * 0.1s)\n",
 			jiffies_to_msecs(now - pre_send_jif), ko_count, timeout);
 		return true;
@@ -2640,7 +3191,7 @@ void request_timer_fn(struct timer_list *t)
 			/* If we did not send the request yet then pre_send_jif
 			 * is not set. Treat this the same as when there are no
 			 * requests pending. */
-			if (req && !(req->net_rq_state[connection->peer_node_id] & RQ_NET_SENT))
+			if (req && !(req_net_state(req, connection->peer_node_id) & RQ_NET_SENT))
 				req = NULL;
 		}
 
@@ -2691,6 +3242,220 @@ void request_timer_fn(struct timer_list *t)
 	}
 }
 
+/* Hedged reads.
+ *
+ * A remote read that its peer did not answer within read_hedge_delay_us, or
+ * within four times the average read latency of that peer if that is longer,
+ * is sent to a second up-to-date peer as well. The first reply is received
+ * into the master bio, the other one is drained, see
+ * drbd_req_claim_read_reply().
+ *
+ * Reads from the local disk are never hedged: we could not cancel them, and
+ * they would keep writing into the pages of a master bio we completed.
+ */
+
+/* overdue reads to hedge per timer run */
+#define HEDGE_BATCH 16
+
+/* The peer this read was sent to, if it is pending there and nowhere else. A
+ * read still queued to its sender is not late because of the peer. */
+static struct drbd_peer_device *hedge_source(struct drbd_request *req)
+{
+	struct drbd_peer_device *peer_device, *source = NULL;
+
+	for_each_peer_device(peer_device, req->device) {
+		unsigned int s = req_net_state(req, peer_device->node_id);
+
+		if (!(s & RQ_NET_PENDING))
+			continue;
+		if (source || !(s & RQ_NET_SENT))
+			return NULL;
+		source = peer_device;
+	}
+	return source;
+}
+
+static struct drbd_peer_device *hedge_target(struct drbd_request *req)
+{
+	struct drbd_peer_device *peer_device, *best = NULL;
+	u64 best_time = U64_MAX;
+
+	for_each_peer_device(peer_device, req->device) {
+		u64 t;
+
+		if (!req_has_node_slot(req, peer_device->node_id) ||
+		    req_net_state(req, peer_device->node_id) & RQ_NET_MASK)
+			continue;
+		if (peer_device->disk_state[NOW] != D_UP_TO_DATE ||
+		    peer_device->repl_state[NOW] < L_ESTABLISHED)
+			continue;
+		t = read_service_time(req->device->resource,
+				atomic64_read(&peer_device->read_latency_ns),
+				atomic_read(&peer_device->ap_pending_cnt) +
+				atomic_read(&peer_device->rs_pending_cnt),
+				peer_device->node_id);
+		if (t < best_time) {
+			best_time = t;
+			best = peer_device;
+		}
+	}
+	return best;
+}
+
+static bool read_reply_claimed(struct drbd_request *req)
+{
+	int node_id;
+
+	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
+		if (req_net_state(req, node_id) & RQ_NET_OK)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * drbd_req_claim_read_reply() - May this data reply be received into the master bio?
+ * @req:	The read request the reply is for.
+ * @peer_device: Where the reply came from.
+ *
+ * Called by the receiver with the interval shard locks held. With hedged reads, two
+ * peers may answer the same request; only the first one may use the master
+ * bio. It is marked RQ_NET_OK until DATA_RECEIVED makes that final. Returns
+ * false if the reply is to be drained.
+ */
+bool drbd_req_claim_read_reply(struct drbd_request *req, struct drbd_peer_device *peer_device)
+{
+	const int idx = peer_device->node_id;
+	bool claimed = true;
+
+	lockdep_assert_held(&req->device->interval_shards[drbd_interval_shard(&req->i)].lock);
+
+	spin_lock(&req->rq_lock); /* local irq already disabled */
+	if (req_net_state(req, idx) & RQ_EXP_READ_REPLY) {
+		claimed = false;
+	} else if (req_net_state(req, idx) & RQ_NET_PENDING) {
+		claimed = !read_reply_claimed(req);
+		if (claimed)
+			WRITE_ONCE(req->net_rq_state[idx], req->net_rq_state[idx] | RQ_NET_OK);
+	}
+	spin_unlock(&req->rq_lock);
+
+	return claimed;
+}
+
+static void hedge_read(struct drbd_request *req)
+{
+	struct drbd_device *device = req->device;
+	struct drbd_peer_device *peer_device;
+	struct drbd_hedged_read *hr;
+	struct bio_and_error m;
+	unsigned long shards;
+	bool hedge = false;
+
+	peer_device = hedge_target(req);
+	if (!peer_device)
+		return;
+
+	hr = kmalloc(sizeof(*hr), GFP_ATOMIC);
+	if (!hr)
+		return;
+
+	/* No reply may be claimed while we add the second peer. And while we
+	 * do, the first one may still fail (NEG_ACKED, CONNECTION_LOST), so
+	 * hold an extra completion ref, taken while it is still pending. */
+	shards = drbd_lock_intervals(device, req->i.sector, req->i.size); /* local irq already disabled */
+	spin_lock(&req->rq_lock);
+	if (!(req->local_rq_state & RQ_HEDGED) && hedge_source(req) && !read_reply_claimed(req)) {
+		req->local_rq_state |= RQ_HEDGED;
+		atomic_inc(&req->completion_ref);
+		hedge = true;
+	}
+	spin_unlock(&req->rq_lock);
+	if (hedge) {
+		__req_mod(req, NEW_NET_READ, peer_device, &m);
+		/* the second peer holds one now, this cannot be the last */
+		atomic_dec(&req->completion_ref);
+	}
+	drbd_unlock_intervals(device, shards);
+
+	if (!hedge) {
+		kfree(hr);
+		return;
+	}
+
+	/* The sender of the second peer sends the P_DATA_REQUEST, once it
+	 * knows it does not overtake any write the read depends on. */
+	kref_get(&req->kref);
+	hr->pdw.w.cb = w_send_hedged_read;
+	hr->pdw.peer_device = peer_device;
+	hr->req = req;
+	drbd_queue_work(&peer_device->connection->sender_work, &hr->pdw.w);
+}
+
+/* keep the earliest of the times the hedge timer should fire */
+static void hedge_trigger_at(unsigned long *next_trigger_time, unsigned long when)
+{
+	if (!*next_trigger_time || time_before(when, *next_trigger_time))
+		*next_trigger_time = when;
+}
+
+void read_hedge_timer_fn(struct timer_list *t)
+{
+	struct drbd_device *device = from_timer(device, t, read_hedge_timer);
+	struct drbd_resource *resource = device->resource;
+	struct drbd_request *req, *overdue[HEDGE_BATCH];
+	s64 min_delay_ns = (s64)READ_ONCE(drbd_read_hedge_delay_us) * NSEC_PER_USEC;
+	unsigned long next_trigger_time = 0;
+	ktime_t now = ktime_get();
+	int i, n = 0;
+
+	if (!min_delay_ns)
+		return;
+
+	read_lock_irq(&resource->state_rwlock);
+	spin_lock(&device->pending_completion_lock); /* local irq already disabled */
+	list_for_each_entry(req, &device->pending_master_completion[0], req_pending_master_completion) {
+		struct drbd_peer_device *peer_device;
+		s64 age, delay;
+
+		if (req->local_rq_state & (RQ_LOCAL_MASK | RQ_HEDGED))
+			continue;
+		peer_device = hedge_source(req);
+		if (!peer_device) {
+			/* not sent yet, look again later */
+			hedge_trigger_at(&next_trigger_time,
+					 jiffies + usecs_to_jiffies(drbd_read_hedge_delay_us));
+			continue;
+		}
+		age = ktime_to_ns(ktime_sub(now, req->read_issue_kt));
+		delay = max_t(s64, min_delay_ns, 4 * atomic64_read(&peer_device->read_latency_ns));
+		if (age < delay) {
+			/* The delay depends on the peer, so younger requests
+			 * to a faster peer may be due already. */
+			hedge_trigger_at(&next_trigger_time, jiffies +
+					 usecs_to_jiffies(div_u64(delay - age, NSEC_PER_USEC)) + 1);
+			continue;
+		}
+		/* on this list, the request is not yet completed */
+		kref_get(&req->kref);
+		overdue[n++] = req;
+		if (n == HEDGE_BATCH) {
+			next_trigger_time = jiffies + 1;
+			break;
+		}
+	}
+	spin_unlock(&device->pending_completion_lock);
+
+	for (i = 0; i < n; i++) {
+		hedge_read(overdue[i]);
+		kref_put(&overdue[i]->kref, drbd_req_destroy);
+	}
+	read_unlock_irq(&resource->state_rwlock);
+
+	if (next_trigger_time)
+		mod_timer(&device->read_hedge_timer, next_trigger_time);
+}
+
 /**
  * drbd_handle_io_error_: Handle the on_io_error setting, should be called from all io completion handlers
  * @device: DRBD device.
@@ -91,6 +91,7 @@ enum drbd_req_event {
 	NEG_ACKED,
 	BARRIER_ACKED, /* in protocol A and B */
 	DATA_RECEIVED, /* (remote read) */
+	HEDGE_CANCELED, /* another peer answered the read first */
 
 	COMPLETED_OK,
 	READ_COMPLETED_WITH_ERROR,
@@ -125,6 +126,8 @@ enum drbd_req_state_bits {
 	 *   To be sent, on transfer log to be processed by sender.
 	 * pending,sent:
 	 *   Sent, expecting P_RECV_ACK (B) or P_WRITE_ACK (C).
+	 * pending,sent,ok:
+	 *   Read reply claimed, being received, see drbd_req_claim_read_reply().
 	 * sent,ok:
 	 *   Sent, implicit "ack" (A), P_RECV_ACK (B) or P_WRITE_ACK (C) received.
 	 *   Still waiting for the barrier ack.
@@ -181,6 +184,14 @@ enum drbd_req_state_bits {
 	/* waiting for a barrier ack, did an extra kref_get */
 	__RQ_EXP_BARR_ACK,
 
+	/* hedged read lost the race, but its reply may still arrive;
+	 * did an extra kref_get, so we find the request to discard it */
+	__RQ_EXP_READ_REPLY,
+
+	/* sent as part of the P_DATA of the request preceding it in the
+	 * transfer log, the peer acks only that one, see coalesce_writes() */
+	__RQ_NET_COALESCED,
+
 	/* 4321
 	 * 0000: no local possible
 	 * 0001: to be submitted
@@ -215,6 +226,9 @@ enum drbd_req_state_bits {
 	/* would have been completed,
 	 * but was not, because of drbd_suspended() */
 	__RQ_COMPLETION_SUSP,
+
+	/* READ was duplicated to a second peer by read_hedge_timer_fn() */
+	__RQ_HEDGED,
 };
 #define RQ_NET_PENDING     (1UL << __RQ_NET_PENDING)
 #define RQ_NET_QUEUED      (1UL << __RQ_NET_QUEUED)
@@ -228,6 +242,8 @@ enum drbd_req_state_bits {
 #define RQ_EXP_RECEIVE_ACK (1UL << __RQ_EXP_RECEIVE_ACK)
 #define RQ_EXP_WRITE_ACK   (1UL << __RQ_EXP_WRITE_ACK)
 #define RQ_EXP_BARR_ACK    (1UL << __RQ_EXP_BARR_ACK)
+#define RQ_EXP_READ_REPLY  (1UL << __RQ_EXP_READ_REPLY)
+#define RQ_NET_COALESCED   (1UL << __RQ_NET_COALESCED)
 
 #define RQ_LOCAL_PENDING   (1UL << __RQ_LOCAL_PENDING)
 #define RQ_LOCAL_COMPLETED (1UL << __RQ_LOCAL_COMPLETED)
@@ -245,6 +261,7 @@ enum drbd_req_state_bits {
 #define RQ_UNPLUG          (1UL << __RQ_UNPLUG)
 #define RQ_POSTPONED	   (1UL << __RQ_POSTPONED)
 #define RQ_COMPLETION_SUSP (1UL << __RQ_COMPLETION_SUSP)
+#define RQ_HEDGED          (1UL << __RQ_HEDGED)
 
 
 /* these flags go into local_rq_state,
@@ -258,13 +275,20 @@ enum drbd_req_state_bits {
 	 RQ_IN_ACT_LOG  |\
 	 RQ_UNPLUG      |\
 	 RQ_POSTPONED   |\
-	 RQ_COMPLETION_SUSP)
+	 RQ_COMPLETION_SUSP |\
+	 RQ_HEDGED)
 
 static inline bool drbd_req_is_write(struct drbd_request *req)
 {
 	return req->local_rq_state & RQ_WRITE;
 }
 
+/* Queued to the sender of the second peer of a hedged read */
+struct drbd_hedged_read {
+	struct drbd_peer_device_work pdw;
+	struct drbd_request *req;
+};
+
 /* Short lived temporary struct on the stack.
  * We could squirrel the error to be returned into
  * bio->bi_iter.bi_size, or similar. But that would be too ugly. */
@@ -278,9 +302,14 @@ extern void drbd_req_destroy(struct kref *kref);
 extern void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		struct drbd_peer_device *peer_device,
 		struct bio_and_error *m);
+extern void req_mod_coalesced(struct drbd_request *req, enum drbd_req_event what,
+		struct drbd_peer_device *peer_device);
 extern void complete_master_bio(struct drbd_device *device,
 		struct bio_and_error *m);
 extern void request_timer_fn(struct timer_list *t);
+extern void read_hedge_timer_fn(struct timer_list *t);
+extern bool drbd_req_claim_read_reply(struct drbd_request *req,
+		struct drbd_peer_device *peer_device);
 extern void tl_walk(struct drbd_connection *connection, struct drbd_request **from_req, enum drbd_req_event what);
 extern void __tl_walk(struct drbd_resource *const resource,
 		struct drbd_connection *const connection,
@@ -291,6 +320,22 @@ extern int w_queue_peer_ack(struct drbd_work *w, int cancel);
 extern void drbd_queue_peer_ack(struct drbd_resource *resource, struct drbd_request *req);
 extern bool drbd_should_do_remote(struct drbd_peer_device *, enum which_state);
 extern void drbd_reclaim_req(struct rcu_head *rp);
+extern int drbd_req_grow_node_slots(struct drbd_resource *resource, int node_id);
+extern int drbd_interval_shard(struct drbd_interval *i);
+extern unsigned long drbd_lock_intervals(struct drbd_device *device, sector_t sector, unsigned int size);
+extern void drbd_unlock_intervals(struct drbd_device *device, unsigned long shards);
+extern void drbd_insert_shard_interval(struct drbd_device *device, struct drbd_interval *i);
+extern void drbd_remove_shard_interval(struct drbd_device *device, struct drbd_interval *i);
+extern struct drbd_interval *drbd_shard_overlap(struct drbd_device *device, unsigned long shards,
+		enum drbd_interval_type type, struct drbd_interval *i,
+		sector_t sector, unsigned int size);
+extern bool drbd_contains_shard_interval(struct drbd_device *device, unsigned long shards,
+		enum drbd_interval_type type, sector_t sector, struct drbd_interval *interval);
+
+#define drbd_for_each_shard_overlap(i, device, shards, type, sector, size)		\
+	for (i = drbd_shard_overlap(device, shards, type, NULL, sector, size);		\
+	     i;										\
+	     i = drbd_shard_overlap(device, shards, type, i, sector, size))
 
 /* this is in drbd_main.c */
 extern void drbd_restart_request(struct drbd_request *req);
@@ -631,6 +631,9 @@ static int drbd_rs_controller(struct drbd_peer_device *peer_device, u64 sect_in,
 
 static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 {
+	struct drbd_bitmap *bm = peer_device->device->bitmap;
+	unsigned int sect_shift = bm->bm_block_shift - SECTOR_SHIFT;
+	unsigned int pages_per_bit = 1U << (bm->bm_block_shift - BM_BLOCK_SHIFT);
 	struct net_conf *nc;
 	ktime_t duration, now;
 	unsigned int sect_in;  /* Number of sectors that came in since the last turn */
@@ -647,11 +650,18 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	nc = rcu_dereference(peer_device->connection->transport.net_conf);
 	mxb = nc ? nc->max_buffers : 0;
 	if (rcu_dereference(peer_device->rs_plan_s)->size) {
-		number = drbd_rs_controller(peer_device, sect_in, ktime_to_ns(duration)) >> (BM_BLOCK_SHIFT - 9);
-		peer_device->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / RS_MAKE_REQS_INTV;
+		number = drbd_rs_controller(peer_device, sect_in, ktime_to_ns(duration)) >> sect_shift;
+		peer_device->c_sync_rate = number * HZ * (bm_block_size(bm) / 1024) / RS_MAKE_REQS_INTV;
 	} else {
+		unsigned int sect;
+
 		peer_device->c_sync_rate = rcu_dereference(peer_device->conf)->resync_rate;
-		number = RS_MAKE_REQS_INTV * peer_device->c_sync_rate  / ((BM_BLOCK_SIZE / 1024) * HZ);
+		/* With coarse bitmap blocks, a turn may be worth less than
+		 * one block. Carry that over, or low rates would never start. */
+		sect = RS_MAKE_REQS_INTV * peer_device->c_sync_rate * 2 / HZ +
+			peer_device->rs_sect_carry;
+		number = sect >> sect_shift;
+		peer_device->rs_sect_carry = sect - (number << sect_shift);
 	}
 	rcu_read_unlock();
 
@@ -660,12 +670,12 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	 * potentially causing a distributed deadlock on congestion during
 	 * online-verify or (checksum-based) resync, if max-buffers,
 	 * socket buffer sizes and resync rate settings are mis-configured. */
-	/* note that "number" is in units of "BM_BLOCK_SIZE" (which is 4k),
+	/* note that "number" is in units of bm_block_size() (4k or more),
 	 * mxb (as used here, and in drbd_alloc_pages on the peer) is
-	 * "number of pages" (typically also 4k),
+	 * "number of pages" (typically 4k),
 	 * but "rs_in_flight" is in "sectors" (512 Byte). */
-	if (mxb - peer_device->rs_in_flight/8 < number)
-		number = mxb - peer_device->rs_in_flight/8;
+	if (mxb - peer_device->rs_in_flight/8 < number * (int)pages_per_bit)
+		number = (mxb - peer_device->rs_in_flight/8) / (int)pages_per_bit;
 
 	return number;
 }
@@ -812,7 +822,9 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	int optimal_bits_alignment, optimal_bits_rate, discard_granularity = 0;
 	int max_bio_bits, number, rollback_i, i, err, optimal_bits, size = 0;
 	struct drbd_device *device = peer_device->device;
+	struct drbd_bitmap *bm = device->bitmap;
 	const sector_t capacity = get_capacity(device->vdisk);
+	struct drbd_rs_batch batch = { .refs = 0 };
 	unsigned long bit;
 	sector_t sector, prev_sector = 0;
 
@@ -849,25 +861,26 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 		rcu_read_unlock();
 	}
 
-	max_bio_bits = queue_max_hw_sectors(device->rq_queue) >> (BM_BLOCK_SHIFT - SECTOR_SHIFT);
+	max_bio_bits = queue_max_hw_sectors(device->rq_queue) >> (bm->bm_block_shift - SECTOR_SHIFT);
 	/*
 	 * Round down to power of 2 to avoid losing alignment when this is the
-	 * limiting factor for our request size.
+	 * limiting factor for our request size. A bitmap block larger than
+	 * that still goes out as a single request.
 	 */
-	max_bio_bits = 1 << (fls(max_bio_bits) - 1);
+	max_bio_bits = 1 << (fls(max(max_bio_bits, 1)) - 1);
 
 	number = drbd_rs_number_requests(peer_device);
-	if (number * BM_BLOCK_SIZE < discard_granularity)
-		number = discard_granularity / BM_BLOCK_SIZE;
+	if (number * bm_block_size(bm) < discard_granularity)
+		number = discard_granularity / bm_block_size(bm);
 
 	/* don't let rs_sectors_came_in() re-schedule us "early"
 	 * just because the first reply came "fast", ... */
-	peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
+	peer_device->rs_in_flight += number * bm_sect_per_bit(bm);
 
 	peer_device->last_resync_next_bit = peer_device->resync_next_bit;
 
 	for (i = 0; i < number; i++) {
-		if ((number - i) << BM_BLOCK_SHIFT < discard_granularity)
+		if ((number - i) << bm->bm_block_shift < discard_granularity)
 			goto request_done;
 
 		if (send_buffer_half_full(peer_device))
@@ -880,8 +893,8 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 				goto request_done;
 			}
 
-			sector = BM_BIT_TO_SECT(bit);
-			err = drbd_try_rs_begin_io(peer_device, sector, true);
+			sector = bm_bit_to_sect(bm, bit);
+			err = drbd_rs_batch_get(peer_device, &batch, sector, number - i, true);
 			if (err) {
 				peer_device->resync_next_bit = bit;
 				goto request_done;
@@ -893,20 +906,20 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 				/* drbd_try_rs_begin_io() might sleep, in case the
 				   bit got cleared while sleeping... */
 				peer_device->resync_next_bit = bit + 1;
-				drbd_rs_complete_io(peer_device, sector);
+				drbd_rs_batch_unget(&batch);
 			}
 		}
 
-		if (adjacent(prev_sector, size, sector) && (number - i) << BM_BLOCK_SHIFT < size) {
+		if (adjacent(prev_sector, size, sector) && (number - i) << bm->bm_block_shift < size) {
 			/* When making requests in an out-of-sync area, ensure that the size
 			   of successive requests does not decrease. This allows the next
 			   make_resync_request call to start with optimal alignment. */
-			drbd_rs_complete_io(peer_device, sector);
+			drbd_rs_batch_unget(&batch);
 			goto request_done;
 		}
 
 		prev_sector = sector;
-		size = BM_BLOCK_SIZE;
+		size = bm_block_size(bm);
 		optimal_bits_alignment = optimal_bits_for_alignment(bit, max_bio_bits);
 		optimal_bits_rate = round_to_powerof_2(number - i);
 		optimal_bits = min(optimal_bits_alignment, optimal_bits_rate) - 1;
@@ -919,7 +932,7 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 
 			if (drbd_bm_test_bit(peer_device, bit + 1) != 1)
 				break;
-			size += BM_BLOCK_SIZE;
+			size += bm_block_size(bm);
 			bit++;
 			i++;
 		}
@@ -934,11 +947,12 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 		if (peer_device->use_csums) {
 			switch (read_for_csum(peer_device, sector, size)) {
 			case -EIO: /* Disk failure */
+				drbd_rs_batch_put(peer_device, &batch);
 				put_ldev(device);
 				return -EIO;
 			case -EAGAIN: /* allocation failed, or ldev busy */
-				drbd_rs_complete_io(peer_device, sector);
-				peer_device->resync_next_bit = BM_SECT_TO_BIT(sector);
+				drbd_rs_batch_unget(&batch);
+				peer_device->resync_next_bit = bm_sect_to_bit(bm, sector);
 				i = rollback_i;
 				goto request_done;
 			case 0:
@@ -957,6 +971,7 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 			if (err) {
 				drbd_err(device, "drbd_send_drequest() failed, aborting...\n");
 				dec_rs_pending(peer_device);
+				drbd_rs_batch_put(peer_device, &batch);
 				put_ldev(device);
 				return err;
 			}
@@ -964,8 +979,9 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	}
 
 request_done:
+	drbd_rs_batch_put(peer_device, &batch);
 	/* ... but do a correction, in case we had to break/goto request_done; */
-	peer_device->rs_in_flight -= (number - i) * BM_SECT_PER_BIT;
+	peer_device->rs_in_flight -= (number - i) * bm_sect_per_bit(bm);
 
 	if (peer_device->resync_next_bit >= drbd_bm_bits(device)) {
 		/* last syncer _request_ was sent,
@@ -993,9 +1009,11 @@ request_done:
 static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 {
 	struct drbd_device *device = peer_device->device;
+	struct drbd_bitmap *bm = device->bitmap;
 	int number, i, size;
 	sector_t sector;
 	const sector_t capacity = get_capacity(device->vdisk);
+	struct drbd_rs_batch batch = { .refs = 0 };
 	bool stop_sector_reached = false;
 
 	if (unlikely(cancel))
@@ -1006,7 +1024,7 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 
 	/* don't let rs_sectors_came_in() re-schedule us "early"
 	 * just because the first reply came "fast", ... */
-	peer_device->rs_in_flight += number * BM_SECT_PER_BIT;
+	peer_device->rs_in_flight += number * bm_sect_per_bit(bm);
 	for (i = 0; i < number; i++) {
 		if (sector >= capacity)
 			break;
@@ -1020,9 +1038,9 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 		if (stop_sector_reached)
 			break;
 
-		size = BM_BLOCK_SIZE;
+		size = bm_block_size(bm);
 
-		if (drbd_try_rs_begin_io(peer_device, sector, true))
+		if (drbd_rs_batch_get(peer_device, &batch, sector, number - i, true))
 			break;
 
 		if (sector + (size>>9) > capacity)
@@ -1031,12 +1049,14 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 		inc_rs_pending(peer_device);
 		if (drbd_send_ov_request(peer_device, sector, size)) {
 			dec_rs_pending(peer_device);
+			drbd_rs_batch_put(peer_device, &batch);
 			return 0;
 		}
-		sector += BM_SECT_PER_BIT;
+		sector += bm_sect_per_bit(bm);
 	}
+	drbd_rs_batch_put(peer_device, &batch);
 	/* ... but do a correction, in case we had to break; ... */
-	peer_device->rs_in_flight -= (number-i) * BM_SECT_PER_BIT;
+	peer_device->rs_in_flight -= (number-i) * bm_sect_per_bit(bm);
 	peer_device->ov_position = sector;
 	if (stop_sector_reached)
 		return 1;
@@ -1302,7 +1322,7 @@ void drbd_resync_finished(struct drbd_peer_device *peer_device,
 	if (repl_state[NOW] == L_VERIFY_S || repl_state[NOW] == L_VERIFY_T)
 		db -= atomic64_read(&peer_device->ov_left);
 
-	dbdt = Bit2KB(db/dt);
+	dbdt = bm_bit_to_kb(device->bitmap, db/dt);
 	peer_device->rs_paused /= HZ;
 
 	if (!get_ldev(device)) {
@@ -1327,10 +1347,10 @@ void drbd_resync_finished(struct drbd_peer_device *peer_device,
 
 	aborted = device->disk_state[NOW] == D_OUTDATED && new_peer_disk_state == D_INCONSISTENT;
 	{
-	char tmp[sizeof(" but 01234567890123456789 4k blocks skipped")] = "";
+	char tmp[sizeof(" but 01234567890123456789 1024k blocks skipped")] = "";
 	if (verify_done && peer_device->ov_skipped)
-		snprintf(tmp, sizeof(tmp), " but %lu %dk blocks skipped",
-			peer_device->ov_skipped, Bit2KB(1));
+		snprintf(tmp, sizeof(tmp), " but %lu %luk blocks skipped",
+			peer_device->ov_skipped, bm_bit_to_kb(device->bitmap, 1));
 	drbd_info(peer_device, "%s %s%s (total %lu sec; paused %lu sec; %lu K/sec)\n",
 		  verify_done ? "Online verify" : "Resync",
 		  aborted ? "aborted" : "done", tmp,
@@ -1341,8 +1361,8 @@ void drbd_resync_finished(struct drbd_peer_device *peer_device,
 
 	if (repl_state[NOW] == L_VERIFY_S || repl_state[NOW] == L_VERIFY_T) {
 		if (n_oos) {
-			drbd_alert(peer_device, "Online verify found %lu %dk blocks out of sync!\n",
-			      n_oos, Bit2KB(1));
+			drbd_alert(peer_device, "Online verify found %lu %luk blocks out of sync!\n",
+			      n_oos, bm_bit_to_kb(device->bitmap, 1));
 			khelper_cmd = "out-of-sync";
 		}
 	} else {
@@ -1363,9 +1383,9 @@ void drbd_resync_finished(struct drbd_peer_device *peer_device,
 			drbd_info(peer_device, "%u %% had equal checksums, eliminated: %luK; "
 			     "transferred %luK total %luK\n",
 			     ratio,
-			     Bit2KB(peer_device->rs_same_csum),
-			     Bit2KB(peer_device->rs_total - peer_device->rs_same_csum),
-			     Bit2KB(peer_device->rs_total));
+			     bm_bit_to_kb(device->bitmap, peer_device->rs_same_csum),
+			     bm_bit_to_kb(device->bitmap, peer_device->rs_total - peer_device->rs_same_csum),
+			     bm_bit_to_kb(device->bitmap, peer_device->rs_total));
 		}
 	}
 
@@ -1571,8 +1591,8 @@ static int drbd_rs_reply(struct drbd_peer_device *peer_device, struct drbd_peer_
 
 	if (eq) {
 		drbd_set_in_sync(peer_device, peer_req->i.sector, peer_req->i.size);
-		/* rs_same_csums unit is BM_BLOCK_SIZE */
-		peer_device->rs_same_csum += peer_req->i.size >> BM_BLOCK_SHIFT;
+		/* rs_same_csums unit is bm_block_size() */
+		peer_device->rs_same_csum += peer_req->i.size >> device->bitmap->bm_block_shift;
 		err = drbd_send_ack(peer_device, P_RS_IS_IN_SYNC, peer_req);
 	} else {
 		inc_rs_pending(peer_device);
@@ -1696,6 +1716,8 @@ out:
 
 void drbd_ov_out_of_sync_found(struct drbd_peer_device *peer_device, sector_t sector, int size)
 {
+	struct drbd_device *device = peer_device->device;
+
 	if (peer_device->ov_last_oos_start + peer_device->ov_last_oos_size == sector) {
 		peer_device->ov_last_oos_size += size>>9;
 	} else {
@@ -1703,6 +1725,13 @@ void drbd_ov_out_of_sync_found(struct drbd_peer_device *peer_device, sector_t se
 		peer_device->ov_last_oos_start = sector;
 		peer_device->ov_last_oos_size = size>>9;
 	}
+	/* Not covered by our activity log. Allocate the pages of a sparse
+	 * bitmap here, rather than in atomic context. */
+	if (size && get_ldev(device)) {
+		drbd_bm_sparse_prepare(device, bm_sect_to_bit(device->bitmap, sector),
+				       bm_sect_to_bit(device->bitmap, sector + (size >> 9) - 1));
+		put_ldev(device);
+	}
 	drbd_set_out_of_sync(peer_device, sector, size);
 }
 
@@ -2343,8 +2372,8 @@ static void go_diskless(struct drbd_device *device)
 
 static int do_md_sync(struct drbd_device *device)
 {
-	drbd_warn(device, "md_sync_timer expired! Worker calls drbd_md_sync().\n");
-	drbd_md_sync(device);
+	drbd_warn(device, "md_sync_timer expired! Worker writes meta data.\n");
+	drbd_md_sync_async(device);
 	return 0;
 }
 
@@ -2478,6 +2507,8 @@ static void do_device_work(struct drbd_device *device, const unsigned long todo)
 {
 	if (test_bit(MD_SYNC, &todo))
 		do_md_sync(device);
+	if (test_bit(MD_SYNC_KICK, &todo))
+		drbd_md_sync_kick(device);
 	if (test_bit(GO_DISKLESS, &todo))
 		go_diskless(device);
 	if (test_bit(MAKE_NEW_CUR_UUID, &todo))
@@ -2503,6 +2534,7 @@ static void do_peer_device_work(struct drbd_peer_device *peer_device, const unsi
 #define DRBD_DEVICE_WORK_MASK	\
 	((1UL << GO_DISKLESS)	\
 	|(1UL << MD_SYNC)	\
+	|(1UL << MD_SYNC_KICK)	\
 	|(1UL << MAKE_NEW_CUR_UUID)\
 	)
 
@@ -2596,7 +2628,7 @@ static struct drbd_request *__next_request_for_connection(
 	struct drbd_request *req;
 
 	list_for_each_entry_rcu(req, &connection->resource->transfer_log, tl_requests) {
-		unsigned s = req->net_rq_state[connection->peer_node_id];
+		unsigned s = req_net_state(req, connection->peer_node_id);
 		/* Found a request which is for this peer but not yet queued.
 		 * Do not skip past it. */
 		if (unlikely(s & RQ_NET_PENDING && !(s & (RQ_NET_QUEUED|RQ_NET_SENT))))
@@ -2751,9 +2783,73 @@ static void wait_for_sender_todo(struct drbd_connection *connection)
 		drbd_uncork(connection, DATA_STREAM);
 }
 
+static void drain_reset(struct drbd_connection *connection)
+{
+	struct drbd_drain_ctl *dc = &connection->drain;
+
+	dc->last_sample = ktime_get();
+	dc->last_dagtag = READ_ONCE(connection->resource->dagtag_sector);
+	dc->last_done = atomic64_read(&connection->ap_done_sectors);
+	dc->in_rate = 0;
+	dc->out_rate = 0;
+	WRITE_ONCE(dc->rtt_us, 0);
+	WRITE_ONCE(dc->fill_ms, 0);
+}
+
+static unsigned int drain_avg(unsigned int avg, u64 sectors, s64 us)
+{
+	unsigned int rate = min_t(u64, div64_u64(sectors * USEC_PER_SEC, us), UINT_MAX);
+
+	return avg ? avg - (avg >> 2) + (rate >> 2) : rate;
+}
+
+/* Samples the rates at which the application writes and at which the data
+ * stream drains, and predicts when the send buffer is full if the former is
+ * higher, see __maybe_pull_ahead(). The rate out is only sampled while
+ * something was in flight, an idle link says nothing about its capacity. */
+static void drain_sample(struct drbd_connection *connection)
+{
+	struct drbd_drain_ctl *dc = &connection->drain;
+	struct drbd_transport *transport = &connection->transport;
+	struct drbd_transport_stats transport_stats;
+	ktime_t now = ktime_get();
+	s64 us = ktime_us_delta(now, dc->last_sample);
+	u64 dagtag, done;
+	unsigned int fill_ms = 0;
+
+	if (us < DRBD_DRAIN_SAMPLE_MS * USEC_PER_MSEC)
+		return;
+
+	dagtag = READ_ONCE(connection->resource->dagtag_sector);
+	done = atomic64_read(&connection->ap_done_sectors);
+	dc->in_rate = drain_avg(dc->in_rate, dagtag - dc->last_dagtag, us);
+	if (done != dc->last_done || atomic_read(&connection->ap_in_flight))
+		dc->out_rate = drain_avg(dc->out_rate, done - dc->last_done, us);
+	dc->last_sample = now;
+	dc->last_dagtag = dagtag;
+	dc->last_done = done;
+
+	if (dc->in_rate <= dc->out_rate)
+		goto out;
+
+	mutex_lock(&connection->mutex[DATA_STREAM]);
+	if (transport->ops->stream_ok(transport, DATA_STREAM)) {
+		int room;
+
+		transport->ops->stats(transport, &transport_stats);
+		room = transport_stats.send_buffer_size - transport_stats.send_buffer_used;
+		fill_ms = div_u64((u64)max(room, 0) / 512 * MSEC_PER_SEC,
+				  dc->in_rate - dc->out_rate) ?: 1;
+	}
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
+out:
+	WRITE_ONCE(dc->fill_ms, fill_ms);
+}
+
 static void re_init_if_first_write(struct drbd_connection *connection, unsigned int epoch)
 {
 	if (!connection->send.seen_any_write_yet) {
+		drain_reset(connection);
 		connection->send.seen_any_write_yet = true;
 		connection->send.current_epoch_nr = epoch;
 		connection->send.current_epoch_writes = 0;
@@ -2788,6 +2884,7 @@ static bool is_write_in_flight(struct drbd_peer_device *peer_device, struct drbd
 	int size = in->size;
 	int idx = peer_device->node_id;
 	int s;
+	unsigned long shards;
 	bool in_flight = false;
 
 	if (idx < 0 || idx >= DRBD_NODE_ID_MAX) {
@@ -2796,8 +2893,8 @@ static bool is_write_in_flight(struct drbd_peer_device *peer_device, struct drbd
 	}
 
 	read_lock_irq(&device->resource->state_rwlock);
-	spin_lock(&device->interval_lock);
-	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
+	shards = drbd_lock_intervals(device, sector, size);
+	drbd_for_each_shard_overlap(i, device, shards, INTERVAL_LOCAL_WRITE, sector, size) {
 		if (i == in)
 			continue;
 		if (i->type != INTERVAL_LOCAL_WRITE)
@@ -2805,7 +2902,7 @@ static bool is_write_in_flight(struct drbd_peer_device *peer_device, struct drbd
 		/* don't care for i->completed, in DRBD_PROT_A we
 		 * are more interested in RQ_NET_DONE instead */
 		req = container_of(i, struct drbd_request, i);
-		s = req->net_rq_state[idx];
+		s = req_net_state(req, idx);
 		if ((s & RQ_NET_SENT) == 0) /* not even sent: ignore */
 			continue;
 		if ((s & RQ_NET_DONE) == RQ_NET_DONE) /* already done: ignore */
@@ -2813,11 +2910,69 @@ static bool is_write_in_flight(struct drbd_peer_device *peer_device, struct drbd
 		in_flight = true;
 		break;
 	}
-	spin_unlock(&device->interval_lock);
+	drbd_unlock_intervals(device, shards);
 	read_unlock_irq(&device->resource->state_rwlock);
 	return in_flight;
 }
 
+/* Collects the writes queued directly behind req in the transfer log that may
+ * share its P_DATA: same volume, epoch and wire flags, continuing req on disk
+ * and in dagtag order, without a plug boundary in between. The peer then
+ * answers for req only; mark them RQ_NET_COALESCED before anything is sent,
+ * so that answer finds them, see req_mod_coalesced(). */
+static int coalesce_writes(struct drbd_peer_device *peer_device, struct drbd_request *req,
+			   struct drbd_request **coalesced)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	const int idx = peer_device->node_id;
+	const unsigned s = req_net_state(req, idx);
+	unsigned int max_size, size = req->i.size;
+	struct drbd_request *prev = req;
+	int nr = 0;
+
+	max_size = min(READ_ONCE(drbd_coalesce_writes_kb) << 10, peer_device->max_bio_size);
+	if (size >= max_size || connection->integrity_tfm ||
+	    bio_op(req->master_bio) != REQ_OP_WRITE || req->local_rq_state & RQ_UNPLUG)
+		return 0;
+
+	rcu_read_lock();
+	list_for_each_entry_continue_rcu(req, &connection->resource->transfer_log, tl_requests) {
+		if (nr == DRBD_COALESCE_MAX)
+			break;
+		/* queued like the first one, so its master bio is still there */
+		if (req_net_state(req, idx) != s)
+			break;
+		if (req->device != prev->device || req->epoch != prev->epoch ||
+		    bio_op(req->master_bio) != REQ_OP_WRITE ||
+		    (req->master_bio->bi_opf ^ prev->master_bio->bi_opf) &
+		    (REQ_SYNC | REQ_FUA | REQ_PREFLUSH))
+			break;
+		if (req->i.sector != prev->i.sector + (prev->i.size >> 9) ||
+		    req->dagtag_sector != prev->dagtag_sector + (req->i.size >> 9) ||
+		    size + req->i.size > max_size)
+			break;
+
+		spin_lock_irq(&req->rq_lock);
+		if (req_net_state(req, idx) != s) {
+			spin_unlock_irq(&req->rq_lock);
+			break;
+		}
+		req->net_rq_state[idx] |= RQ_NET_COALESCED;
+		spin_unlock_irq(&req->rq_lock);
+
+		req->pre_send_jif[idx] = jiffies;
+		ktime_get_accounting(req->pre_send_kt[idx]);
+		size += req->i.size;
+		coalesced[nr++] = req;
+		prev = req;
+		if (req->local_rq_state & RQ_UNPLUG)
+			break;
+	}
+	rcu_read_unlock();
+
+	return nr;
+}
+
 static int process_one_request(struct drbd_connection *connection)
 {
 	struct bio_and_error m;
@@ -2825,8 +2980,10 @@ static int process_one_request(struct drbd_connection *connection)
 	struct drbd_device *device = req->device;
 	struct drbd_peer_device *peer_device =
 			conn_peer_device(connection, device->vnr);
-	unsigned s = req->net_rq_state[peer_device->node_id];
+	unsigned s = req_net_state(req, peer_device->node_id);
 	bool do_send_unplug = req->local_rq_state & RQ_UNPLUG;
+	struct drbd_request *coalesced[DRBD_COALESCE_MAX];
+	int i, nr_coalesced = 0;
 	int err = 0;
 	enum drbd_req_event what;
 
@@ -2845,8 +3002,13 @@ static int process_one_request(struct drbd_connection *connection)
 			if (current_dagtag_sector != connection->send.current_dagtag_sector)
 				drbd_send_dagtag(connection, current_dagtag_sector);
 
+			if (drbd_coalesce_writes_kb)
+				nr_coalesced = coalesce_writes(peer_device, req, coalesced);
+
+			/* the peer advances its dagtag by the size of the whole packet */
 			connection->send.current_epoch_writes++;
-			connection->send.current_dagtag_sector = req->dagtag_sector;
+			connection->send.current_dagtag_sector = nr_coalesced ?
+				coalesced[nr_coalesced - 1]->dagtag_sector : req->dagtag_sector;
 
 			if (peer_device->todo.was_ahead) {
 				clear_bit(SEND_STATE_AFTER_AHEAD, &peer_device->flags);
@@ -2854,8 +3016,10 @@ static int process_one_request(struct drbd_connection *connection)
 				drbd_send_current_state(peer_device);
 			}
 
-			err = drbd_send_dblock(peer_device, req);
+			err = drbd_send_dblock(peer_device, req, coalesced, nr_coalesced);
 			what = err ? SEND_FAILED : HANDED_OVER_TO_NETWORK;
+			if (!err && drbd_congestion_target_ms)
+				drain_sample(connection);
 		} else {
 			/* this time, no connection->send.current_epoch_writes++;
 			 * If it was sent, it was the closing barrier for the last
@@ -2905,6 +3069,9 @@ static int process_one_request(struct drbd_connection *connection)
 				err = drbd_send_out_of_sync(peer_device, req->i.sector, req->i.size);
 			what = OOS_HANDED_TO_NETWORK; /* Well, most of the time, anyways. */
 		}
+	} else if (req->local_rq_state & RQ_HEDGED && !(s & RQ_NET_PENDING)) {
+		/* another peer answered this hedged read already */
+		what = HEDGE_CANCELED;
 	} else {
 		maybe_send_barrier(connection, req->epoch);
 		err = drbd_send_drequest(peer_device, P_DATA_REQUEST,
@@ -2916,17 +3083,97 @@ static int process_one_request(struct drbd_connection *connection)
 	__req_mod(req, what, peer_device, &m);
 	read_unlock_irq(&connection->resource->state_rwlock);
 
-	check_sender_todo(connection);
-
 	if (m.bio)
 		complete_master_bio(device, &m);
 
+	/* in transfer log order, so todo.req_next moves past them */
+	if (nr_coalesced)
+		do_send_unplug = coalesced[nr_coalesced - 1]->local_rq_state & RQ_UNPLUG;
+	for (i = 0; i < nr_coalesced; i++) {
+		read_lock_irq(&connection->resource->state_rwlock);
+		__req_mod(coalesced[i], what, peer_device, &m);
+		read_unlock_irq(&connection->resource->state_rwlock);
+
+		if (m.bio)
+			complete_master_bio(device, &m);
+	}
+
+	check_sender_todo(connection);
+
 	do_send_unplug = do_send_unplug && what == HANDED_OVER_TO_NETWORK;
 	maybe_send_unplug_remote(connection, do_send_unplug);
 
 	return err;
 }
 
+/* Does this connection still have to send something older than req? Then a
+ * P_DATA_REQUEST sent now could overtake a write the read must see. */
+static bool older_requests_unsent(struct drbd_connection *connection, struct drbd_request *req)
+{
+	struct drbd_request *r;
+	bool unsent = false;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(r, &connection->resource->transfer_log, tl_requests) {
+		unsigned s;
+
+		if (r == req)
+			break;
+		s = req_net_state(r, connection->peer_node_id);
+		if (s & RQ_NET_QUEUED || (s & RQ_NET_PENDING && !(s & RQ_NET_SENT))) {
+			unsent = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return unsent;
+}
+
+/* The second P_DATA_REQUEST of a hedged read, queued by read_hedge_timer_fn().
+ * It is sent out of transfer log order, unless that could reorder it. */
+int w_send_hedged_read(struct drbd_work *w, int cancel)
+{
+	struct drbd_hedged_read *hr = container_of(w, struct drbd_hedged_read, pdw.w);
+	struct drbd_peer_device *peer_device = hr->pdw.peer_device;
+	struct drbd_connection *connection = peer_device->connection;
+	struct drbd_device *device = peer_device->device;
+	struct drbd_request *req = hr->req;
+	unsigned s = req_net_state(req, peer_device->node_id);
+	enum drbd_req_event what;
+	struct bio_and_error m;
+	int err = 0;
+
+	kfree(hr);
+
+	if (!(s & RQ_NET_PENDING)) {
+		/* the first peer was faster after all */
+		what = HEDGE_CANCELED;
+	} else if (cancel) {
+		/* real cleanup will be done from tl_walk(,CONNECTION_LOST*) */
+		what = SEND_CANCELED;
+	} else if (older_requests_unsent(connection, req)) {
+		/* process_one_request() will get to it in order */
+		what = ADDED_TO_TRANSFER_LOG;
+	} else {
+		req->pre_send_jif[peer_device->node_id] = jiffies;
+		ktime_get_accounting(req->pre_send_kt[peer_device->node_id]);
+		err = drbd_send_drequest(peer_device, P_DATA_REQUEST,
+				req->i.sector, req->i.size, (unsigned long)req);
+		what = err ? SEND_FAILED : HANDED_OVER_TO_NETWORK;
+	}
+
+	read_lock_irq(&connection->resource->state_rwlock);
+	__req_mod(req, what, peer_device, &m);
+	kref_put(&req->kref, drbd_req_destroy);
+	read_unlock_irq(&connection->resource->state_rwlock);
+
+	if (m.bio)
+		complete_master_bio(device, &m);
+
+	return err;
+}
+
 static int process_sender_todo(struct drbd_connection *connection)
 {
 	struct drbd_work *w = NULL;
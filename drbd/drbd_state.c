@@ -2428,10 +2428,10 @@ static void set_ov_position(struct drbd_peer_device *peer_device,
 		 * first P_OV_REQUEST is received */
 		peer_device->ov_start_sector = ~(sector_t)0;
 	} else {
-		unsigned long bit = BM_SECT_TO_BIT(peer_device->ov_start_sector);
+		unsigned long bit = bm_sect_to_bit(device->bitmap, peer_device->ov_start_sector);
 		if (bit >= peer_device->rs_total) {
 			peer_device->ov_start_sector =
-				BM_BIT_TO_SECT(peer_device->rs_total - 1);
+				bm_bit_to_sect(device->bitmap, peer_device->rs_total - 1);
 			peer_device->rs_total = 1;
 		} else
 			peer_device->rs_total -= bit;
@@ -2624,7 +2624,7 @@ static void finish_state_change(struct drbd_resource *resource)
 				unsigned long ov_left = atomic64_read(&peer_device->ov_left);
 
 				peer_device->ov_start_sector =
-					BM_BIT_TO_SECT(drbd_bm_bits(device) - ov_left);
+					bm_bit_to_sect(device->bitmap, drbd_bm_bits(device) - ov_left);
 				if (ov_left)
 					drbd_info(peer_device, "Online Verify reached sector %llu\n",
 						  (unsigned long long)peer_device->ov_start_sector);
@@ -3564,7 +3564,7 @@ static void drbd_run_resync(struct drbd_peer_device *peer_device, enum drbd_repl
 
 	drbd_info(peer_device, "Began resync as %s (will sync %lu KB [%lu bits set]).\n",
 			drbd_repl_str(repl_state),
-			(unsigned long) peer_device->rs_total << (BM_BLOCK_SHIFT-10),
+			bm_bit_to_kb(device->bitmap, peer_device->rs_total),
 			(unsigned long) peer_device->rs_total);
 
 	if (side == L_SYNC_TARGET)
@@ -4006,6 +4006,20 @@ static int w_after_state_change(struct drbd_work *w, int unused)
 			put_ldev(device);
 		}
 
+		if (role[OLD] == R_PRIMARY && role[NEW] == R_SECONDARY && get_ldev(device)) {
+			drbd_al_save_hints(device);
+			put_ldev(device);
+		}
+
+		/* promoted, or attached while primary */
+		if (role[NEW] == R_PRIMARY &&
+		    (role[OLD] != R_PRIMARY ||
+		     (disk_state[OLD] < D_INCONSISTENT && disk_state[NEW] >= D_INCONSISTENT)) &&
+		    get_ldev(device)) {
+			drbd_al_warm(device);
+			put_ldev(device);
+		}
+
 		/* first half of local IO error, failure to attach,
 		 * or administrative detach */
 		if ((disk_state[OLD] != D_FAILED && disk_state[NEW] == D_FAILED) ||
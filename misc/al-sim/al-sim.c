@@ -0,0 +1,633 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * al-sim - replay a write trace against the DRBD activity log
+ *
+ * Builds the lru_cache of drbd-kernel-compat as is, and models how
+ * drbd_actlog.c and do_submit() in drbd_req.c use it: the fast path for
+ * writes to committed extents, drbd_al_begin_io_nonblock() for the others,
+ * one transaction at a time with all pending changes in it, and the 2Q
+ * replacement policy. Use it to size al-extents for a workload, or to compare
+ * changes to that logic.
+ *
+ * Traces are fio iologs (version 2 or 3) or the default text output of
+ * blkparse, of which "Q" events of writes are used. Without timestamps
+ * (fio version 2), writes are replayed with a fixed queue depth.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include "linux/lru_cache.h"
+
+/* as in drbd_int.h */
+#define AL_EXTENT_SHIFT			22
+#define AL_UPDATES_PER_TRANSACTION	64
+
+enum al_policy_kind {
+	AL_POLICY_LRU,
+	AL_POLICY_2Q,
+};
+
+struct al_extent {
+	struct list_head policy_list;
+	unsigned int policy_enr;
+	bool policy_am;
+	struct lc_element lce;
+};
+
+struct sim_io {
+	double arrival;		/* usec */
+	unsigned long long sector;
+	unsigned int sectors;
+	unsigned int first, last;
+	double started;
+	struct sim_io *next;	/* on one of the queues below */
+};
+
+struct io_queue {
+	struct sim_io *head, **tail;
+};
+
+static struct {
+	unsigned int al_extents;
+	unsigned int extent_shift;
+	enum al_policy_kind policy;
+	unsigned int depth;
+	double data_usec;
+	double md_usec;
+} cfg = {
+	.al_extents = 1237,
+	.extent_shift = AL_EXTENT_SHIFT,
+	.policy = AL_POLICY_LRU,
+	.depth = 32,
+	.data_usec = 100,
+	.md_usec = 500,
+};
+
+static struct lru_cache *al;
+
+/* 2Q, see al_policy_pick_victim() in drbd_actlog.c */
+static struct {
+	struct list_head a1in;
+	struct list_head am;
+	unsigned int a1in_len;
+	struct ghost {
+		struct hlist_node colision;
+		unsigned int enr;
+	} *ghost;
+	struct hlist_head *ghost_slot;
+	unsigned int ghost_size;
+	unsigned int ghost_next;
+} pol;
+
+static struct {
+	double now;
+	unsigned long transactions;
+	unsigned long histogram[AL_UPDATES_PER_TRANSACTION + 1];
+	unsigned int max_active;
+	unsigned long completed;
+	double *stalls;
+	unsigned long n_stalls;
+} stat;
+
+static struct io_queue waiting;		/* arrived, no activity log references */
+static struct io_queue pending;		/* waiting for the next transaction */
+static struct io_queue committing;	/* waiting for the one in flight */
+static bool tr_busy;
+static double tr_done;
+
+/* data writes in flight, a binary heap ordered by completion time */
+static struct {
+	struct sim_io **io;
+	double *done;
+	unsigned long n, size;
+} heap;
+
+static void queue_init(struct io_queue *q)
+{
+	q->head = NULL;
+	q->tail = &q->head;
+}
+
+static void queue_add(struct io_queue *q, struct sim_io *io)
+{
+	io->next = NULL;
+	*q->tail = io;
+	q->tail = &io->next;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+static void heap_push(struct sim_io *io, double done)
+{
+	unsigned long i = heap.n++;
+
+	if (heap.n > heap.size) {
+		heap.size = heap.size ? heap.size * 2 : 64;
+		heap.io = xrealloc(heap.io, heap.size * sizeof(*heap.io));
+		heap.done = xrealloc(heap.done, heap.size * sizeof(*heap.done));
+	}
+	while (i && heap.done[(i - 1) / 2] > done) {
+		heap.io[i] = heap.io[(i - 1) / 2];
+		heap.done[i] = heap.done[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap.io[i] = io;
+	heap.done[i] = done;
+}
+
+static struct sim_io *heap_pop(void)
+{
+	struct sim_io *io = heap.io[0];
+	struct sim_io *last_io = heap.io[--heap.n];
+	double last = heap.done[heap.n];
+	unsigned long i = 0, c;
+
+	while ((c = 2 * i + 1) < heap.n) {
+		if (c + 1 < heap.n && heap.done[c + 1] < heap.done[c])
+			c++;
+		if (heap.done[c] >= last)
+			break;
+		heap.io[i] = heap.io[c];
+		heap.done[i] = heap.done[c];
+		i = c;
+	}
+	heap.io[i] = last_io;
+	heap.done[i] = last;
+	return io;
+}
+
+static void al_policy_init(void)
+{
+	unsigned int i;
+
+	INIT_LIST_HEAD(&pol.a1in);
+	INIT_LIST_HEAD(&pol.am);
+	pol.ghost_size = al->nr_elements / 2 ? al->nr_elements / 2 : 1;
+	pol.ghost = calloc(pol.ghost_size, sizeof(*pol.ghost));
+	pol.ghost_slot = calloc(pol.ghost_size, sizeof(*pol.ghost_slot));
+	if (!pol.ghost || !pol.ghost_slot) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < pol.ghost_size; i++)
+		pol.ghost[i].enr = LC_FREE;
+	for (i = 0; i < al->nr_elements; i++) {
+		struct al_extent *ext = lc_entry(lc_element_by_index(al, i), struct al_extent, lce);
+
+		INIT_LIST_HEAD(&ext->policy_list);
+		ext->policy_enr = LC_FREE;
+	}
+}
+
+static struct hlist_head *al_policy_ghost_slot(unsigned int enr)
+{
+	return pol.ghost_slot + (enr % pol.ghost_size);
+}
+
+static void al_policy_ghost_add(unsigned int enr)
+{
+	struct ghost *g = &pol.ghost[pol.ghost_next];
+
+	hlist_del_init(&g->colision);
+	g->enr = enr;
+	hlist_add_head(&g->colision, al_policy_ghost_slot(enr));
+	pol.ghost_next = (pol.ghost_next + 1) % pol.ghost_size;
+}
+
+static bool al_policy_ghost_remove(unsigned int enr)
+{
+	struct ghost *g;
+
+	hlist_for_each_entry(g, al_policy_ghost_slot(enr), colision) {
+		if (g->enr == enr) {
+			hlist_del_init(&g->colision);
+			g->enr = LC_FREE;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void al_policy_account(struct lc_element *e)
+{
+	struct al_extent *ext = lc_entry(e, struct al_extent, lce);
+
+	if (ext->policy_enr == e->lc_new_number) {
+		if (ext->policy_am)
+			list_move(&ext->policy_list, &pol.am);
+		return;
+	}
+
+	if (ext->policy_enr != LC_FREE && !ext->policy_am)
+		al_policy_ghost_add(ext->policy_enr);
+	if (!ext->policy_am && !list_empty(&ext->policy_list))
+		pol.a1in_len--;
+	list_del_init(&ext->policy_list);
+
+	ext->policy_enr = e->lc_new_number;
+	ext->policy_am = al_policy_ghost_remove(ext->policy_enr);
+	if (ext->policy_am) {
+		list_add(&ext->policy_list, &pol.am);
+	} else {
+		list_add(&ext->policy_list, &pol.a1in);
+		pol.a1in_len++;
+	}
+}
+
+static struct al_extent *al_policy_oldest_unused(struct list_head *queue)
+{
+	struct al_extent *ext, *tmp;
+	LIST_HEAD(busy);
+
+	list_for_each_entry_safe_reverse(ext, tmp, queue, policy_list) {
+		struct lc_element *e = &ext->lce;
+
+		if (e->refcnt == 0 && e->lc_number == e->lc_new_number && e->lc_number != LC_FREE) {
+			list_splice(&busy, queue);
+			return ext;
+		}
+		list_move_tail(&ext->policy_list, &busy);
+	}
+	list_splice(&busy, queue);
+	return NULL;
+}
+
+static void al_policy_pick_victim(unsigned int enr)
+{
+	struct al_extent *victim = NULL;
+
+	if (cfg.policy != AL_POLICY_2Q)
+		return;
+	if (!list_empty(&al->free) || lc_find(al, enr))
+		return;
+
+	if (pol.a1in_len > al->nr_elements / 4)
+		victim = al_policy_oldest_unused(&pol.a1in);
+	if (!victim)
+		victim = al_policy_oldest_unused(&pol.am);
+	if (!victim)
+		victim = al_policy_oldest_unused(&pol.a1in);
+	if (victim)
+		list_move_tail(&victim->lce.list, &al->lru);
+}
+
+/* drbd_al_begin_io_fastpath() */
+static bool al_begin_io_fastpath(struct sim_io *io)
+{
+	struct lc_element *e;
+
+	if (io->first != io->last)
+		return false;
+	e = lc_try_get(al, io->first);
+	if (e)
+		al_policy_account(e);
+	return e != NULL;
+}
+
+/* drbd_al_begin_io_nonblock() */
+static bool al_begin_io_nonblock(struct sim_io *io)
+{
+	unsigned int nr = 1 + io->last - io->first;
+	unsigned int available;
+	unsigned int enr;
+
+	available = al->nr_elements - al->used;
+	if (al->max_pending_changes - al->pending_changes < available)
+		available = al->max_pending_changes - al->pending_changes;
+	if (available < nr) {
+		if (!al->pending_changes)
+			set_bit(__LC_STARVING, &al->flags);
+		return false;
+	}
+
+	for (enr = io->first; enr <= io->last; enr++) {
+		struct lc_element *e;
+
+		al_policy_pick_victim(enr);
+		e = lc_get_cumulative(al, enr);
+		if (!e) {
+			fprintf(stderr, "LOGIC BUG for enr=%u\n", enr);
+			exit(1);
+		}
+		al_policy_account(e);
+	}
+	return true;
+}
+
+static void submit_data(struct sim_io *io)
+{
+	io->started = stat.now;
+	stat.stalls[stat.n_stalls++] = io->started - io->arrival;
+	heap_push(io, stat.now + cfg.data_usec);
+}
+
+static void count_active(void)
+{
+	unsigned int i, active = 0;
+
+	for (i = 0; i < al->nr_elements; i++) {
+		if (lc_element_by_index(al, i)->lc_number != LC_FREE)
+			active++;
+	}
+	if (active > stat.max_active)
+		stat.max_active = active;
+}
+
+/* The part of do_submit() that deals with the activity log */
+static void do_submit(void)
+{
+	struct sim_io *io, **pp = &waiting.head;
+
+	while ((io = *pp)) {
+		bool got = al_begin_io_fastpath(io);
+
+		if (!got && !tr_busy && al_begin_io_nonblock(io)) {
+			*pp = io->next;
+			if (!*pp)
+				waiting.tail = pp;
+			if (al->pending_changes)
+				queue_add(&pending, io);
+			else
+				submit_data(io);
+			continue;
+		}
+		if (got) {
+			*pp = io->next;
+			if (!*pp)
+				waiting.tail = pp;
+			submit_data(io);
+			continue;
+		}
+		pp = &io->next;
+	}
+
+	/* drbd_al_begin_io_commit(): one transaction with all pending changes */
+	if (!tr_busy && pending.head) {
+		if (!lc_try_lock_for_transaction(al)) {
+			fprintf(stderr, "activity log locked\n");
+			exit(1);
+		}
+		stat.histogram[al->pending_changes > AL_UPDATES_PER_TRANSACTION ?
+			       AL_UPDATES_PER_TRANSACTION : al->pending_changes]++;
+		stat.transactions++;
+		committing = pending;
+		if (committing.tail == &pending.head)
+			committing.tail = &committing.head;
+		queue_init(&pending);
+		tr_busy = true;
+		tr_done = stat.now + cfg.md_usec;
+	}
+}
+
+static void transaction_done(void)
+{
+	struct sim_io *io, *next;
+
+	lc_committed(al);
+	lc_unlock(al);
+	tr_busy = false;
+	count_active();
+	for (io = committing.head; io; io = next) {
+		next = io->next;
+		submit_data(io);
+	}
+	queue_init(&committing);
+}
+
+static void io_done(struct sim_io *io)
+{
+	unsigned int enr;
+
+	for (enr = io->first; enr <= io->last; enr++)
+		lc_put(al, lc_find(al, enr));
+	stat.completed++;
+}
+
+static int parse_trace(FILE *f, struct sim_io **ios, unsigned long *n_ios, bool *timed)
+{
+	unsigned long size = 0;
+	char line[512];
+	int fio_version = 0;
+
+	*ios = NULL;
+	*n_ios = 0;
+	*timed = true;
+	if (fgets(line, sizeof(line), f) && sscanf(line, "fio version %d iolog", &fio_version) != 1)
+		rewind(f);
+	if (fio_version == 2)
+		*timed = false;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long offset, sector;
+		unsigned int length;
+		char action[32], rwbs[16];
+		double t = 0;
+		struct sim_io *io;
+
+		if (fio_version == 2) {
+			if (sscanf(line, "%*s %31s %llu %u", action, &offset, &length) != 3 ||
+			    strcmp(action, "write"))
+				continue;
+		} else if (fio_version == 3) {
+			if (sscanf(line, "%lf %*s %31s %llu %u", &t, action, &offset, &length) != 4 ||
+			    strcmp(action, "write"))
+				continue;
+			t *= 1000;
+		} else {
+			if (sscanf(line, "%*s %*d %*u %lf %*u %31s %15s %llu + %u",
+				   &t, action, rwbs, &sector, &length) != 5 ||
+			    strcmp(action, "Q") || !strchr(rwbs, 'W'))
+				continue;
+			t *= 1000000;
+			offset = sector << 9;
+			length <<= 9;
+		}
+		if (!length)
+			continue;
+
+		if (*n_ios == size) {
+			size = size ? size * 2 : 4096;
+			*ios = xrealloc(*ios, size * sizeof(**ios));
+		}
+		io = &(*ios)[(*n_ios)++];
+		io->arrival = t;
+		io->sector = offset >> 9;
+		io->sectors = (length + 511) >> 9;
+		io->first = io->sector >> (cfg.extent_shift - 9);
+		io->last = (io->sector + io->sectors - 1) >> (cfg.extent_shift - 9);
+	}
+	return ferror(f) ? -EIO : 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(struct sim_io *ios, unsigned long n_ios)
+{
+	struct seq_file seq = { .file = stdout };
+	double duration = stat.now - (n_ios ? ios[0].arrival : 0);
+	unsigned long long extent_kb = 1ULL << (cfg.extent_shift - 10);
+	double sum = 0;
+	unsigned long i;
+
+	for (i = 0; i < stat.n_stalls; i++)
+		sum += stat.stalls[i];
+	qsort(stat.stalls, stat.n_stalls, sizeof(*stat.stalls), cmp_double);
+
+	printf("writes:              %lu in %.3f s\n", n_ios, duration / 1000000);
+	printf("al transactions:     %lu (%.1f/s, %.2f writes each)\n", stat.transactions,
+	       duration > 0 ? stat.transactions * 1000000 / duration : 0,
+	       stat.transactions ? (double)n_ios / stat.transactions : 0);
+	if (stat.n_stalls) {
+		printf("al stall (usec):     mean %.1f  p50 %.1f  p99 %.1f  max %.1f\n",
+		       sum / stat.n_stalls,
+		       stat.stalls[stat.n_stalls / 2],
+		       stat.stalls[(unsigned long)floor(0.99 * (stat.n_stalls - 1))],
+		       stat.stalls[stat.n_stalls - 1]);
+	}
+	printf("resync after crash:  up to %u extents, %llu MiB\n", stat.max_active,
+	       stat.max_active * extent_kb >> 10);
+	printf("al_histogram (updates per transaction: transactions)\n");
+	for (i = 0; i <= AL_UPDATES_PER_TRANSACTION; i++) {
+		if (stat.histogram[i])
+			printf("\t%2lu: %lu\n", i, stat.histogram[i]);
+	}
+	lc_seq_printf_stats(&seq, al);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <trace>\n"
+		"  -e <n>     al-extents (default %u)\n"
+		"  -s <MiB>   activity log extent size: 4, 16 or 64 (default 4)\n"
+		"  -p <name>  replacement policy: lru or 2q (default lru)\n"
+		"  -q <n>     queue depth for traces without timestamps (default %u)\n"
+		"  -d <usec>  latency of a data write (default %.0f)\n"
+		"  -m <usec>  latency of an activity log transaction (default %.0f)\n",
+		prog, cfg.al_extents, cfg.depth, cfg.data_usec, cfg.md_usec);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct kmem_cache *cache;
+	struct sim_io *ios;
+	unsigned long n_ios, next = 0;
+	unsigned int mb;
+	bool timed;
+	FILE *f;
+	int c;
+
+	while ((c = getopt(argc, argv, "e:s:p:q:d:m:h")) != -1) {
+		switch (c) {
+		case 'e':
+			cfg.al_extents = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			mb = strtoul(optarg, NULL, 0);
+			if (mb != 4 && mb != 16 && mb != 64)
+				usage(argv[0]);
+			cfg.extent_shift = 20 + __builtin_ctz(mb);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "lru"))
+				cfg.policy = AL_POLICY_LRU;
+			else if (!strcmp(optarg, "2q"))
+				cfg.policy = AL_POLICY_2Q;
+			else
+				usage(argv[0]);
+			break;
+		case 'q':
+			cfg.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.data_usec = strtod(optarg, NULL);
+			break;
+		case 'm':
+			cfg.md_usec = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || !cfg.al_extents || !cfg.depth)
+		usage(argv[0]);
+
+	f = fopen(argv[optind], "r");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (parse_trace(f, &ios, &n_ios, &timed)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	fclose(f);
+
+	/* as drbd_check_al_size() */
+	cache = kmem_cache_create("al", sizeof(struct al_extent), 0, 0, NULL);
+	al = lc_create("act_log", cache,
+		       AL_UPDATES_PER_TRANSACTION >> (cfg.extent_shift - AL_EXTENT_SHIFT),
+		       cfg.al_extents, sizeof(struct al_extent),
+		       offsetof(struct al_extent, lce));
+	stat.stalls = malloc((n_ios ? n_ios : 1) * sizeof(*stat.stalls));
+	if (!cache || !al || !stat.stalls) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	al_policy_init();
+	queue_init(&waiting);
+	queue_init(&pending);
+	queue_init(&committing);
+	if (n_ios && timed)
+		stat.now = ios[0].arrival;
+
+	for (;;) {
+		unsigned long in_system = next - stat.completed;
+		double t_arrival = INFINITY, t_io = heap.n ? heap.done[0] : INFINITY;
+		double t_tr = tr_busy ? tr_done : INFINITY;
+
+		if (next < n_ios) {
+			if (timed)
+				t_arrival = ios[next].arrival;
+			else if (in_system < cfg.depth)
+				t_arrival = stat.now;
+		}
+
+		if (t_tr <= t_io && t_tr <= t_arrival && t_tr != INFINITY) {
+			stat.now = t_tr;
+			transaction_done();
+		} else if (t_io <= t_arrival && t_io != INFINITY) {
+			stat.now = t_io;
+			io_done(heap_pop());
+		} else if (t_arrival != INFINITY) {
+			stat.now = t_arrival;
+			ios[next].arrival = stat.now;
+			queue_add(&waiting, &ios[next++]);
+		} else {
+			break;
+		}
+		do_submit();
+	}
+
+	if (waiting.head) {
+		fprintf(stderr, "writes left waiting, al-extents too small?\n");
+		return 1;
+	}
+	report(ios, n_ios);
+	return 0;
+}